@@ -0,0 +1,289 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/S3Client.h>
+#include <aws/s3/model/GetObjectAclRequest.h>
+#include <aws/s3/model/PutObjectAclRequest.h>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include "acl_grants.h"
+#include "acl_headers.h"
+#include "acl_verify.h"
+#include "concurrency_controller.h"
+#include "latency_metrics.h"
+#include "request_hedger.h"
+#include "request_trace.h"
+
+/**
+ * Called once when an asynchronous ACL update has finished
+ */
+using AclApplyCallback =
+    std::function<void(const Aws::String& object_name, AclApplyResult result)>;
+
+/**
+ * Result of an update that failed with error
+ */
+inline AclApplyResult FailedResult(const Aws::Client::AWSError<Aws::S3::S3Errors>& error)
+{
+    return IsThrottlingError(error) ? AclApplyResult::Throttled
+        : AclApplyResult::Failed;
+}
+
+/**
+ * State of one asynchronous object ACL update, shared by its continuations
+ */
+struct ObjectAclUpdate
+{
+    Aws::String bucket_name;
+    Aws::String object_name;
+    Aws::String grantee_id;
+    Aws::S3::Model::Permission permission;
+    AclVerifier* verifier;
+    AclApplyCallback on_finished;
+    TraceLog::Clock::time_point started = TraceLog::Clock::now();
+
+    void Finish(AclApplyResult result)
+    {
+        if (Trace().Enabled())
+            Trace().AsyncSpan("SetAclForObject", "acl", Trace().NextId(), started,
+                TraceLog::Clock::now(), object_name);
+        if (on_finished)
+            on_finished(object_name, result);
+    }
+};
+
+/**
+ * Handle the PutObjectAcl response of an update: report it, or verify it
+ * first according to the update's verifier
+ */
+inline void FinishObjectAclPut(const Aws::S3::S3Client& s3_client,
+    const std::shared_ptr<ObjectAclUpdate>& update,
+    const Aws::S3::Model::PutObjectAclOutcome& put_outcome)
+{
+    if (!put_outcome.IsSuccess())
+    {
+        auto& error = put_outcome.GetError();
+        std::cout << "PutObjectAcl error: " << update->object_name
+            << ": " << error.GetExceptionName() << " - "
+            << error.GetMessage() << std::endl;
+        update->Finish(FailedResult(error));
+        return;
+    }
+
+    AclVerifier* verifier = update->verifier;
+    if (!verifier || !verifier->Policy().ShouldVerify())
+    {
+        update->Finish(AclApplyResult::Applied);
+        return;
+    }
+
+    if (verifier->Policy().GetMode() == AclVerifyPolicy::Mode::All)
+    {
+        verifier->VerifyObjectAsync(s3_client, update->bucket_name,
+            update->object_name, update->grantee_id, update->permission,
+            [update](bool verified)
+        {
+            update->Finish(verified ? AclApplyResult::Applied
+                : AclApplyResult::Failed);
+        });
+        return;
+    }
+
+    // Sampled: verify off the critical path. The verification is started
+    // first so that it is pending before the caller learns the update has
+    // finished.
+    verifier->VerifyObjectAsync(s3_client, update->bucket_name,
+        update->object_name, update->grantee_id, update->permission);
+    update->Finish(AclApplyResult::Applied);
+}
+
+/**
+ * Asynchronously grant permission on an object
+ *
+ * The GET -> merge -> PUT (-> verify) cycle of SetAclForObject() runs as a
+ * chain of SDK callbacks: each response handler builds and starts the next
+ * request and returns, so neither the caller nor an executor thread waits
+ * between steps. on_finished is called exactly once, on an executor thread,
+ * with Skipped if the grant was already present.
+ *
+ * verifier (optional) decides whether the update is read back. Under the
+ * All policy on_finished waits for the verification; under Sampled it is
+ * called as soon as the PUT succeeds and a mismatch is only counted by the
+ * verifier.
+ *
+ * hedger (optional) hedges the GetObjectAcl; see SendHedged().
+ *
+ * s3_client, verifier and hedger must outlive the update.
+ */
+inline void SetAclForObjectAsync(const Aws::S3::S3Client& s3_client,
+    const Aws::String& bucket_name,
+    const Aws::String& object_name,
+    const Aws::String& grantee_id,
+    Aws::S3::Model::Permission permission,
+    AclVerifier* verifier,
+    AclApplyCallback on_finished,
+    RequestHedger* hedger = nullptr)
+{
+    auto update = Aws::MakeShared<ObjectAclUpdate>("SetAclForObjectAsync");
+    update->bucket_name = bucket_name;
+    update->object_name = object_name;
+    update->grantee_id = grantee_id;
+    update->permission = permission;
+    update->verifier = verifier;
+    update->on_finished = std::move(on_finished);
+
+    Aws::S3::Model::GetObjectAclRequest get_request;
+    get_request.SetBucket(bucket_name);
+    get_request.SetKey(object_name);
+
+    // A hedged read may be sent twice, so its copies are not hooked: it is
+    // traced as one span from the call to the answer
+    auto get_trace = RequestTrace::Start(hedger ? "GetObjectAclHedged" : "GetObjectAcl",
+        object_name);
+    if (!hedger)
+        RequestTrace::Attach(get_trace, get_request);
+
+    auto on_get = [update, client = &s3_client, started = LatencyMetrics::Clock::now(),
+        get_trace](const Aws::S3::Model::GetObjectAclOutcome& get_outcome)
+    {
+        RequestTraceCallback trace_callback(get_trace);
+        Metrics().Record(S3Operation::GetObjectAcl, started, get_outcome);
+        if (!get_outcome.IsSuccess())
+        {
+            auto& error = get_outcome.GetError();
+            std::cout << "Original GetObjectAcl error: " << update->object_name
+                << ": " << error.GetExceptionName() << " - "
+                << error.GetMessage() << std::endl;
+            update->Finish(FailedResult(error));
+            return;
+        }
+
+        // The outcome is a temporary owned by the SDK task and is not used
+        // after this handler returns, so its grants can be moved out
+        auto& result = Mutable(get_outcome.GetResult());
+        if (HasGrant(result.GetGrants(), update->grantee_id, update->permission))
+        {
+            update->Finish(AclApplyResult::Skipped);
+            return;
+        }
+
+        Aws::S3::Model::PutObjectAclRequest put_request;
+        put_request.SetAccessControlPolicy(MakeUpdatedPolicy(result,
+            MakeGrant(update->grantee_id, update->permission)));
+        put_request.SetBucket(update->bucket_name);
+        put_request.SetKey(update->object_name);
+        auto put_trace = RequestTrace::Start("PutObjectAcl", update->object_name);
+        RequestTrace::Attach(put_trace, put_request);
+
+        client->PutObjectAclAsync(put_request,
+            [update, started = LatencyMetrics::Clock::now(), put_trace](
+                const Aws::S3::S3Client* client,
+                const Aws::S3::Model::PutObjectAclRequest&,
+                const Aws::S3::Model::PutObjectAclOutcome& put_outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            RequestTraceCallback trace_callback(put_trace);
+            Metrics().Record(S3Operation::PutObjectAcl, started, put_outcome);
+            FinishObjectAclPut(*client, update, put_outcome);
+        });
+    };
+
+    if (hedger)
+    {
+        SendHedged<Aws::S3::Model::GetObjectAclRequest,
+            Aws::S3::Model::GetObjectAclOutcome>(*hedger, get_request,
+                GetObjectAclStarter(s3_client), on_get);
+        return;
+    }
+    s3_client.GetObjectAclAsync(get_request,
+        [on_get](const Aws::S3::S3Client*,
+            const Aws::S3::Model::GetObjectAclRequest&,
+            const Aws::S3::Model::GetObjectAclOutcome& get_outcome,
+            const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+    {
+        on_get(get_outcome);
+    });
+}
+
+/**
+ * Asynchronously grant permission on an object that has the default ACL,
+ * with a single header-only PutObjectAcl
+ *
+ * No GetObjectAcl is sent: the PUT carries a canned ACL or x-amz-grant-*
+ * headers planned by PlanHeaderAcl() from the object's owner (as returned
+ * by ListObjectsV2 with FetchOwner) and replaces the ACL outright, so it
+ * must only be used when the object is known to have the default ACL.
+ * An object whose owner is not known is updated by SetAclForObjectAsync()
+ * instead, its GetObjectAcl hedged by hedger if there is one. on_finished
+ * is called as for SetAclForObjectAsync(), except when the plan leaves
+ * nothing to send: then it is called with Skipped on the calling thread,
+ * before this function returns.
+ */
+inline void SetAclForObjectHeadersAsync(const Aws::S3::S3Client& s3_client,
+    const Aws::String& bucket_name,
+    const Aws::String& object_name,
+    const Aws::String& owner_id,
+    const Aws::String& bucket_owner_id,
+    const Aws::String& grantee_id,
+    Aws::S3::Model::Permission permission,
+    AclVerifier* verifier,
+    AclApplyCallback on_finished,
+    RequestHedger* hedger = nullptr)
+{
+    const HeaderAcl plan = PlanHeaderAcl(owner_id, bucket_owner_id, grantee_id,
+        ToPermissionMask(permission));
+    if (plan.kind == HeaderAcl::Kind::Skip)
+    {
+        if (on_finished)
+            on_finished(object_name, AclApplyResult::Skipped);
+        return;
+    }
+    if (plan.kind == HeaderAcl::Kind::NoOwner)
+    {
+        SetAclForObjectAsync(s3_client, bucket_name, object_name, grantee_id, permission,
+            verifier, std::move(on_finished), hedger);
+        return;
+    }
+
+    auto update = Aws::MakeShared<ObjectAclUpdate>("SetAclForObjectHeadersAsync");
+    update->bucket_name = bucket_name;
+    update->object_name = object_name;
+    update->grantee_id = grantee_id;
+    update->permission = permission;
+    update->verifier = verifier;
+    update->on_finished = std::move(on_finished);
+
+    Aws::S3::Model::PutObjectAclRequest put_request;
+    ApplyHeaderAcl(plan, put_request);
+    put_request.SetBucket(bucket_name);
+    put_request.SetKey(object_name);
+    auto put_trace = RequestTrace::Start("PutObjectAcl", object_name);
+    RequestTrace::Attach(put_trace, put_request);
+
+    s3_client.PutObjectAclAsync(put_request,
+        [update, started = LatencyMetrics::Clock::now(), put_trace](
+            const Aws::S3::S3Client* client,
+            const Aws::S3::Model::PutObjectAclRequest&,
+            const Aws::S3::Model::PutObjectAclOutcome& put_outcome,
+            const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+    {
+        RequestTraceCallback trace_callback(put_trace);
+        Metrics().Record(S3Operation::PutObjectAcl, started, put_outcome);
+        FinishObjectAclPut(*client, update, put_outcome);
+    });
+}
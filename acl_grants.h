@@ -0,0 +1,163 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/model/AccessControlPolicy.h>
+#include <aws/s3/model/Grant.h>
+#include <aws/s3/model/Grantee.h>
+#include <aws/s3/model/Permission.h>
+#include <atomic>
+#include <utility>
+#include "acl_permissions.h"
+
+/**
+ * Access a member of an SDK result through its const getter for modification
+ *
+ * The result classes only expose const getters, but a result held in a
+ * non-const Outcome is owned by the caller, so moving out of it is safe.
+ */
+template <typename T>
+T& Mutable(const T& value)
+{
+    return const_cast<T&>(value);
+}
+
+/**
+ * Move the grants of a GetBucketAclResult or GetObjectAclResult into a
+ * vector ready to be sent back in an AccessControlPolicy
+ *
+ * No grant, grantee or string is copied. The grantee type, which PUT
+ * requires, is filled in where the response did not carry it. Room is
+ * reserved for extra_grants more grants so that appending them does not
+ * reallocate. The result is left without grants.
+ */
+template <typename AclResult>
+Aws::Vector<Aws::S3::Model::Grant> TakeGrants(AclResult& result,
+    size_t extra_grants = 1)
+{
+    Aws::Vector<Aws::S3::Model::Grant> grants =
+        std::move(Mutable(result.GetGrants()));
+    grants.reserve(grants.size() + extra_grants);
+
+    for (auto& grant : grants)
+    {
+        auto& grantee = Mutable(grant.GetGrantee());
+        if (!grantee.TypeHasBeenSet())
+        {
+            if (!grantee.GetURI().empty())
+                grantee.SetType(Aws::S3::Model::Type::Group);
+            else if (!grantee.GetEmailAddress().empty())
+                grantee.SetType(Aws::S3::Model::Type::AmazonCustomerByEmail);
+            else
+                grantee.SetType(Aws::S3::Model::Type::CanonicalUser);
+        }
+    }
+    return grants;
+}
+
+/**
+ * Build a grant of permission to the canonical user grantee_id
+ */
+inline Aws::S3::Model::Grant MakeGrant(const Aws::String& grantee_id,
+    Aws::S3::Model::Permission permission)
+{
+    Aws::S3::Model::Grantee grantee;
+    grantee.SetID(grantee_id);
+    grantee.SetType(Aws::S3::Model::Type::CanonicalUser);
+
+    Aws::S3::Model::Grant grant;
+    grant.SetGrantee(std::move(grantee));
+    grant.SetPermission(permission);
+    return grant;
+}
+
+/**
+ * Turn a GetBucketAclResult or GetObjectAclResult into an
+ * AccessControlPolicy with new_grant appended, moving everything out of
+ * the result
+ */
+template <typename AclResult>
+Aws::S3::Model::AccessControlPolicy MakeUpdatedPolicy(AclResult& result,
+    Aws::S3::Model::Grant&& new_grant)
+{
+    Aws::S3::Model::AccessControlPolicy acp;
+    acp.SetOwner(std::move(Mutable(result.GetOwner())));
+
+    Aws::Vector<Aws::S3::Model::Grant> grants = TakeGrants(result);
+    grants.push_back(std::move(new_grant));
+    acp.SetGrants(std::move(grants));
+    return acp;
+}
+
+/**
+ * Whether grants already give the canonical user grantee_id permission,
+ * either directly or through FULL_CONTROL
+ *
+ * When it does, sending the new grant would change nothing but add a
+ * duplicate toward the 100-grant limit, so the PUT can be skipped. NOT_SET
+ * is never granted, rather than always, so that it cannot skip every PUT.
+ */
+inline bool HasGrant(const Aws::Vector<Aws::S3::Model::Grant>& grants,
+    const Aws::String& grantee_id,
+    Aws::S3::Model::Permission permission)
+{
+    const PermissionMask wanted = ToPermissionMask(permission);
+    return wanted != PERMISSION_NONE &&
+        CoversPermissions(GranteePermissions(grants, grantee_id), wanted);
+}
+
+/**
+ * Outcome of applying a grant to a bucket or object
+ */
+enum class AclApplyResult
+{
+    Applied,    // The ACL was updated
+    Skipped,    // The grant was already present; nothing was sent
+    Failed,     // A request failed
+    Throttled   // A request failed because it was throttled (503 SlowDown)
+};
+
+/**
+ * Running totals of AclApplyResult values, safe to update from many threads
+ */
+struct AclApplyCounts
+{
+    std::atomic<size_t> applied{0};
+    std::atomic<size_t> skipped{0};
+    std::atomic<size_t> failed{0};
+    std::atomic<size_t> throttled{0};
+
+    void Add(AclApplyResult result)
+    {
+        switch (result)
+        {
+        case AclApplyResult::Applied:
+            ++applied;
+            break;
+        case AclApplyResult::Skipped:
+            ++skipped;
+            break;
+        case AclApplyResult::Failed:
+            ++failed;
+            break;
+        case AclApplyResult::Throttled:
+            ++throttled;
+            break;
+        }
+    }
+
+    size_t Total() const { return applied + skipped + failed + throttled; }
+};
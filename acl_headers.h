@@ -0,0 +1,150 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/model/ObjectCannedACL.h>
+#include <aws/s3/model/PutObjectAclRequest.h>
+#include "acl_permissions.h"
+
+/**
+ * Header-only form of an ACL: a canned ACL or x-amz-grant-* headers
+ *
+ * A PUT that carries either replaces the whole ACL without an XML body, so
+ * it can be sent without reading the current ACL first, but only when the
+ * full resulting ACL is known. HeaderAcl is planned for a resource that has
+ * the default ACL (its owner holds FULL_CONTROL and nothing else) and must
+ * end up with that plus one more grant.
+ */
+struct HeaderAcl
+{
+    enum class Kind
+    {
+        Skip,       // The grant is already implied; send nothing
+        Canned,     // Send canned_acl
+        Grants,     // Send the grant headers
+        NoOwner     // The owner is unknown, so the headers cannot restate its
+                    // grant; read and modify the ACL instead
+    };
+
+    Kind kind = Kind::Skip;
+    Aws::S3::Model::ObjectCannedACL canned_acl = Aws::S3::Model::ObjectCannedACL::NOT_SET;
+
+    // Values of x-amz-grant-full-control, -read, -write, -read-acp and
+    // -write-acp, e.g. id="79a59df9...", id="0f5c3a8e..."
+    Aws::String grant_full_control;
+    Aws::String grant_read;
+    Aws::String grant_write;
+    Aws::String grant_read_acp;
+    Aws::String grant_write_acp;
+};
+
+inline void AddGrantHeaderValue(Aws::String& header, const Aws::String& canonical_id)
+{
+    if (!header.empty())
+        header += ", ";
+    header += "id=\"";
+    header += canonical_id;
+    header += "\"";
+}
+
+/**
+ * Plan the header-only PUT that turns the default ACL of a resource owned
+ * by owner_id into that ACL plus permission for grantee_id
+ *
+ * For objects, bucket_owner_id (optional) enables the
+ * bucket-owner-read/bucket-owner-full-control canned ACLs. An empty
+ * owner_id (ListObjectsV2 without FetchOwner, or an owner it did not
+ * return) plans NoOwner: headers without the owner's grant would take
+ * FULL_CONTROL away from it.
+ */
+inline HeaderAcl PlanHeaderAcl(const Aws::String& owner_id,
+    const Aws::String& bucket_owner_id,
+    const Aws::String& grantee_id,
+    PermissionMask permission)
+{
+    HeaderAcl plan;
+    if (owner_id.empty())
+    {
+        plan.kind = HeaderAcl::Kind::NoOwner;
+        return plan;
+    }
+
+    // The owner already holds FULL_CONTROL
+    if (grantee_id == owner_id || permission == PERMISSION_NONE)
+        return plan;
+
+    if (!bucket_owner_id.empty() && grantee_id == bucket_owner_id)
+    {
+        if (permission == PERMISSION_FULL_CONTROL)
+        {
+            plan.kind = HeaderAcl::Kind::Canned;
+            plan.canned_acl = Aws::S3::Model::ObjectCannedACL::bucket_owner_full_control;
+            return plan;
+        }
+        if (permission == PERMISSION_READ)
+        {
+            plan.kind = HeaderAcl::Kind::Canned;
+            plan.canned_acl = Aws::S3::Model::ObjectCannedACL::bucket_owner_read;
+            return plan;
+        }
+    }
+
+    // The headers replace the ACL, so the owner's grant is restated
+    plan.kind = HeaderAcl::Kind::Grants;
+    AddGrantHeaderValue(plan.grant_full_control, owner_id);
+    if (permission & PERMISSION_FULL_CONTROL)
+        AddGrantHeaderValue(plan.grant_full_control, grantee_id);
+    if (permission & PERMISSION_READ)
+        AddGrantHeaderValue(plan.grant_read, grantee_id);
+    if (permission & PERMISSION_WRITE)
+        AddGrantHeaderValue(plan.grant_write, grantee_id);
+    if (permission & PERMISSION_READ_ACP)
+        AddGrantHeaderValue(plan.grant_read_acp, grantee_id);
+    if (permission & PERMISSION_WRITE_ACP)
+        AddGrantHeaderValue(plan.grant_write_acp, grantee_id);
+    return plan;
+}
+
+/**
+ * Set the grant headers of a PutObjectAclRequest
+ */
+template <typename PutAclRequest>
+void SetGrantHeaders(const HeaderAcl& plan, PutAclRequest& put_request)
+{
+    if (!plan.grant_full_control.empty())
+        put_request.SetGrantFullControl(plan.grant_full_control);
+    if (!plan.grant_read.empty())
+        put_request.SetGrantRead(plan.grant_read);
+    if (!plan.grant_write.empty())
+        put_request.SetGrantWrite(plan.grant_write);
+    if (!plan.grant_read_acp.empty())
+        put_request.SetGrantReadACP(plan.grant_read_acp);
+    if (!plan.grant_write_acp.empty())
+        put_request.SetGrantWriteACP(plan.grant_write_acp);
+}
+
+/**
+ * Fill in a header-only PutObjectAclRequest; plan.kind must be Canned or
+ * Grants
+ */
+inline void ApplyHeaderAcl(const HeaderAcl& plan,
+    Aws::S3::Model::PutObjectAclRequest& put_request)
+{
+    if (plan.kind == HeaderAcl::Kind::Canned)
+        put_request.SetACL(plan.canned_acl);
+    else
+        SetGrantHeaders(plan, put_request);
+}
@@ -0,0 +1,498 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Crash-safe checkpoint/resume journal of a bulk ACL job
+ *
+ * The journal is an append-only file, written through a shared memory
+ * mapping, of these records:
+ *
+ *   Job         identifies the job (bucket, prefix, grant); first record
+ *   Completed   64-bit hash of a key whose update has finished, and the
+ *               ordinal of the listing page it came from
+ *   Failed      ordinal of the listing page of a key whose update has
+ *               failed, and the key; a later Completed record of the key
+ *               cancels it
+ *   Checkpoint  ordinal of the page a continuation token lists, and the
+ *               token, from which listing resumes: every key on the pages
+ *               before it has finished or failed
+ *   Listed      every listing page has closed; only the failed keys are
+ *               left
+ *   Finished    the whole job has finished
+ *
+ * Each record is [payload length:4][checksum:4][type:1][payload], so a
+ * record torn by a crash fails its checksum and ends the log. Records are
+ * copied into the mapping under a short lock, where they survive a crash of
+ * the process; a background thread msyncs them to disk in batches every
+ * flush_interval, so they also survive a crash of the machine without each
+ * record costing a synchronous write. The msync runs outside the lock, so
+ * appends never wait for the disk, and a mapping replaced when the file
+ * grows is unmapped only once no msync still uses it.
+ *
+ * On reopening, only the Completed records of the last checkpointed page
+ * and later ones are kept in memory: those are the finished keys listing
+ * will meet again. A key can finish before the checkpoint of an earlier
+ * page is written, since keys of several pages are in flight at once, so
+ * records are dropped by their page rather than by their position. Failed
+ * keys are kept whole, so that a rerun can retry them without listing
+ * their pages again.
+ */
+class AclJournal
+{
+public:
+    AclJournal() = default;
+
+    ~AclJournal()
+    {
+        Close();
+    }
+
+    AclJournal(const AclJournal&) = delete;
+    AclJournal& operator=(const AclJournal&) = delete;
+
+    /**
+     * Open or create the journal at path for the job described by job_id
+     *
+     * Fails if the file cannot be opened or belongs to a different job.
+     */
+    bool Open(const std::string& path, const Aws::String& job_id,
+        std::chrono::milliseconds flush_interval = std::chrono::milliseconds(100))
+    {
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_fd < 0)
+        {
+            std::cout << "Journal error: cannot open " << path << ": "
+                << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        struct stat file_stat;
+        if (::fstat(m_fd, &file_stat) != 0 || !Map(std::max<size_t>(
+            static_cast<size_t>(file_stat.st_size), INITIAL_SIZE)))
+        {
+            std::cout << "Journal error: cannot map " << path << ": "
+                << std::strerror(errno) << std::endl;
+            ::close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+
+        Load();
+        if (m_end == 0)
+            Append(RECORD_JOB, job_id.c_str(), job_id.size());
+        else if (m_job_id != job_id)
+        {
+            std::cout << "Journal error: " << path << " belongs to another job ("
+                << m_job_id << ")" << std::endl;
+            Close();
+            return false;
+        }
+        m_synced = m_end;
+
+        m_flush_interval = flush_interval;
+        m_stop = false;
+        m_flusher = std::thread([this]() { FlushLoop(); });
+        return true;
+    }
+
+    /**
+     * Whether the journal already held progress of this job when opened
+     */
+    bool Resuming() const
+    {
+        return !m_resume_token.empty() || !m_completed.empty() || !m_failed.empty() ||
+            m_listed || m_finished;
+    }
+
+    /**
+     * Continuation token to resume listing from (empty: from the start)
+     */
+    const Aws::String& ResumeToken() const { return m_resume_token; }
+
+    /**
+     * Ordinal of the page ResumeToken() lists; page ordinals go on from it
+     */
+    std::uint64_t ResumePage() const { return m_resume_page; }
+
+    /**
+     * Whether every listing page had closed; then only FailedKeys() are left
+     */
+    bool JobListed() const { return m_listed; }
+
+    /**
+     * Whether the job had already finished
+     */
+    bool JobFinished() const { return m_finished; }
+
+    /**
+     * A key whose update failed in a previous run
+     */
+    struct FailedKey
+    {
+        Aws::String key;
+        std::uint64_t page;
+    };
+
+    /**
+     * The failed keys a rerun must retry: those on the pages before
+     * ResumePage(), which listing will not meet again, or all of them once
+     * the job is listed
+     */
+    std::vector<FailedKey> FailedKeys() const
+    {
+        std::vector<FailedKey> failed;
+        for (auto& entry : m_failed)
+            if (m_listed || entry.second.page < m_resume_page)
+                failed.push_back(entry.second);
+        return failed;
+    }
+
+    /**
+     * Whether key, on a page from ResumePage() on, finished in a previous run
+     */
+    bool IsCompleted(const Aws::String& key) const
+    {
+        return m_completed.count(HashKey(key)) != 0;
+    }
+
+    size_t ResumedCompletedCount() const { return m_completed.size(); }
+
+    /**
+     * Record that key, listed on page page, has finished
+     */
+    void RecordCompleted(const Aws::String& key, std::uint64_t page)
+    {
+        std::uint64_t payload[2] = { HashKey(key), page };
+        Append(RECORD_COMPLETED, payload, sizeof(payload));
+    }
+
+    /**
+     * Record that key, listed on page page, has failed
+     */
+    void RecordFailed(const Aws::String& key, std::uint64_t page)
+    {
+        Aws::String payload(sizeof(page), '\0');
+        std::memcpy(&payload[0], &page, sizeof(page));
+        payload += key;
+        Append(RECORD_FAILED, payload.c_str(), payload.size());
+    }
+
+    /**
+     * Record that every key on the pages before next_page has finished or
+     * failed; next_token lists next_page
+     */
+    void RecordCheckpoint(const Aws::String& next_token, std::uint64_t next_page)
+    {
+        Aws::String payload(sizeof(next_page), '\0');
+        std::memcpy(&payload[0], &next_page, sizeof(next_page));
+        payload += next_token;
+        Append(RECORD_CHECKPOINT, payload.c_str(), payload.size());
+    }
+
+    /**
+     * Record that every listing page has closed, with failed keys left
+     */
+    void RecordListed()
+    {
+        Append(RECORD_LISTED, nullptr, 0);
+        Flush();
+    }
+
+    void RecordFinished()
+    {
+        Append(RECORD_FINISHED, nullptr, 0);
+        Flush();
+    }
+
+    /**
+     * Make every record appended so far durable
+     */
+    void Flush()
+    {
+        Sync();
+    }
+
+    void Close()
+    {
+        if (m_flusher.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_flush_wakeup.notify_all();
+            m_flusher.join();
+        }
+        if (m_mapping)
+        {
+            ::msync(m_data, m_end, MS_SYNC);
+            m_mapping.reset();
+            m_data = nullptr;
+        }
+        if (m_fd >= 0)
+        {
+            // Trim the unused, zero-filled tail
+            if (::ftruncate(m_fd, static_cast<off_t>(m_end)) != 0)
+                std::cout << "Journal error: cannot trim: " << std::strerror(errno) << std::endl;
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+private:
+    enum RecordType : std::uint8_t
+    {
+        RECORD_JOB = 1,
+        RECORD_COMPLETED = 2,
+        RECORD_CHECKPOINT = 3,
+        RECORD_FINISHED = 4,
+        RECORD_FAILED = 5,
+        RECORD_LISTED = 6
+    };
+
+    static constexpr size_t HEADER_SIZE = 4 + 4 + 1;
+    static constexpr size_t INITIAL_SIZE = 16 * 1024 * 1024;
+
+    // One mapping of the file; unmapped when the last user lets go of it
+    struct Mapping
+    {
+        Mapping(char* data, size_t size) : data(data), size(size) {}
+        ~Mapping() { ::munmap(data, size); }
+
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+
+        char* data;
+        size_t size;
+    };
+
+    static std::uint64_t HashKey(const Aws::String& key)
+    {
+        // FNV-1a, with a final mix
+        std::uint64_t hash = 0xcbf29ce484222325ull;
+        for (unsigned char c : key)
+        {
+            hash ^= c;
+            hash *= 0x100000001b3ull;
+        }
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    static std::uint32_t Checksum(std::uint8_t type, const void* payload, size_t length)
+    {
+        std::uint32_t hash = 0x811c9dc5u;
+        hash = (hash ^ type) * 0x01000193u;
+        auto bytes = static_cast<const unsigned char*>(payload);
+        for (size_t i = 0; i < length; ++i)
+            hash = (hash ^ bytes[i]) * 0x01000193u;
+        return hash;
+    }
+
+    bool Map(size_t size)
+    {
+        if (::ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+            return false;
+        void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (data == MAP_FAILED)
+            return false;
+        m_mapping = std::make_shared<Mapping>(static_cast<char*>(data), size);
+        m_data = m_mapping->data;
+        m_size = size;
+        return true;
+    }
+
+    // Scan the existing records up to the first torn or empty one
+    void Load()
+    {
+        // Finished keys by page, while pages are still being checkpointed
+        std::map<std::uint64_t, std::vector<std::uint64_t>> completed_pages;
+        size_t offset = 0;
+        while (offset + HEADER_SIZE <= m_size)
+        {
+            std::uint32_t length;
+            std::uint32_t checksum;
+            std::memcpy(&length, m_data + offset, 4);
+            std::memcpy(&checksum, m_data + offset + 4, 4);
+            std::uint8_t type = static_cast<std::uint8_t>(m_data[offset + 8]);
+            const char* payload = m_data + offset + HEADER_SIZE;
+            if (type == 0 || offset + HEADER_SIZE + length > m_size ||
+                Checksum(type, payload, length) != checksum)
+                break;
+
+            switch (type)
+            {
+            case RECORD_JOB:
+                m_job_id.assign(payload, length);
+                break;
+            case RECORD_COMPLETED:
+            {
+                std::uint64_t record[2] = { 0, 0 };
+                std::memcpy(record, payload, std::min<size_t>(length, sizeof(record)));
+                completed_pages[record[1]].push_back(record[0]);
+                m_failed.erase(record[0]);
+                break;
+            }
+            case RECORD_FAILED:
+            {
+                std::uint64_t page = 0;
+                std::memcpy(&page, payload, std::min<size_t>(length, sizeof(page)));
+                if (length >= sizeof(page))
+                {
+                    Aws::String key(payload + sizeof(page), length - sizeof(page));
+                    m_failed[HashKey(key)] = FailedKey{ key, page };
+                }
+                break;
+            }
+            case RECORD_CHECKPOINT:
+            {
+                std::uint64_t next_page = 0;
+                std::memcpy(&next_page, payload, std::min<size_t>(length, sizeof(next_page)));
+                if (length >= sizeof(next_page))
+                    m_resume_token.assign(payload + sizeof(next_page),
+                        length - sizeof(next_page));
+                m_resume_page = next_page;
+                completed_pages.erase(completed_pages.begin(),
+                    completed_pages.lower_bound(next_page));
+                break;
+            }
+            case RECORD_LISTED:
+                m_listed = true;
+                break;
+            case RECORD_FINISHED:
+                m_finished = true;
+                break;
+            }
+            offset += HEADER_SIZE + length;
+        }
+        m_end = offset;
+        for (auto& page : completed_pages)
+            m_completed.insert(page.second.begin(), page.second.end());
+
+        // Clear whatever a crash left past the end, so that no stale record
+        // can reappear behind the ones appended from now on
+        std::memset(m_data + m_end, 0, m_size - m_end);
+    }
+
+    void Append(std::uint8_t type, const void* payload, size_t length)
+    {
+        std::uint32_t length32 = static_cast<std::uint32_t>(length);
+        std::uint32_t checksum = Checksum(type, payload, length);
+
+        // The mapping a growth replaces is released after the lock: a
+        // concurrent Sync() may still be using it, and the records in it are
+        // made durable by msyncs of the new one, which maps the same pages
+        std::shared_ptr<Mapping> replaced;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_end + HEADER_SIZE + length > m_size)
+        {
+            replaced = m_mapping;
+            if (!Map(std::max(2 * m_size, m_end + HEADER_SIZE + length)))
+            {
+                std::cout << "Journal error: cannot grow: " << std::strerror(errno) << std::endl;
+                return;
+            }
+        }
+
+        // The type byte is written last: until it is, the record reads as
+        // the end of the log
+        char* record = m_data + m_end;
+        std::memcpy(record, &length32, 4);
+        std::memcpy(record + 4, &checksum, 4);
+        if (length)
+            std::memcpy(record + HEADER_SIZE, payload, length);
+        record[8] = static_cast<char>(type);
+        m_end += HEADER_SIZE + length;
+    }
+
+    // Make the records appended so far durable; m_mutex must not be held
+    void Sync()
+    {
+        static const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        std::shared_ptr<Mapping> mapping;
+        size_t start;
+        size_t end;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_mapping || m_synced >= m_end)
+                return;
+            mapping = m_mapping;
+            start = m_synced / page_size * page_size;
+            end = m_end;
+        }
+
+        ::msync(mapping->data + start, end - start, MS_SYNC);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_synced = std::max(m_synced, end);
+    }
+
+    void FlushLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop)
+        {
+            m_flush_wakeup.wait_for(lock, m_flush_interval);
+            lock.unlock();
+            Sync();
+            lock.lock();
+        }
+    }
+
+    int m_fd = -1;
+    std::shared_ptr<Mapping> m_mapping;
+    char* m_data = nullptr;     // m_mapping's
+    size_t m_size = 0;
+    size_t m_end = 0;
+    size_t m_synced = 0;
+
+    Aws::String m_job_id;
+    Aws::String m_resume_token;
+    std::uint64_t m_resume_page = 0;
+    bool m_listed = false;
+    bool m_finished = false;
+    std::unordered_set<std::uint64_t> m_completed;
+    std::unordered_map<std::uint64_t, FailedKey> m_failed;  // By key hash
+
+    std::mutex m_mutex;
+    std::condition_variable m_flush_wakeup;
+    std::chrono::milliseconds m_flush_interval{100};
+    std::thread m_flusher;
+    bool m_stop = false;
+};
@@ -0,0 +1,171 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/model/Grant.h>
+#include <aws/s3/model/Permission.h>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * Set of ACL permissions, one bit per permission
+ *
+ * Grant-set operations are plain integer operations: union is |,
+ * intersection is &, difference is a & ~b.
+ */
+using PermissionMask = std::uint8_t;
+
+constexpr PermissionMask PERMISSION_NONE = 0;
+constexpr PermissionMask PERMISSION_READ = 1 << 0;
+constexpr PermissionMask PERMISSION_WRITE = 1 << 1;
+constexpr PermissionMask PERMISSION_READ_ACP = 1 << 2;
+constexpr PermissionMask PERMISSION_WRITE_ACP = 1 << 3;
+constexpr PermissionMask PERMISSION_FULL_CONTROL = 1 << 4;
+constexpr PermissionMask PERMISSION_ALL = PERMISSION_READ | PERMISSION_WRITE |
+    PERMISSION_READ_ACP | PERMISSION_WRITE_ACP | PERMISSION_FULL_CONTROL;
+
+struct PermissionInfo
+{
+    std::string_view name;
+    Aws::S3::Model::Permission permission;
+    PermissionMask mask;
+};
+
+/**
+ * Every permission, indexed by its bit position
+ */
+constexpr PermissionInfo PERMISSION_TABLE[] = {
+    { "READ", Aws::S3::Model::Permission::READ, PERMISSION_READ },
+    { "WRITE", Aws::S3::Model::Permission::WRITE, PERMISSION_WRITE },
+    { "READ_ACP", Aws::S3::Model::Permission::READ_ACP, PERMISSION_READ_ACP },
+    { "WRITE_ACP", Aws::S3::Model::Permission::WRITE_ACP, PERMISSION_WRITE_ACP },
+    { "FULL_CONTROL", Aws::S3::Model::Permission::FULL_CONTROL, PERMISSION_FULL_CONTROL },
+};
+
+/**
+ * Parse a permission name into its bit, or PERMISSION_NONE
+ *
+ * The five names have five different lengths, so the length selects the
+ * only candidate and a single comparison confirms it.
+ */
+constexpr PermissionMask ParsePermission(std::string_view name)
+{
+    int index = -1;
+    switch (name.size())
+    {
+    case 4: index = 0; break;   // READ
+    case 5: index = 1; break;   // WRITE
+    case 8: index = 2; break;   // READ_ACP
+    case 9: index = 3; break;   // WRITE_ACP
+    case 12: index = 4; break;  // FULL_CONTROL
+    default: return PERMISSION_NONE;
+    }
+    return PERMISSION_TABLE[index].name == name ?
+        PERMISSION_TABLE[index].mask : PERMISSION_NONE;
+}
+
+static_assert(ParsePermission("READ") == PERMISSION_READ, "READ");
+static_assert(ParsePermission("WRITE") == PERMISSION_WRITE, "WRITE");
+static_assert(ParsePermission("READ_ACP") == PERMISSION_READ_ACP, "READ_ACP");
+static_assert(ParsePermission("WRITE_ACP") == PERMISSION_WRITE_ACP, "WRITE_ACP");
+static_assert(ParsePermission("FULL_CONTROL") == PERMISSION_FULL_CONTROL, "FULL_CONTROL");
+static_assert(ParsePermission("READX") == PERMISSION_NONE, "unknown name");
+
+/**
+ * Bit for an SDK permission value, or PERMISSION_NONE for NOT_SET
+ */
+constexpr PermissionMask ToPermissionMask(Aws::S3::Model::Permission permission)
+{
+    for (const auto& info : PERMISSION_TABLE)
+    {
+        if (info.permission == permission)
+            return info.mask;
+    }
+    return PERMISSION_NONE;
+}
+
+/**
+ * SDK permission value for a single bit, or NOT_SET
+ */
+constexpr Aws::S3::Model::Permission ToPermission(PermissionMask mask)
+{
+    for (const auto& info : PERMISSION_TABLE)
+    {
+        if (info.mask == mask)
+            return info.permission;
+    }
+    return Aws::S3::Model::Permission::NOT_SET;
+}
+
+/**
+ * Name of an SDK permission value
+ */
+constexpr std::string_view PermissionName(Aws::S3::Model::Permission permission)
+{
+    if (permission == Aws::S3::Model::Permission::NOT_SET)
+        return "NOT_SET";
+    for (const auto& info : PERMISSION_TABLE)
+    {
+        if (info.permission == permission)
+            return info.name;
+    }
+    return "UNKNOWN VALUE";
+}
+
+/**
+ * Permissions actually conferred by a set: FULL_CONTROL implies all others
+ */
+constexpr PermissionMask EffectivePermissions(PermissionMask held)
+{
+    return (held & PERMISSION_FULL_CONTROL) ? PERMISSION_ALL : held;
+}
+
+/**
+ * Permissions in wanted that held does not already confer
+ */
+constexpr PermissionMask MissingPermissions(PermissionMask held, PermissionMask wanted)
+{
+    return wanted & ~EffectivePermissions(held);
+}
+
+/**
+ * Whether held confers every permission in wanted
+ */
+constexpr bool CoversPermissions(PermissionMask held, PermissionMask wanted)
+{
+    return MissingPermissions(held, wanted) == PERMISSION_NONE;
+}
+
+static_assert(CoversPermissions(PERMISSION_FULL_CONTROL, PERMISSION_READ | PERMISSION_WRITE_ACP),
+    "FULL_CONTROL covers everything");
+static_assert(!CoversPermissions(PERMISSION_READ, PERMISSION_READ_ACP),
+    "READ does not cover READ_ACP");
+
+/**
+ * Union of the permissions the grants give the canonical user grantee_id
+ */
+inline PermissionMask GranteePermissions(
+    const Aws::Vector<Aws::S3::Model::Grant>& grants,
+    const Aws::String& grantee_id)
+{
+    PermissionMask held = PERMISSION_NONE;
+    for (const auto& grant : grants)
+    {
+        if (grant.GetGrantee().GetID() == grantee_id)
+            held |= ToPermissionMask(grant.GetPermission());
+    }
+    return held;
+}
@@ -0,0 +1,308 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/model/Grant.h>
+#include <aws/s3/model/Grantee.h>
+#include <aws/s3/model/Owner.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "acl_permissions.h"
+
+/**
+ * Interned grantee: an index into the store's canonical ID table, or, with
+ * GRANTEE_REF_OTHER set, into its table of group URIs and email addresses
+ */
+using GranteeRef = std::uint32_t;
+constexpr GranteeRef GRANTEE_REF_OTHER = 0x80000000u;
+
+/**
+ * Interned access control policy (owner + grants)
+ */
+using AclPolicyId = std::uint32_t;
+
+/**
+ * Canonical user ID in binary form: 64 hex digits become 32 bytes
+ */
+using CanonicalId = std::array<std::uint8_t, 32>;
+
+/**
+ * Convert a 64-digit hex canonical user ID to binary
+ */
+inline bool ParseCanonicalId(const Aws::String& text, CanonicalId& id)
+{
+    if (text.size() != 2 * id.size())
+        return false;
+
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    for (size_t i = 0; i < id.size(); ++i)
+    {
+        int high = nibble(text[2 * i]);
+        int low = nibble(text[2 * i + 1]);
+        if (high < 0 || low < 0)
+            return false;
+        id[i] = static_cast<std::uint8_t>(high << 4 | low);
+    }
+    return true;
+}
+
+/**
+ * Hash-consed store of access control policies for ACL audits
+ *
+ * Millions of objects typically share a few dozen distinct ACLs. Intern()
+ * reduces an ACL to its owner and its grants, merged per grantee into a
+ * PermissionMask and sorted, and returns the same AclPolicyId for every
+ * ACL with the same content. The caller keeps only that ID per object.
+ * Canonical user IDs are stored once each, as 32-byte binaries.
+ *
+ * Stored policies are immutable. All members are thread-safe.
+ */
+class AclPolicyStore
+{
+public:
+    /**
+     * One grant of an interned policy
+     */
+    struct PolicyGrant
+    {
+        GranteeRef grantee;
+        PermissionMask permissions;
+    };
+
+    template <typename AclResult>
+    AclPolicyId Intern(const AclResult& result)
+    {
+        return Intern(result.GetOwner(), result.GetGrants());
+    }
+
+    AclPolicyId Intern(const Aws::S3::Model::Owner& owner,
+        const Aws::Vector<Aws::S3::Model::Grant>& grants)
+    {
+        // Packed policy: the owner, then (grantee << 8 | permissions) per
+        // grantee in ascending order
+        thread_local std::vector<std::uint64_t> key;
+        key.clear();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto& grant : grants)
+        {
+            key.push_back(static_cast<std::uint64_t>(InternGrantee(grant.GetGrantee())) << 8 |
+                ToPermissionMask(grant.GetPermission()));
+        }
+        std::sort(key.begin(), key.end());
+
+        // Merge the grants of each grantee into one mask
+        size_t merged = 0;
+        for (size_t i = 0; i < key.size(); ++i)
+        {
+            if (merged > 0 && (key[merged - 1] >> 8) == (key[i] >> 8))
+                key[merged - 1] |= key[i] & 0xFF;
+            else
+                key[merged++] = key[i];
+        }
+        key.resize(merged);
+        key.insert(key.begin(), InternCanonicalId(owner.GetID()));
+
+        auto found = m_policy_ids.find(key);
+        if (found != m_policy_ids.end())
+            return found->second;
+
+        AclPolicyId id = static_cast<AclPolicyId>(m_policies.size());
+        auto inserted = m_policy_ids.emplace(key, id).first;
+        m_policies.push_back(&inserted->first);
+        return id;
+    }
+
+    size_t PolicyCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_policies.size();
+    }
+
+    size_t GranteeCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_canonical_ids.size() + m_other_grantees.size();
+    }
+
+    GranteeRef PolicyOwner(AclPolicyId policy) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return static_cast<GranteeRef>(m_policies.at(policy)->front());
+    }
+
+    std::vector<PolicyGrant> Grants(AclPolicyId policy) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto& key = *m_policies.at(policy);
+        std::vector<PolicyGrant> grants;
+        grants.reserve(key.size() - 1);
+        for (size_t i = 1; i < key.size(); ++i)
+        {
+            grants.push_back({ static_cast<GranteeRef>(key[i] >> 8),
+                static_cast<PermissionMask>(key[i] & 0xFF) });
+        }
+        return grants;
+    }
+
+    /**
+     * Permissions the policy gives a grantee
+     */
+    PermissionMask Permissions(AclPolicyId policy, GranteeRef grantee) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto& key = *m_policies.at(policy);
+        auto first = key.begin() + 1;
+        auto found = std::lower_bound(first, key.end(),
+            static_cast<std::uint64_t>(grantee) << 8);
+        if (found != key.end() && (*found >> 8) == grantee)
+            return static_cast<PermissionMask>(*found & 0xFF);
+        return PERMISSION_NONE;
+    }
+
+    /**
+     * Look up a canonical user ID, group URI or email address without
+     * interning it
+     */
+    bool FindGrantee(const Aws::String& name, GranteeRef& grantee) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        CanonicalId id;
+        if (ParseCanonicalId(name, id))
+        {
+            auto found = m_canonical_refs.find(id);
+            if (found == m_canonical_refs.end())
+                return false;
+            grantee = found->second;
+            return true;
+        }
+        auto found = m_other_refs.find(std::string(name.c_str(), name.size()));
+        if (found == m_other_refs.end())
+            return false;
+        grantee = found->second;
+        return true;
+    }
+
+    /**
+     * Canonical user ID (hex), group URI or email address of a grantee
+     */
+    Aws::String GranteeName(GranteeRef grantee) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (grantee & GRANTEE_REF_OTHER)
+        {
+            const auto& name = m_other_grantees.at(grantee & ~GRANTEE_REF_OTHER);
+            return Aws::String(name.c_str(), name.size());
+        }
+
+        static const char digits[] = "0123456789abcdef";
+        const CanonicalId& id = m_canonical_ids.at(grantee);
+        Aws::String name;
+        name.reserve(2 * id.size());
+        for (auto byte : id)
+        {
+            name += digits[byte >> 4];
+            name += digits[byte & 0xF];
+        }
+        return name;
+    }
+
+private:
+    struct CanonicalIdHash
+    {
+        size_t operator()(const CanonicalId& id) const
+        {
+            // Canonical IDs are uniformly distributed already
+            size_t hash;
+            std::memcpy(&hash, id.data(), sizeof(hash));
+            return hash;
+        }
+    };
+
+    struct PolicyKeyHash
+    {
+        size_t operator()(const std::vector<std::uint64_t>& key) const
+        {
+            std::uint64_t hash = 0xcbf29ce484222325ull;
+            for (auto word : key)
+            {
+                hash ^= word;
+                hash *= 0x100000001b3ull;
+                hash ^= hash >> 29;
+            }
+            return static_cast<size_t>(hash);
+        }
+    };
+
+    // m_mutex must be held
+    GranteeRef InternCanonicalId(const Aws::String& text)
+    {
+        CanonicalId id;
+        if (!ParseCanonicalId(text, id))
+            return InternOther(text);
+
+        auto found = m_canonical_refs.find(id);
+        if (found != m_canonical_refs.end())
+            return found->second;
+        GranteeRef ref = static_cast<GranteeRef>(m_canonical_ids.size());
+        m_canonical_ids.push_back(id);
+        m_canonical_refs.emplace(id, ref);
+        return ref;
+    }
+
+    // m_mutex must be held
+    GranteeRef InternOther(const Aws::String& text)
+    {
+        std::string name(text.c_str(), text.size());
+        auto found = m_other_refs.find(name);
+        if (found != m_other_refs.end())
+            return found->second;
+        GranteeRef ref = GRANTEE_REF_OTHER |
+            static_cast<GranteeRef>(m_other_grantees.size());
+        m_other_grantees.push_back(name);
+        m_other_refs.emplace(std::move(name), ref);
+        return ref;
+    }
+
+    // m_mutex must be held
+    GranteeRef InternGrantee(const Aws::S3::Model::Grantee& grantee)
+    {
+        if (!grantee.GetURI().empty())
+            return InternOther(grantee.GetURI());
+        if (!grantee.GetEmailAddress().empty())
+            return InternOther(grantee.GetEmailAddress());
+        return InternCanonicalId(grantee.GetID());
+    }
+
+    mutable std::mutex m_mutex;
+    std::vector<CanonicalId> m_canonical_ids;
+    std::unordered_map<CanonicalId, GranteeRef, CanonicalIdHash> m_canonical_refs;
+    std::vector<std::string> m_other_grantees;
+    std::unordered_map<std::string, GranteeRef> m_other_refs;
+    std::unordered_map<std::vector<std::uint64_t>, AclPolicyId, PolicyKeyHash> m_policy_ids;
+    std::vector<const std::vector<std::uint64_t>*> m_policies;
+};
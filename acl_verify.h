@@ -0,0 +1,256 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/S3Client.h>
+#include <aws/s3/model/GetBucketAclRequest.h>
+#include <aws/s3/model/GetObjectAclRequest.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include "acl_grants.h"
+#include "latency_metrics.h"
+
+/**
+ * Which ACL updates are read back after the PUT
+ *
+ * None skips verification, All verifies every update before it is reported
+ * as finished, and Sampled verifies the given percentage of updates in the
+ * background, after they have been reported.
+ */
+class AclVerifyPolicy
+{
+public:
+    enum class Mode { None, All, Sampled };
+
+    static AclVerifyPolicy None() { return AclVerifyPolicy(Mode::None, 0); }
+    static AclVerifyPolicy All() { return AclVerifyPolicy(Mode::All, 100); }
+    static AclVerifyPolicy Sampled(double percent)
+    {
+        if (percent <= 0)
+            return None();
+        if (percent >= 100)
+            return All();
+        return AclVerifyPolicy(Mode::Sampled, percent);
+    }
+
+    /**
+     * Parse "none", "all" or a sampling percentage such as "5" or "0.5%"
+     */
+    static bool Parse(const char* text, AclVerifyPolicy& policy)
+    {
+        if (std::strcmp(text, "none") == 0)
+            policy = None();
+        else if (std::strcmp(text, "all") == 0)
+            policy = All();
+        else
+        {
+            char* end = nullptr;
+            double percent = std::strtod(text, &end);
+            if (end == text || (*end != '\0' && std::strcmp(end, "%") != 0) ||
+                percent < 0 || percent > 100)
+                return false;
+            policy = Sampled(percent);
+        }
+        return true;
+    }
+
+    Mode GetMode() const { return m_mode; }
+    double GetPercent() const { return m_percent; }
+
+    /**
+     * Decide whether to verify the next update
+     */
+    bool ShouldVerify() const
+    {
+        switch (m_mode)
+        {
+        case Mode::All:
+            return true;
+        case Mode::Sampled:
+        {
+            thread_local std::minstd_rand generator(std::random_device{}());
+            std::uniform_real_distribution<double> distribution(0, 100);
+            return distribution(generator) < m_percent;
+        }
+        default:
+            return false;
+        }
+    }
+
+private:
+    AclVerifyPolicy(Mode mode, double percent)
+        : m_mode(mode), m_percent(percent)
+    {
+    }
+
+    Mode m_mode;
+    double m_percent;
+};
+
+/**
+ * Verify ACL updates according to an AclVerifyPolicy
+ *
+ * Background (sampled) verifications are counted separately from the
+ * updates themselves: a mismatch found there does not turn an applied
+ * update into a failed one, it is reported by Report(). Call WaitIdle()
+ * before the client is destroyed.
+ */
+class AclVerifier
+{
+public:
+    using VerifyCallback = std::function<void(bool verified)>;
+
+    explicit AclVerifier(AclVerifyPolicy policy)
+        : m_policy(policy)
+    {
+    }
+
+    const AclVerifyPolicy& Policy() const { return m_policy; }
+
+    /**
+     * Start reading back a bucket ACL and check that grantee_id holds
+     * permission; on_verified (optional) receives the outcome
+     */
+    void VerifyBucketAsync(const Aws::S3::S3Client& s3_client,
+        const Aws::String& bucket_name,
+        const Aws::String& grantee_id,
+        Aws::S3::Model::Permission permission,
+        VerifyCallback on_verified = nullptr)
+    {
+        Aws::S3::Model::GetBucketAclRequest get_request;
+        get_request.SetBucket(bucket_name);
+
+        Started();
+        s3_client.GetBucketAclAsync(get_request,
+            [this, bucket_name, grantee_id, permission, on_verified,
+                started = LatencyMetrics::Clock::now()](
+                const Aws::S3::S3Client*,
+                const Aws::S3::Model::GetBucketAclRequest&,
+                const Aws::S3::Model::GetBucketAclOutcome& get_outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            Metrics().Record(S3Operation::GetBucketAcl, started, get_outcome);
+            Check(get_outcome, bucket_name, grantee_id, permission, on_verified);
+        });
+    }
+
+    /**
+     * Start reading back an object ACL and check that grantee_id holds
+     * permission; on_verified (optional) receives the outcome
+     */
+    void VerifyObjectAsync(const Aws::S3::S3Client& s3_client,
+        const Aws::String& bucket_name,
+        const Aws::String& object_name,
+        const Aws::String& grantee_id,
+        Aws::S3::Model::Permission permission,
+        VerifyCallback on_verified = nullptr)
+    {
+        Aws::S3::Model::GetObjectAclRequest get_request;
+        get_request.SetBucket(bucket_name);
+        get_request.SetKey(object_name);
+
+        Started();
+        s3_client.GetObjectAclAsync(get_request,
+            [this, object_name, grantee_id, permission, on_verified,
+                started = LatencyMetrics::Clock::now()](
+                const Aws::S3::S3Client*,
+                const Aws::S3::Model::GetObjectAclRequest&,
+                const Aws::S3::Model::GetObjectAclOutcome& get_outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            Metrics().Record(S3Operation::GetObjectAcl, started, get_outcome);
+            Check(get_outcome, object_name, grantee_id, permission, on_verified);
+        });
+    }
+
+    /**
+     * Wait for the verifications still in flight
+     */
+    void WaitIdle()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this]() { return m_pending == 0; });
+    }
+
+    void Report(std::ostream& out) const
+    {
+        out << "Verified " << m_verified << " ACLs: " << m_mismatched
+            << " mismatched, " << m_errors << " could not be read"
+            << std::endl;
+    }
+
+    size_t Mismatched() const { return m_mismatched; }
+
+private:
+    void Started()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_pending;
+    }
+
+    void Finished()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_pending;
+        m_idle.notify_all();
+    }
+
+    template <typename Outcome>
+    void Check(const Outcome& get_outcome,
+        const Aws::String& name,
+        const Aws::String& grantee_id,
+        Aws::S3::Model::Permission permission,
+        const VerifyCallback& on_verified)
+    {
+        bool verified = false;
+        if (!get_outcome.IsSuccess())
+        {
+            auto& error = get_outcome.GetError();
+            std::cout << "Verify ACL error: " << name << ": "
+                << error.GetExceptionName() << " - " << error.GetMessage()
+                << std::endl;
+            ++m_errors;
+        }
+        else if (!HasGrant(get_outcome.GetResult().GetGrants(), grantee_id,
+            permission))
+        {
+            std::cout << "Verify ACL mismatch: " << name
+                << ": grant not present after PUT" << std::endl;
+            ++m_mismatched;
+        }
+        else
+            verified = true;
+        ++m_verified;
+
+        if (on_verified)
+            on_verified(verified);
+        Finished();
+    }
+
+    const AclVerifyPolicy m_policy;
+    std::atomic<size_t> m_verified{0};
+    std::atomic<size_t> m_mismatched{0};
+    std::atomic<size_t> m_errors{0};
+    size_t m_pending = 0;
+    std::mutex m_mutex;
+    std::condition_variable m_idle;
+};
@@ -0,0 +1,148 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#include <aws/core/Aws.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "mapped_file_stream.h"
+
+/**
+ * CPU time per GB of reading a request body the way the SDK's HTTP client
+ * does (size it by seeking, then read() it into a send buffer), through an
+ * Aws::FStream and through a MappedFileStream
+ *
+ * The file is read once first so that both run from the page cache, which
+ * is the case the mapping targets; the numbers are then the cost of the
+ * copies, not of the disk.
+ *
+ * Usage: bench_body_stream [FILE_SIZE_MB] [PASSES] [BUFFER_KB]
+ */
+
+struct CpuTimes
+{
+    double user;
+    double system;
+
+    static CpuTimes Now()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return CpuTimes{ usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 };
+    }
+};
+
+/**
+ * Read body to the end as the HTTP client does; returns a checksum of the
+ * data so that the reads cannot be optimized away
+ */
+std::uint64_t SendBody(Aws::IOStream& body, std::vector<char>& buffer)
+{
+    body.seekg(0, std::ios_base::end);
+    std::streamoff length = body.tellg();
+    body.seekg(0, std::ios_base::beg);
+
+    std::uint64_t checksum = static_cast<std::uint64_t>(length);
+    while (body.read(buffer.data(), static_cast<std::streamsize>(buffer.size())),
+        body.gcount() > 0)
+    {
+        std::streamsize count = body.gcount();
+        checksum += static_cast<unsigned char>(buffer[0]) +
+            static_cast<unsigned char>(buffer[static_cast<size_t>(count - 1)]);
+    }
+    return checksum;
+}
+
+template <typename OpenBody>
+void Measure(const char* name, const std::string& path, std::uint64_t file_size, int passes,
+    size_t buffer_size, OpenBody open_body)
+{
+    std::vector<char> buffer(buffer_size);
+    std::uint64_t checksum = 0;
+    CpuTimes cpu_start = CpuTimes::Now();
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        std::shared_ptr<Aws::IOStream> body = open_body(path);
+        checksum += SendBody(*body, buffer);
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    CpuTimes cpu_end = CpuTimes::Now();
+
+    double gigabytes = static_cast<double>(file_size) * passes / 1e9;
+    double user = cpu_end.user - cpu_start.user;
+    double system = cpu_end.system - cpu_start.system;
+    std::printf("%-8s cpu_s_per_gb=%.4f user_s_per_gb=%.4f sys_s_per_gb=%.4f "
+        "gb_per_s=%.2f checksum=%llu\n", name, (user + system) / gigabytes, user / gigabytes,
+        system / gigabytes, gigabytes / seconds, static_cast<unsigned long long>(checksum));
+}
+
+int main(int argc, char** argv)
+{
+    const std::uint64_t file_size =
+        (argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1024) << 20;
+    const int passes = argc > 2 ? std::atoi(argv[2]) : 5;
+    const size_t buffer_size = (argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 64) << 10;
+    const std::string path = "bench_body_stream.bin";
+
+    // Random data, written once
+    {
+        std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+        std::mt19937_64 random(42);
+        std::vector<std::uint64_t> block(1 << 17);
+        for (std::uint64_t written = 0; written < file_size; )
+        {
+            for (auto& word : block)
+                word = random();
+            std::uint64_t count = std::min<std::uint64_t>(block.size() * sizeof(block[0]),
+                file_size - written);
+            out.write(reinterpret_cast<const char*>(block.data()),
+                static_cast<std::streamsize>(count));
+            written += count;
+        }
+    }
+
+    auto open_fstream = [](const std::string& file_name)
+    {
+        return std::shared_ptr<Aws::IOStream>(Aws::MakeShared<Aws::FStream>(
+            "bench_body_stream", file_name.c_str(), std::ios_base::in | std::ios_base::binary));
+    };
+    auto open_mapped = [](const std::string& file_name)
+    {
+        return std::shared_ptr<Aws::IOStream>(Aws::MakeShared<MappedFileStream>(
+            "bench_body_stream", MappedFile::Open(file_name)));
+    };
+
+    Aws::SDKOptions options;
+    Aws::InitAPI(options);
+    {
+        // Warm the page cache
+        Measure("warmup", path, file_size, 1, buffer_size, open_fstream);
+        Measure("fstream", path, file_size, passes, buffer_size, open_fstream);
+        Measure("mapped", path, file_size, passes, buffer_size, open_mapped);
+    }
+    Aws::ShutdownAPI(options);
+    std::remove(path.c_str());
+}
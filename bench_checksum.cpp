@@ -0,0 +1,210 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#include <aws/core/Aws.h>
+#include <aws/s3/model/ChecksumAlgorithm.h>
+#include <aws/s3/model/PutObjectRequest.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include "local_s3.h"
+#include "mapped_file_stream.h"
+#include "multipart_upload.h"
+#include "s3_runtime.h"
+
+/**
+ * CPU cost of sending uploads with a checksum
+ *
+ * A small file is sent with PutObject and a large one with a multipart
+ * upload, through the SDK to the local S3 stand-in, once with no checksum
+ * algorithm and once each with CRC32C, CRC64NVME and SHA-256, which the SDK
+ * computes as it sends the body and attaches as a trailer. The stand-in
+ * does not check the checksums, so the difference from the run without one
+ * is what the client adds; it is reported as CPU seconds per GB and as the
+ * share of one core it takes at 10 Gb/s, which should stay under 5%. That
+ * holds for the CRCs; SHA-256 costs far more, and is for when a
+ * cryptographic hash is required.
+ *
+ * Usage: bench_checksum [LARGE_FILE_MB] [PASSES] [SMALL_FILE_MB]
+ */
+
+struct CpuTimes
+{
+    double user;
+    double system;
+
+    static CpuTimes Now()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return CpuTimes{ usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 };
+    }
+};
+
+// Bytes per second of a 10 Gb/s link
+constexpr double LINE_RATE = 10e9 / 8;
+
+const Aws::String BUCKET = "bench-checksum";
+
+/**
+ * Send file in one PutObject with checksum; false if the request failed
+ */
+bool PutObject(const std::string& path, const std::shared_ptr<const MappedFile>& file,
+    Aws::S3::Model::ChecksumAlgorithm checksum)
+{
+    Aws::S3::Model::PutObjectRequest request;
+    request.SetBucket(BUCKET);
+    request.SetKey(path.c_str());
+    if (checksum != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
+        request.SetChecksumAlgorithm(checksum);
+    request.SetBody(Aws::MakeShared<MappedFileStream>("bench_checksum", file));
+    auto outcome = S3Runtime::Instance().Client().PutObject(request);
+    if (!outcome.IsSuccess())
+        std::printf("PutObject failed: %s\n", outcome.GetError().GetMessage().c_str());
+    return outcome.IsSuccess();
+}
+
+/**
+ * Send file in parts with checksum and wait for it; false if it failed
+ */
+bool UploadParts(const std::string& path, const std::shared_ptr<const MappedFile>& file,
+    Aws::S3::Model::ChecksumAlgorithm checksum)
+{
+    std::promise<bool> finished;
+    MultipartUpload::Start(S3Runtime::Instance().Client(), BUCKET, path.c_str(), path,
+        file->Size(), MultipartSettings(), checksum, CompressionSettings(),
+        [&finished](const Aws::S3::Model::CompleteMultipartUploadOutcome& outcome)
+        {
+            if (!outcome.IsSuccess())
+                std::printf("Multipart upload failed: %s\n",
+                    outcome.GetError().GetMessage().c_str());
+            finished.set_value(outcome.IsSuccess());
+        });
+    return finished.get_future().get();
+}
+
+using Upload = bool (*)(const std::string&, const std::shared_ptr<const MappedFile>&,
+    Aws::S3::Model::ChecksumAlgorithm);
+
+/**
+ * CPU seconds per GB of uploading the file passes times with checksum; a
+ * negative value if an upload failed
+ */
+double Measure(Upload upload, const std::string& path,
+    const std::shared_ptr<const MappedFile>& file, int passes,
+    Aws::S3::Model::ChecksumAlgorithm checksum)
+{
+    CpuTimes cpu_start = CpuTimes::Now();
+    for (int pass = 0; pass < passes; ++pass)
+        if (!upload(path, file, checksum))
+            return -1;
+    CpuTimes cpu_end = CpuTimes::Now();
+    double gigabytes = static_cast<double>(file->Size()) * passes / 1e9;
+    return (cpu_end.user - cpu_start.user + cpu_end.system - cpu_start.system) / gigabytes;
+}
+
+/**
+ * Report the upload without a checksum, then with each one
+ */
+void Run(const char* name, Upload upload, const std::string& path, int passes)
+{
+    auto file = MappedFile::Open(path);
+    if (!file)
+    {
+        std::printf("Cannot map %s\n", path.c_str());
+        return;
+    }
+
+    using Aws::S3::Model::ChecksumAlgorithm;
+    // Warm the page cache and the connections, then the upload alone
+    Measure(upload, path, file, 1, ChecksumAlgorithm::NOT_SET);
+    const double plain = Measure(upload, path, file, passes, ChecksumAlgorithm::NOT_SET);
+    if (plain < 0)
+        return;
+    std::printf("%-10s %-9s cpu_s_per_gb=%.4f\n", name, "none", plain);
+
+    const std::pair<const char*, ChecksumAlgorithm> algorithms[] = {
+        { "crc32c", ChecksumAlgorithm::CRC32C },
+        { "crc64nvme", ChecksumAlgorithm::CRC64NVME },
+        { "sha256", ChecksumAlgorithm::SHA256 } };
+    for (auto& algorithm : algorithms)
+    {
+        double with_checksum = Measure(upload, path, file, passes, algorithm.second);
+        if (with_checksum < 0)
+            return;
+        double added = std::max(with_checksum - plain, 0.0);
+        double core_share = added * LINE_RATE / 1e9 * 100;
+        std::printf("%-10s %-9s cpu_s_per_gb=%.4f added_s_per_gb=%.4f "
+            "core_percent_at_10gbps=%.2f %s\n", name, algorithm.first, with_checksum,
+            added, core_share, core_share < 5 ? "ok" : "over 5%");
+    }
+}
+
+/**
+ * Write size bytes of random data to path
+ */
+void WriteRandomFile(const std::string& path, std::uint64_t size)
+{
+    std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+    std::mt19937_64 random(42);
+    std::vector<std::uint64_t> block(1 << 17);
+    for (std::uint64_t written = 0; written < size; )
+    {
+        for (auto& word : block)
+            word = random();
+        std::uint64_t count = std::min<std::uint64_t>(block.size() * sizeof(block[0]),
+            size - written);
+        out.write(reinterpret_cast<const char*>(block.data()),
+            static_cast<std::streamsize>(count));
+        written += count;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const std::uint64_t large_size =
+        (argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 512) << 20;
+    const int passes = argc > 2 ? std::atoi(argv[2]) : 3;
+    const std::uint64_t small_size =
+        (argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 8) << 20;
+    const std::string small_path = "bench_checksum_small.bin";
+    const std::string large_path = "bench_checksum_large.bin";
+    WriteRandomFile(small_path, small_size);
+    WriteRandomFile(large_path, large_size);
+
+    Aws::SDKOptions options;
+    LocalS3Settings settings;
+    settings.verify_checksums = false;
+    InstallLocalS3(options, settings);
+    Aws::InitAPI(options);
+    {
+        S3Runtime runtime(S3Runtime::DefaultConfiguration("us-east-1"));
+        // Many small objects, so that per-request costs count too
+        Run("putobject", PutObject, small_path, passes * 8);
+        Run("multipart", UploadParts, large_path, passes);
+    }
+    Aws::ShutdownAPI(options);
+    std::remove(small_path.c_str());
+    std::remove(large_path.c_str());
+}
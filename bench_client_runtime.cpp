@@ -0,0 +1,91 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#include <aws/core/Aws.h>
+#include <aws/s3/S3Client.h>
+#include <aws/s3/model/GetBucketAclRequest.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "s3_runtime.h"
+
+/**
+ * Measure the per-operation cost of GetBucketAcl with a client constructed
+ * for every call (the original behavior of SetAclForBucket(),
+ * SetAclForObject() and put_s3_object_async()) and with the shared client
+ * of S3Runtime
+ *
+ * Usage: bench_client_runtime BUCKET_NAME [ITERATIONS]
+ */
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::cout << "Usage: bench_client_runtime BUCKET_NAME [ITERATIONS]" << std::endl;
+        return 1;
+    }
+    const Aws::String bucket_name = argv[1];
+    const int iterations = argc > 2 ? std::atoi(argv[2]) : 100;
+
+    Aws::SDKOptions options;
+    Aws::InitAPI(options);
+    {
+        using clock = std::chrono::steady_clock;
+        Aws::S3::Model::GetBucketAclRequest request;
+        request.SetBucket(bucket_name);
+        int failures = 0;
+
+        // Before: construct a client for every operation, each from its own
+        // configuration and so with its own executor threads, and destroy
+        // it afterwards
+        std::chrono::duration<double, std::micro> construct_time(0);
+        std::chrono::duration<double, std::micro> per_call_time(0);
+        for (int i = 0; i < iterations; ++i) {
+            auto start = clock::now();
+            clock::time_point constructed;
+            {
+                Aws::S3::S3Client s3_client(S3Runtime::DefaultConfiguration());
+                constructed = clock::now();
+                if (!s3_client.GetBucketAcl(request).IsSuccess())
+                    ++failures;
+            }
+            auto finished = clock::now();
+            construct_time += constructed - start;
+            per_call_time += finished - start;
+        }
+
+        // After: one shared client; the first call warms the connection pool
+        std::chrono::duration<double, std::micro> shared_time(0);
+        {
+            S3Runtime runtime(S3Runtime::DefaultConfiguration());
+            if (!runtime.Client().GetBucketAcl(request).IsSuccess())
+                ++failures;
+            for (int i = 0; i < iterations; ++i) {
+                auto start = clock::now();
+                if (!runtime.Client().GetBucketAcl(request).IsSuccess())
+                    ++failures;
+                shared_time += clock::now() - start;
+            }
+        }
+
+        std::cout << "iterations: " << iterations << "\n"
+            << "per-call client, construction only: "
+            << construct_time.count() / iterations << " us/op\n"
+            << "per-call client, construction + GetBucketAcl + teardown: "
+            << per_call_time.count() / iterations << " us/op\n"
+            << "shared client, GetBucketAcl: "
+            << shared_time.count() / iterations << " us/op\n"
+            << "failed requests: " << failures << std::endl;
+    }
+    Aws::ShutdownAPI(options);
+}
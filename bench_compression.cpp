@@ -0,0 +1,150 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+
+#include <aws/core/Aws.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "block_compressor.h"
+#include "mapped_file_stream.h"
+#include "work_pool.h"
+
+/**
+ * Whether compressing an upload keeps up with the network
+ *
+ * A log-like file is compressed into parts by a BlockCompressor, on every
+ * core of the WorkPool, at fixed levels and with the parts taken as soon
+ * as they are ready, as by a network that is never the bottleneck.
+ * The compressed bytes produced per second are what the stage can feed the
+ * link; below the line rate, the network would wait for compression, and
+ * an upload with the default settings would step down to the next level
+ * listed, until one keeps up.
+ *
+ * Usage: bench_compression [FILE_SIZE_MB] [LINE_RATE_GBPS] [PART_SIZE_MB]
+ */
+
+struct CompressionResult
+{
+    double seconds;
+    std::uint64_t compressed_bytes;
+    size_t parts;
+};
+
+/**
+ * Compress the whole file at level, taking every part as it is ready
+ */
+CompressionResult Measure(const std::shared_ptr<const MappedFile>& file, int level,
+    std::uint64_t part_size)
+{
+    CompressionSettings settings;
+    settings.enabled = true;
+    settings.level = settings.min_level = level;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool done = false;
+    CompressionResult result{ 0, 0, 0 };
+    auto start = std::chrono::steady_clock::now();
+    auto take_parts = [&](BlockCompressor& compressor)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<const MappedFile> part;
+        BlockCompressor::Status status;
+        while ((status = compressor.NextPart(part)) == BlockCompressor::Status::Ready)
+        {
+            result.compressed_bytes += part->Size();
+            ++result.parts;
+        }
+        if (status != BlockCompressor::Status::Pending)
+        {
+            done = true;
+            finished.notify_one();
+        }
+    };
+    BlockCompressor::Start(file, settings, part_size, 2, take_parts);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&done]() { return done; });
+    result.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    const std::uint64_t file_size =
+        (argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 512) << 20;
+    const double line_rate = (argc > 2 ? std::atof(argv[2]) : 10) * 1e9 / 8;
+    const std::uint64_t part_size = (argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 16) << 20;
+    const std::string path = "bench_compression.bin";
+
+    if (!CompressionSettings::Available())
+    {
+        std::printf("Built without zstd (S3_SAMPLE_ZSTD)\n");
+        return 1;
+    }
+
+    // Log lines of a few thousand words and numbers, written once
+    {
+        std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+        std::mt19937_64 random(42);
+        std::vector<std::string> words(4096);
+        for (auto& word : words)
+            for (size_t length = 3 + random() % 8; word.size() < length; )
+                word += static_cast<char>('a' + random() % 26);
+        std::string line;
+        for (std::uint64_t written = 0; written < file_size; written += line.size())
+        {
+            line = std::to_string(1500000000 + written / 4096) + " INFO";
+            for (int i = 0; i < 10; ++i)
+                line += " " + words[random() % words.size()];
+            line += " id=" + std::to_string(random() % 1000000) + "\n";
+            out << line;
+        }
+    }
+
+    Aws::SDKOptions options;
+    Aws::InitAPI(options);
+    {
+        auto file = MappedFile::Open(path);
+        if (file)
+        {
+            std::printf("threads=%zu line_rate_mb_s=%.0f\n",
+                WorkPool::Instance().Threads(), line_rate / 1e6);
+            for (int level : { 3, 2, 1, -1, -4, -16, -64, -256, -1024 })
+            {
+                CompressionResult result = Measure(file, level, part_size);
+                double output_rate = result.compressed_bytes / result.seconds;
+                std::printf("level=%-3d ratio=%.2f input_mb_s=%.0f output_mb_s=%.0f "
+                    "parts=%zu %s\n", level,
+                    static_cast<double>(file->Size()) / result.compressed_bytes,
+                    file->Size() / result.seconds / 1e6, output_rate / 1e6, result.parts,
+                    output_rate >= line_rate ? "keeps up" : "below line rate");
+            }
+        }
+        else
+            std::printf("Cannot map %s\n", path.c_str());
+    }
+    Aws::ShutdownAPI(options);
+    std::remove(path.c_str());
+}
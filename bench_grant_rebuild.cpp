@@ -0,0 +1,196 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#include <aws/core/Aws.h>
+#include <aws/core/utils/memory/MemorySystemInterface.h>
+#include <aws/s3/model/GetObjectAclResult.h>
+#include <aws/s3/model/PutObjectAclRequest.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include "acl_grants.h"
+
+/**
+ * Count heap allocations made while rebuilding the grants of an ACL
+ *
+ * Allocations are counted both through the global operator new (SDK built
+ * with std::allocator) and through an SDK memory manager (SDK built with
+ * custom memory management), so the count is complete either way.
+ *
+ * Usage: bench_grant_rebuild [GRANTS] [ITERATIONS]
+ */
+static std::atomic<size_t> allocation_count(0);
+
+void* operator new(std::size_t size)
+{
+    ++allocation_count;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+class CountingMemorySystem : public Aws::Utils::Memory::MemorySystemInterface
+{
+public:
+    void Begin() override {}
+    void End() override {}
+
+    void* AllocateMemory(std::size_t block_size, std::size_t,
+        const char* = nullptr) override
+    {
+        ++allocation_count;
+        return std::malloc(block_size);
+    }
+
+    void FreeMemory(void* memory_ptr) override
+    {
+        std::free(memory_ptr);
+    }
+};
+
+/**
+ * Build a GetObjectAcl result with grant_count canonical-user grants, as
+ * the XML deserializer would
+ */
+Aws::S3::Model::GetObjectAclResult MakeResult(size_t grant_count)
+{
+    Aws::S3::Model::Owner owner;
+    owner.SetID("79a59df900b949e55d96a1e698fbacedfd6e09d98eacf8f8d5218e7cd47ef2be");
+    owner.SetDisplayName("owner-display-name");
+
+    Aws::Vector<Aws::S3::Model::Grant> grants;
+    for (size_t i = 0; i < grant_count; ++i)
+    {
+        Aws::S3::Model::Grantee grantee;
+        grantee.SetID("0f5c3a8e1d9b7c6a5f4e3d2c1b0a998877665544332211ffeeddccbbaa9988" +
+            Aws::String(1, static_cast<char>('a' + i % 26)));
+        grantee.SetDisplayName("grantee-display-name");
+        Aws::S3::Model::Grant grant;
+        grant.SetGrantee(std::move(grantee));
+        grant.SetPermission(Aws::S3::Model::Permission::READ);
+        grants.push_back(std::move(grant));
+    }
+
+    Aws::S3::Model::GetObjectAclResult result;
+    result.SetOwner(owner);
+    result.SetGrants(std::move(grants));
+    return result;
+}
+
+/**
+ * The original rebuild loop of SetAclForObject(): copy every grant through
+ * two shared_ptrs, then copy the vector into the policy and the policy into
+ * the request
+ */
+void RebuildByCopy(Aws::S3::Model::GetObjectAclResult& result,
+    const Aws::String& grantee_id,
+    Aws::S3::Model::PutObjectAclRequest& put_request)
+{
+    Aws::S3::Model::AccessControlPolicy acp;
+    acp.SetOwner(result.GetOwner());
+
+    Aws::Vector<Aws::S3::Model::Grant> updated_grants;
+    for (auto acp_grant : result.GetGrants())
+    {
+        std::shared_ptr<Aws::S3::Model::Grant> updated_grant = std::make_shared<Aws::S3::Model::Grant>();
+        std::shared_ptr<Aws::S3::Model::Grantee> updated_grantee = std::make_shared<Aws::S3::Model::Grantee>();
+        updated_grant->SetPermission(acp_grant.GetPermission());
+        *updated_grantee = acp_grant.GetGrantee();
+        updated_grantee->SetType(Aws::S3::Model::Type::CanonicalUser);
+        updated_grant->SetGrantee(*updated_grantee);
+        updated_grants.push_back(*updated_grant);
+    }
+
+    Aws::S3::Model::Grant new_grant;
+    Aws::S3::Model::Grantee new_grantee;
+    new_grantee.SetID(grantee_id);
+    new_grantee.SetType(Aws::S3::Model::Type::CanonicalUser);
+    new_grant.SetGrantee(new_grantee);
+    new_grant.SetPermission(Aws::S3::Model::Permission::READ);
+    updated_grants.push_back(new_grant);
+
+    acp.SetGrants(updated_grants);
+    put_request.SetAccessControlPolicy(acp);
+}
+
+/**
+ * The in-place rebuild now used by SetAclForObject()
+ */
+void RebuildInPlace(Aws::S3::Model::GetObjectAclResult& result,
+    const Aws::String& grantee_id,
+    Aws::S3::Model::PutObjectAclRequest& put_request)
+{
+    put_request.SetAccessControlPolicy(MakeUpdatedPolicy(result,
+        MakeGrant(grantee_id, Aws::S3::Model::Permission::READ)));
+}
+
+template <typename Rebuild>
+void Measure(const char* name, Rebuild rebuild, size_t grant_count, int iterations)
+{
+    const Aws::String grantee_id =
+        "a1b2c3d4e5f60718293a4b5c6d7e8f90a1b2c3d4e5f60718293a4b5c6d7e8f90";
+    size_t allocations = 0;
+    std::chrono::duration<double, std::nano> elapsed(0);
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        auto result = MakeResult(grant_count);
+        Aws::S3::Model::PutObjectAclRequest put_request;
+
+        size_t before = allocation_count;
+        auto start = std::chrono::steady_clock::now();
+        rebuild(result, grantee_id, put_request);
+        elapsed += std::chrono::steady_clock::now() - start;
+        allocations += allocation_count - before;
+    }
+
+    double per_rebuild = static_cast<double>(allocations) / iterations;
+    std::cout << name << ": grants=" << grant_count
+        << " allocations/rebuild=" << per_rebuild
+        << " allocations/grant=" << per_rebuild / grant_count
+        << " ns/rebuild=" << elapsed.count() / iterations << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    const size_t max_grants = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100;
+    const int iterations = argc > 2 ? std::atoi(argv[2]) : 1000;
+
+    CountingMemorySystem memory_system;
+    Aws::SDKOptions options;
+    options.memoryManagementOptions.memoryManager = &memory_system;
+    Aws::InitAPI(options);
+    {
+        // The in-place allocation count should stay flat as grants grow:
+        // only the new grant's strings and the policy's internal state
+        for (size_t grant_count = 1; grant_count <= max_grants; grant_count *= 10)
+        {
+            Measure("copy", RebuildByCopy, grant_count, iterations);
+            Measure("in-place", RebuildInPlace, grant_count, iterations);
+        }
+    }
+    Aws::ShutdownAPI(options);
+}
@@ -0,0 +1,377 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#include <aws/core/Aws.h>
+#include <aws/s3/S3Client.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include "command_line.h"
+#include "concurrency_controller.h"
+#include "latency_metrics.h"
+#include "local_s3.h"
+#include "put_object_async.h"
+#include "s3_runtime.h"
+#include "set_acl.h"
+
+/**
+ * Throughput and latency of the sample operations against the local S3
+ * stand-in (see local_s3.h)
+ *
+ *   SetAclForObject  objects/sec at 1, 2, 4, ... --max-concurrency callers,
+ *                    each call a GET + PUT on a fresh grantee
+ *   SetAclForBucket  the same, each call on a fresh bucket
+ *   PutObject        MB/s and uploads/sec of put_s3_object_async() for
+ *                    files of 1 KB, 4 KB, ... up to --max-size (10 GB),
+ *                    up to --upload-concurrency uploads at a time
+ *
+ * Every run is also written as one JSON document to --output, to be
+ * compared between releases. The stand-in is configured by --local (same
+ * syntax as S3_LOCAL) and by default answers without delay, so that the
+ * numbers are the client's own cost; add latency=<ms> to model a network.
+ * The files uploaded are sparse, so 10 GB costs no disk space.
+ *
+ * Usage: bench_s3_throughput [--output=<file>] [--local=<settings>]
+ *     [--only=acl|upload] [--max-concurrency=<n>] [--acl-objects=<n>]
+ *     [--bucket-ops=<n>] [--min-size=<bytes>] [--max-size=<bytes>]
+ *     [--upload-bytes=<bytes per size>] [--upload-concurrency=<n>]
+ *     [--dir=<directory for the upload files>]
+ */
+
+namespace
+{
+
+const Aws::String bench_bucket = "bench-bucket";
+const Aws::String acl_prefix = "bench/acl/";
+
+/**
+ * Discards what the sample code prints per request while a run is timed
+ */
+class QuietOutput
+{
+public:
+    QuietOutput() : m_saved(std::cout.rdbuf(&m_null)) {}
+    ~QuietOutput() { std::cout.rdbuf(m_saved); }
+
+private:
+    class NullBuffer : public std::streambuf
+    {
+    protected:
+        int overflow(int c) override { return traits_type::not_eof(c); }
+        std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+    };
+
+    NullBuffer m_null;
+    std::streambuf* m_saved;
+};
+
+struct RunResult
+{
+    const char* operation;
+    size_t concurrency;
+    std::uint64_t size = 0;     // PutObject only
+    std::uint64_t count = 0;
+    std::uint64_t failed = 0;
+    double seconds = 0;
+    double mean_us = 0;
+    std::uint64_t p50_us = 0;
+    std::uint64_t p90_us = 0;
+    std::uint64_t p99_us = 0;
+    std::uint64_t max_us = 0;
+
+    void SetLatency(const LatencyHistogram& histogram)
+    {
+        mean_us = histogram.MeanMicros();
+        p50_us = histogram.PercentileMicros(0.50);
+        p90_us = histogram.PercentileMicros(0.90);
+        p99_us = histogram.PercentileMicros(0.99);
+        max_us = histogram.MaxMicros();
+    }
+
+    double OpsPerSecond() const { return seconds > 0 ? count / seconds : 0; }
+    double MegabytesPerSecond() const
+    {
+        return seconds > 0 ? static_cast<double>(size) * count / seconds / 1e6 : 0;
+    }
+};
+
+/**
+ * Call operation(index) for indexes 0 .. count-1 from concurrency threads
+ * and time each call; operation returns false on failure
+ */
+template <typename Operation>
+RunResult RunConcurrently(const char* name, size_t concurrency, size_t count,
+    Operation operation)
+{
+    LatencyHistogram latency;
+    std::atomic<size_t> next(0);
+    std::atomic<std::uint64_t> failed(0);
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < concurrency; ++t)
+        {
+            threads.emplace_back([&]()
+            {
+                for (size_t i = next++; i < count; i = next++)
+                {
+                    auto call_start = std::chrono::steady_clock::now();
+                    if (!operation(i))
+                        ++failed;
+                    latency.Record(std::chrono::steady_clock::now() - call_start);
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    RunResult result{ name, concurrency };
+    result.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    result.count = count;
+    result.failed = failed;
+    result.SetLatency(latency);
+    return result;
+}
+
+std::vector<RunResult> BenchmarkAcl(const Aws::S3::S3Client& s3_client,
+    size_t max_concurrency, size_t acl_objects, size_t bucket_ops)
+{
+    std::vector<RunResult> results;
+    for (size_t concurrency = 1; concurrency <= max_concurrency; concurrency *= 2)
+    {
+        // A grantee per run, so that every call updates the ACL
+        const Aws::String grantee_id = "bench-grantee-" + std::to_string(concurrency);
+        QuietOutput quiet;
+        results.push_back(RunConcurrently("SetAclForObject", concurrency, acl_objects,
+            [&](size_t index)
+        {
+            char name[32];
+            std::snprintf(name, sizeof(name), "object-%08zu", index);
+            return SetAclForObject(s3_client, bench_bucket, acl_prefix + name, grantee_id,
+                "READ") == AclApplyResult::Applied;
+        }));
+
+        AclVerifier verifier(AclVerifyPolicy::None());
+        const Aws::String bucket_prefix = "bench-bucket-" + std::to_string(concurrency) + "-";
+        results.push_back(RunConcurrently("SetAclForBucket", concurrency, bucket_ops,
+            [&](size_t index)
+        {
+            return SetAclForBucket(s3_client, bucket_prefix + std::to_string(index),
+                "bench-grantee", "READ", verifier) == AclApplyResult::Applied;
+        }));
+    }
+    return results;
+}
+
+std::vector<RunResult> BenchmarkUpload(std::uint64_t min_size, std::uint64_t max_size,
+    std::uint64_t upload_bytes, size_t concurrency, const std::filesystem::path& directory)
+{
+    std::vector<RunResult> results;
+    ConcurrencyController::Settings window;
+    window.max_window = concurrency;
+    window.initial_window = std::min(window.initial_window, concurrency);
+    ConcurrencyController controller(window);
+    UploadOptions options;
+    options.controller = &controller;
+
+    const LatencyHistogram& succeeded =
+        Metrics().Histogram(S3Operation::PutObject, S3OperationOutcome::Success);
+    for (std::uint64_t size = min_size; size <= max_size;
+        size = size == max_size ? max_size + 1 : std::min(size * 4, max_size))
+    {
+        const std::filesystem::path file = directory /
+            ("bench_s3_throughput_" + std::to_string(size) + ".bin");
+        {
+            std::ofstream create(file, std::ios_base::binary | std::ios_base::trunc);
+        }
+        std::filesystem::resize_file(file, size);
+
+        const size_t count = static_cast<size_t>(
+            std::min<std::uint64_t>(std::max<std::uint64_t>(upload_bytes / size, 1), 1000));
+        const Aws::String key_prefix = "bench/upload/" + std::to_string(size) + "/";
+        for (size_t outcome = 0; outcome < static_cast<size_t>(S3OperationOutcome::Count);
+            ++outcome)
+            Metrics().Histogram(S3Operation::PutObject,
+                static_cast<S3OperationOutcome>(outcome)).Reset();
+
+        RunResult result{ "PutObject", concurrency, size };
+        std::vector<UploadHandle> uploads;
+        uploads.reserve(count);
+        auto start = std::chrono::steady_clock::now();
+        {
+            QuietOutput quiet;
+            for (size_t i = 0; i < count; ++i)
+                uploads.push_back(put_s3_object_async(bench_bucket,
+                    key_prefix + std::to_string(i), file.string(), options));
+            result.count = wait_all(uploads);
+        }
+        result.seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        result.failed = count - result.count;
+        result.SetLatency(succeeded);
+        results.push_back(result);
+
+        std::error_code ignored;
+        std::filesystem::remove(file, ignored);
+    }
+    return results;
+}
+
+void WriteJson(std::ostream& out, const LocalS3Settings& settings,
+    const std::vector<RunResult>& results)
+{
+    char timestamp[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+    out << "{\n  \"benchmark\": \"bench_s3_throughput\",\n  \"timestamp\": \"" << timestamp
+        << "\",\n  \"hardware_threads\": " << std::thread::hardware_concurrency()
+        << ",\n  \"local_s3\": {\"latency_ms\": " << settings.latency_ms
+        << ", \"latency_sigma\": " << settings.latency_sigma
+        << ", \"bandwidth_mbps\": " << settings.bandwidth_mbps
+        << ", \"throttle_rate\": " << settings.throttle_rate
+        << ", \"error_rate\": " << settings.error_rate
+        << "},\n  \"results\": [";
+    const char* separator = "\n";
+    for (const RunResult& result : results)
+    {
+        out << separator << "    {\"operation\": \"" << result.operation
+            << "\", \"concurrency\": " << result.concurrency;
+        if (result.size)
+            out << ", \"size\": " << result.size;
+        out << ", \"count\": " << result.count << ", \"failed\": " << result.failed
+            << ", \"seconds\": " << result.seconds
+            << ", \"ops_per_sec\": " << result.OpsPerSecond();
+        if (result.size)
+            out << ", \"mb_per_sec\": " << result.MegabytesPerSecond();
+        out << ", \"mean_us\": " << result.mean_us << ", \"p50_us\": " << result.p50_us
+            << ", \"p90_us\": " << result.p90_us << ", \"p99_us\": " << result.p99_us
+            << ", \"max_us\": " << result.max_us << "}";
+        separator = ",\n";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void Report(const RunResult& result)
+{
+    char line[160];
+    std::snprintf(line, sizeof(line),
+        "%-16s %4zu %12llu %8llu %8llu %12.1f %10.1f %10llu %10llu %10llu",
+        result.operation, result.concurrency,
+        static_cast<unsigned long long>(result.size),
+        static_cast<unsigned long long>(result.count),
+        static_cast<unsigned long long>(result.failed),
+        result.OpsPerSecond(), result.MegabytesPerSecond(),
+        static_cast<unsigned long long>(result.p50_us),
+        static_cast<unsigned long long>(result.p99_us),
+        static_cast<unsigned long long>(result.max_us));
+    std::cout << line << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto option = [argc, argv](const char* name, std::uint64_t default_value)
+    {
+        const char* value = GetOption(argc, argv, name);
+        return value ? static_cast<std::uint64_t>(std::strtoull(value, nullptr, 10))
+            : default_value;
+    };
+    const char* output = GetOption(argc, argv, "--output");
+    const std::string output_path = output ? output : "bench_s3_throughput.json";
+    const char* only = GetOption(argc, argv, "--only");
+    const bool run_acl = !only || std::string(only) == "acl";
+    const bool run_upload = !only || std::string(only) == "upload";
+    const size_t max_concurrency = std::max<size_t>(option("--max-concurrency", 64), 1);
+    const size_t acl_objects = std::max<size_t>(option("--acl-objects", 2000), 1);
+    const size_t bucket_ops = std::max<size_t>(option("--bucket-ops", 500), 1);
+    const std::uint64_t min_size = std::max<std::uint64_t>(option("--min-size", 1024), 1);
+    const std::uint64_t max_size = std::max<std::uint64_t>(option("--max-size", 10ull << 30), min_size);
+    const std::uint64_t upload_bytes = option("--upload-bytes", 1ull << 30);
+    const size_t upload_concurrency = std::max<size_t>(option("--upload-concurrency", 16), 1);
+    const char* directory = GetOption(argc, argv, "--dir");
+
+    LocalS3Settings settings;
+    const char* local = GetOption(argc, argv, "--local");
+    if (!local)
+        local = std::getenv("S3_LOCAL");
+    if (local && std::string(local) != "1" && !LocalS3Settings::Parse(local, settings))
+    {
+        std::cout << "Invalid --local settings: " << local << std::endl;
+        return 1;
+    }
+    settings.seed_bucket = bench_bucket;
+    settings.seed_prefix = acl_prefix;
+    settings.seed_objects = run_acl ? acl_objects : 0;
+
+    std::vector<RunResult> results;
+    Aws::SDKOptions options;
+    InstallLocalS3(options, settings);
+    Aws::InitAPI(options);
+    {
+        // Enough connections and executor threads for every caller, upload
+        // and part in flight
+        const size_t threads = std::max({ max_concurrency, upload_concurrency,
+            MultipartSettings().concurrency });
+        S3Runtime runtime(S3Runtime::DefaultConfiguration("us-east-1",
+            static_cast<unsigned>(threads), threads));
+
+        std::cout << "operation        conc         size    count   failed      ops/sec"
+            "       MB/s    p50(us)    p99(us)    max(us)" << std::endl;
+        if (run_acl)
+        {
+            for (const RunResult& result : BenchmarkAcl(runtime.Client(), max_concurrency,
+                acl_objects, bucket_ops))
+            {
+                Report(result);
+                results.push_back(result);
+            }
+        }
+        if (run_upload)
+        {
+            for (const RunResult& result : BenchmarkUpload(min_size, max_size, upload_bytes,
+                upload_concurrency, directory ? std::filesystem::path(directory)
+                : std::filesystem::temp_directory_path()))
+            {
+                Report(result);
+                results.push_back(result);
+            }
+        }
+    }
+    Aws::ShutdownAPI(options);
+
+    std::ofstream out(output_path, std::ios_base::out | std::ios_base::trunc);
+    WriteJson(out, settings, results);
+    if (!out.flush())
+    {
+        std::cout << "Cannot write " << output_path << std::endl;
+        return 1;
+    }
+    std::cout << "Results written to " << output_path << std::endl;
+    return 0;
+}
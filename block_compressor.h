@@ -0,0 +1,287 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#ifdef S3_SAMPLE_ZSTD
+#include <zstd.h>
+#endif
+#include "mapped_file_stream.h"
+#include "work_pool.h"
+
+/**
+ * Whether and how uploads are compressed (see BlockCompressor)
+ */
+struct CompressionSettings
+{
+    // Compress the body with zstd and store the object with
+    // Content-Encoding: zstd; needs a build with S3_SAMPLE_ZSTD
+    bool enabled = false;
+
+    // Level of the first blocks; lowered a step, down to min_level, each
+    // time the network has room for a part that is not compressed yet.
+    // Below 1 the steps are zstd's fast levels, -1, -4, -16 and so on; at
+    // -1024 compressing is about as fast as copying.
+    int level = 3;
+    int min_level = -1024;
+
+    // Bytes of the file compressed as one frame, on one thread
+    std::uint64_t block_size = 4 * 1024 * 1024;
+
+    static bool Available()
+    {
+#ifdef S3_SAMPLE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+/**
+ * zstd compression of a mapped file into upload parts, ahead of the sends
+ *
+ * The file is cut into blocks that are compressed as independent zstd
+ * frames on the WorkPool, several at once; frames concatenate into a
+ * valid zstd stream. Finished frames are appended in order to the part
+ * being filled, which becomes ready once it holds part_size bytes, so every
+ * part but the last is at least part_size.
+ *
+ * The consumer takes ready parts with NextPart() and is called back
+ * (on_ready) when more are ready or the stream has ended. Compression stays
+ * at most lookahead parts ahead of the consumer, bounding memory. When the
+ * consumer asks for a part that is not ready, the network is waiting for
+ * compression, so the level is lowered for the following blocks.
+ */
+class BlockCompressor : public std::enable_shared_from_this<BlockCompressor>
+{
+public:
+    using ReadyCallback = std::function<void(BlockCompressor& compressor)>;
+
+    enum class Status
+    {
+        Ready,      // A part was taken
+        Pending,    // None is ready yet; on_ready will be called
+        Done,       // Every part was taken
+        Failed      // A block could not be compressed
+    };
+
+    static std::shared_ptr<BlockCompressor> Start(std::shared_ptr<const MappedFile> file,
+        const CompressionSettings& settings, std::uint64_t part_size, size_t lookahead,
+        ReadyCallback on_ready)
+    {
+        auto compressor = std::shared_ptr<BlockCompressor>(new BlockCompressor(
+            std::move(file), settings, part_size, lookahead, std::move(on_ready)));
+        std::vector<size_t> blocks;
+        {
+            std::lock_guard<std::mutex> lock(compressor->m_mutex);
+            blocks = compressor->ScheduleLocked();
+        }
+        compressor->Submit(std::move(blocks));
+        return compressor;
+    }
+
+    /**
+     * Take the next part if one is ready
+     */
+    Status NextPart(std::shared_ptr<const MappedFile>& body)
+    {
+        std::vector<size_t> blocks;
+        Status status;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_failed)
+                return Status::Failed;
+            if (!m_ready.empty())
+            {
+                body = std::move(m_ready.front());
+                m_ready.pop_front();
+                blocks = ScheduleLocked();
+                status = Status::Ready;
+            }
+            else if (m_finished)
+                return Status::Done;
+            else
+            {
+                // Once sending has begun, lower the level at most once per part
+                if (m_parts_made > 0 && m_lowered_at != m_parts_made &&
+                    m_level > m_settings.min_level)
+                {
+                    m_lowered_at = m_parts_made;
+                    m_level = std::max(m_level > 1 ? m_level - 1 : m_level > -1 ? -1 :
+                        m_level * 4, m_settings.min_level);
+                }
+                return Status::Pending;
+            }
+        }
+        Submit(std::move(blocks));
+        return status;
+    }
+
+    /**
+     * Stop compressing; blocks already started finish and are dropped
+     */
+    void Cancel()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled = true;
+        m_on_ready = nullptr;
+    }
+
+    // Level the next blocks are compressed at
+    int Level() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_level;
+    }
+
+private:
+    BlockCompressor(std::shared_ptr<const MappedFile> file, const CompressionSettings& settings,
+        std::uint64_t part_size, size_t lookahead, ReadyCallback on_ready)
+        : m_file(std::move(file)), m_settings(settings), m_part_size(part_size),
+        m_lookahead(std::max<size_t>(lookahead, 1)),
+        m_max_blocks(2 * WorkPool::Instance().Threads()),
+        m_block_count(static_cast<size_t>(std::max<std::uint64_t>(
+            (m_file->Size() + BlockSize() - 1) / BlockSize(), 1))),
+        m_level(settings.level), m_on_ready(std::move(on_ready))
+    {
+    }
+
+    std::uint64_t BlockSize() const { return std::max<std::uint64_t>(m_settings.block_size, 1); }
+
+    // Blocks to start now: compressing keeps every core busy until
+    // lookahead parts wait for the consumer; m_mutex must be held
+    std::vector<size_t> ScheduleLocked()
+    {
+        std::vector<size_t> blocks;
+        while (!m_cancelled && !m_failed && m_next_block < m_block_count &&
+            m_next_block - m_next_append < m_max_blocks && m_ready.size() < m_lookahead)
+            blocks.push_back(m_next_block++);
+        return blocks;
+    }
+
+    void Submit(std::vector<size_t> blocks)
+    {
+        const int level = Level();
+        auto self = shared_from_this();
+        for (size_t block : blocks)
+            WorkPool::Instance().Submit([self, block, level]()
+            {
+                self->BlockCompressed(block, self->Compress(block, level));
+            });
+    }
+
+    // The block as one zstd frame; empty if it failed
+    std::vector<char> Compress(size_t block, int level) const
+    {
+        std::vector<char> frame;
+#ifdef S3_SAMPLE_ZSTD
+        const std::uint64_t offset = block * BlockSize();
+        const size_t size = static_cast<size_t>(std::min(BlockSize(), m_file->Size() - offset));
+        thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> context(
+            ZSTD_createCCtx(), ZSTD_freeCCtx);
+        frame.resize(ZSTD_compressBound(size));
+        size_t written = ZSTD_compressCCtx(context.get(), frame.data(), frame.size(),
+            m_file->Data() + offset, size, level);
+        frame.resize(ZSTD_isError(written) ? 0 : written);
+#else
+        (void)block;
+        (void)level;
+#endif
+        return frame;
+    }
+
+    // Append the frames that are next in order, make ready the parts they
+    // fill, and start more blocks
+    void BlockCompressed(size_t block, std::vector<char> frame)
+    {
+        ReadyCallback on_ready;
+        std::vector<size_t> blocks;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_cancelled || m_failed)
+                return;
+            if (frame.empty())
+                m_failed = true;
+            m_frames[block] = std::move(frame);
+            const size_t ready = m_ready.size();
+            for (auto next = m_frames.begin(); !m_failed && next != m_frames.end() &&
+                next->first == m_next_append; next = m_frames.erase(next))
+            {
+                m_part.insert(m_part.end(), next->second.begin(), next->second.end());
+                if (++m_next_append < m_block_count && m_part.size() >= m_part_size)
+                    MakePartLocked();
+            }
+            if (!m_failed && m_next_append == m_block_count && !m_finished)
+            {
+                MakePartLocked();
+                m_finished = true;
+            }
+            blocks = ScheduleLocked();
+            if (m_failed || m_finished || m_ready.size() > ready)
+                on_ready = m_on_ready;
+            // The last call; drop the consumer it refers to
+            if (m_failed || m_finished)
+                m_on_ready = nullptr;
+        }
+        Submit(std::move(blocks));
+        if (on_ready)
+            on_ready(*this);
+    }
+
+    void MakePartLocked()
+    {
+        m_ready.push_back(MappedFile::FromMemory(std::move(m_part)));
+        m_part = std::vector<char>();
+        // The final part leaves no blocks to fill a new one
+        if (m_next_append < m_block_count)
+            m_part.reserve(static_cast<size_t>(std::min(m_part_size, m_file->Size())));
+        ++m_parts_made;
+    }
+
+    const std::shared_ptr<const MappedFile> m_file;
+    const CompressionSettings m_settings;
+    const std::uint64_t m_part_size;
+    const size_t m_lookahead;
+    const size_t m_max_blocks;
+    const size_t m_block_count;
+
+    mutable std::mutex m_mutex;
+    int m_level;
+    ReadyCallback m_on_ready;
+    size_t m_next_block = 0;        // Next to start
+    size_t m_next_append = 0;       // Next to append to m_part
+    std::map<size_t, std::vector<char>> m_frames;  // Compressed out of order
+    std::vector<char> m_part;
+    std::deque<std::shared_ptr<const MappedFile>> m_ready;
+    size_t m_parts_made = 0;
+    size_t m_lowered_at = 0;
+    bool m_finished = false;
+    bool m_failed = false;
+    bool m_cancelled = false;
+};
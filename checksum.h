@@ -0,0 +1,85 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/core/utils/HashingUtils.h>
+#include <aws/core/utils/crypto/CRC32.h>
+#include <aws/core/utils/crypto/CRC64.h>
+#include <aws/core/utils/crypto/Sha256.h>
+#include <aws/s3/model/ChecksumAlgorithm.h>
+#include <memory>
+
+/**
+ * Checksum of a kind S3 verifies uploads against, fed a piece at a time
+ *
+ * The local S3 stand-in checks the checksums clients send with it. The
+ * hashes are the SDK's own, those it computes trailing checksums with, so
+ * the stand-in agrees with the client on every algorithm here.
+ */
+class StreamingChecksum
+{
+public:
+    explicit StreamingChecksum(Aws::S3::Model::ChecksumAlgorithm algorithm)
+        : m_algorithm(algorithm)
+    {
+        using Aws::S3::Model::ChecksumAlgorithm;
+        switch (algorithm)
+        {
+        case ChecksumAlgorithm::CRC32C:
+            m_hash = Aws::MakeShared<Aws::Utils::Crypto::CRC32C>("StreamingChecksum");
+            break;
+        case ChecksumAlgorithm::CRC64NVME:
+            m_hash = Aws::MakeShared<Aws::Utils::Crypto::CRC64>("StreamingChecksum");
+            break;
+        case ChecksumAlgorithm::SHA256:
+            m_hash = Aws::MakeShared<Aws::Utils::Crypto::Sha256>("StreamingChecksum");
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Whether algorithm is one of those computed here
+    static bool Supported(Aws::S3::Model::ChecksumAlgorithm algorithm)
+    {
+        using Aws::S3::Model::ChecksumAlgorithm;
+        return algorithm == ChecksumAlgorithm::CRC32C ||
+            algorithm == ChecksumAlgorithm::CRC64NVME || algorithm == ChecksumAlgorithm::SHA256;
+    }
+
+    Aws::S3::Model::ChecksumAlgorithm Algorithm() const { return m_algorithm; }
+
+    void Update(const void* data, size_t size)
+    {
+        // The SDK's hashes only read the buffer
+        if (m_hash)
+            m_hash->Update(const_cast<unsigned char*>(static_cast<const unsigned char*>(data)),
+                size);
+    }
+
+    // Base64 of the digest, as sent in x-amz-checksum-* headers and
+    // trailers; call once, after the last Update()
+    Aws::String Base64()
+    {
+        return m_hash ? Aws::Utils::HashingUtils::Base64Encode(m_hash->GetHash().GetResult())
+            : Aws::String();
+    }
+
+private:
+    Aws::S3::Model::ChecksumAlgorithm m_algorithm;
+    std::shared_ptr<Aws::Utils::Crypto::Hash> m_hash;
+};
@@ -0,0 +1,45 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <cstring>
+
+/**
+ * Return the value of a --name=value command-line option, or nullptr
+ */
+inline const char* GetOption(int argc, char** argv, const char* name)
+{
+    size_t name_length = std::strlen(name);
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], name, name_length) == 0 &&
+            argv[i][name_length] == '=')
+            return argv[i] + name_length + 1;
+    }
+    return nullptr;
+}
+
+/**
+ * Whether a --name flag is present on the command line
+ */
+inline bool HasFlag(int argc, char** argv, const char* name)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], name) == 0)
+            return true;
+    }
+    return false;
+}
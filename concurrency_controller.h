@@ -0,0 +1,203 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/core/http/HttpResponse.h>
+#include <aws/s3/S3Errors.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Whether an S3 error means the request was throttled (503 SlowDown)
+ */
+inline bool IsThrottlingError(const Aws::Client::AWSError<Aws::S3::S3Errors>& error)
+{
+    return error.GetErrorType() == Aws::S3::S3Errors::SLOW_DOWN ||
+        error.GetErrorType() == Aws::S3::S3Errors::THROTTLING ||
+        error.GetResponseCode() == Aws::Http::HttpResponseCode::SERVICE_UNAVAILABLE ||
+        error.GetExceptionName() == "SlowDown";
+}
+
+/**
+ * Adaptive (AIMD) bound on the number of requests in flight
+ *
+ * Works like InFlightLimiter, except that the limit, the window, moves:
+ * every healthy completion adds 1/window, so the window grows by about one
+ * request per window's worth of completions, and a throttled completion
+ * multiplies it by decrease_factor. A completion is healthy when it
+ * succeeded, its latency is within latency_factor of the lowest latency
+ * seen for requests of its size, and the recent error rate is below
+ * max_error_rate. Sizes, given to Acquire(), are compared in classes a
+ * factor of 4 apart, so that an upload of a large file is not judged by
+ * the latency of a small one.
+ *
+ * Only one decrease is applied per window: throttles reported by requests
+ * that were started before the last decrease are ignored, since they
+ * reflect the old window.
+ */
+class ConcurrencyController
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Settings
+    {
+        size_t initial_window = 16;
+        size_t min_window = 1;
+        size_t max_window = 1024;
+        double decrease_factor = 0.5;
+        double latency_factor = 3.0;
+        double max_error_rate = 0.05;
+    };
+
+    enum class Signal
+    {
+        Success,    // The request succeeded
+        Throttled,  // The request was throttled (see IsThrottlingError())
+        Error       // The request failed for another reason
+    };
+
+    /**
+     * Handed out by Acquire() and returned to Release()
+     */
+    struct Ticket
+    {
+        Clock::time_point start;
+        std::uint64_t epoch;
+        size_t size_class;
+    };
+
+    explicit ConcurrencyController(const Settings& settings)
+        : m_settings(settings)
+    {
+        m_settings.min_window = std::max<size_t>(m_settings.min_window, 1);
+        m_settings.max_window = std::max(m_settings.max_window, m_settings.min_window);
+        m_window = static_cast<double>(std::min(std::max(m_settings.initial_window,
+            m_settings.min_window), m_settings.max_window));
+    }
+
+    /**
+     * Wait until the window has room, then count one more request in flight
+     *
+     * size is the number of bytes the request moves, when requests of very
+     * different sizes share the window; otherwise 0.
+     */
+    Ticket Acquire(std::uint64_t size = 0)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]() { return m_in_flight < WindowLocked(); });
+        ++m_in_flight;
+        return Ticket{ Clock::now(), m_epoch, SizeClass(size) };
+    }
+
+    /**
+     * Report the completion of a request started with ticket
+     */
+    void Release(const Ticket& ticket, Signal signal)
+    {
+        auto latency = Clock::now() - ticket.start;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_in_flight;
+
+        // Exponentially weighted error rate over roughly the last 100 requests
+        m_error_rate = 0.99 * m_error_rate + (signal == Signal::Success ? 0.0 : 0.01);
+
+        if (signal == Signal::Throttled)
+        {
+            ++m_throttle_count;
+            if (ticket.epoch == m_epoch)
+            {
+                m_window = std::max(m_window * m_settings.decrease_factor,
+                    static_cast<double>(m_settings.min_window));
+                ++m_epoch;
+            }
+        }
+        else if (signal == Signal::Success)
+        {
+            Clock::duration& min_latency = m_min_latency[ticket.size_class];
+            if (min_latency == Clock::duration::zero() || latency < min_latency)
+                min_latency = latency;
+            bool latency_healthy = latency <= min_latency * m_settings.latency_factor;
+            if (latency_healthy && m_error_rate < m_settings.max_error_rate)
+            {
+                m_window = std::min(m_window + 1.0 / m_window,
+                    static_cast<double>(m_settings.max_window));
+            }
+        }
+
+        // Notify while holding the lock; see InFlightLimiter::Release()
+        m_changed.notify_all();
+    }
+
+    void WaitIdle()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]() { return m_in_flight == 0; });
+    }
+
+    /**
+     * Current window (the metric to watch while tuning)
+     */
+    size_t Window() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return WindowLocked();
+    }
+
+    size_t InFlight() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_in_flight;
+    }
+
+    size_t ThrottleCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_throttle_count;
+    }
+
+private:
+    // One class per factor of 4 in size: 0, 1-3, 4-15, ...
+    static constexpr size_t SIZE_CLASSES = 33;
+
+    static size_t SizeClass(std::uint64_t size)
+    {
+        size_t bits = 0;
+        for (; size; size >>= 1)
+            ++bits;
+        return (bits + 1) / 2;
+    }
+
+    size_t WindowLocked() const
+    {
+        return static_cast<size_t>(m_window);
+    }
+
+    Settings m_settings;
+    double m_window;
+    std::uint64_t m_epoch = 0;
+    size_t m_in_flight = 0;
+    size_t m_throttle_count = 0;
+    double m_error_rate = 0;
+    std::array<Clock::duration, SIZE_CLASSES> m_min_latency{};     // By size class
+    mutable std::mutex m_mutex;
+    std::condition_variable m_changed;
+};
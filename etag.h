@@ -0,0 +1,107 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/core/utils/HashingUtils.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "mapped_file_stream.h"
+#include "work_pool.h"
+
+/**
+ * Called once with the local ETag of a file (see local_etag_async())
+ */
+using LocalETagCallback = std::function<void(Aws::String etag)>;
+
+/**
+ * Compute the ETag S3 gives the object uploaded from file, without the
+ * quotes, and pass it to on_etag: the hex MD5 of the body, or, when it goes
+ * up as a multipart upload with parts of part_size bytes (part_size > 0),
+ * the hex MD5 of the parts' MD5s followed by "-" and the number of parts
+ *
+ * Each part is hashed by a task of the WorkPool, so the caller never waits
+ * and a large file is hashed on every core; on_etag is called on the
+ * thread of the last part to finish. Objects encrypted with SSE-KMS or
+ * SSE-C get other ETags, which never match.
+ */
+inline void local_etag_async(std::shared_ptr<const MappedFile> file, std::uint64_t part_size,
+    LocalETagCallback on_etag)
+{
+    struct Parts
+    {
+        std::shared_ptr<const MappedFile> file;
+        std::uint64_t part_size;
+        LocalETagCallback on_etag;
+        std::vector<Aws::Utils::ByteBuffer> digests;
+        std::atomic<size_t> remaining;
+    };
+
+    const std::uint64_t size = part_size > 0 ? part_size : file->Size();
+    const size_t count = part_size > 0
+        ? static_cast<size_t>(std::max<std::uint64_t>((file->Size() + size - 1) / size, 1))
+        : 1;
+    auto parts = std::make_shared<Parts>();
+    parts->file = std::move(file);
+    parts->part_size = part_size;
+    parts->on_etag = std::move(on_etag);
+    parts->digests.resize(count);
+    parts->remaining = count;
+
+    for (size_t part = 0; part < count; ++part)
+        WorkPool::Instance().Submit([parts, part, size]()
+        {
+            const std::uint64_t offset = part * size;
+            MappedFileStream body(parts->file, offset,
+                std::min(size, parts->file->Size() - offset));
+            parts->digests[part] = Aws::Utils::HashingUtils::CalculateMD5(body);
+            if (parts->remaining.fetch_sub(1) != 1)
+                return;
+
+            if (parts->part_size == 0)
+            {
+                parts->on_etag(Aws::Utils::HashingUtils::HexEncode(parts->digests[0]));
+                return;
+            }
+            Aws::String concatenated;
+            for (const auto& digest : parts->digests)
+                concatenated.append(reinterpret_cast<const char*>(digest.GetUnderlyingData()),
+                    digest.GetLength());
+            parts->on_etag(Aws::Utils::HashingUtils::HexEncode(
+                Aws::Utils::HashingUtils::CalculateMD5(concatenated)) + "-" +
+                std::to_string(parts->digests.size()).c_str());
+        });
+}
+
+/**
+ * Whether two ETags are the same, quoted or not
+ */
+inline bool same_etag(const Aws::String& a, const Aws::String& b)
+{
+    auto unquoted = [](const Aws::String& etag)
+    {
+        size_t begin = etag.find_first_not_of('"');
+        size_t end = etag.find_last_not_of('"');
+        return begin == Aws::String::npos ? Aws::String() : etag.substr(begin, end - begin + 1);
+    };
+    return !a.empty() && unquoted(a) == unquoted(b);
+}
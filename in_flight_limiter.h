@@ -0,0 +1,69 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+/**
+ * Bound the number of asynchronous operations in flight
+ *
+ * The dispatching thread calls Acquire() before starting an operation and
+ * the operation's completion callback calls Release(). WaitIdle() blocks
+ * until every started operation has finished.
+ */
+class InFlightLimiter
+{
+public:
+    explicit InFlightLimiter(size_t limit)
+        : m_limit(limit ? limit : 1)
+    {
+    }
+
+    void Acquire()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]() { return m_in_flight < m_limit; });
+        ++m_in_flight;
+    }
+
+    void Release()
+    {
+        // Notify while holding the lock: once it is released a thread in
+        // WaitIdle() may return and destroy this object
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_in_flight;
+        m_changed.notify_all();
+    }
+
+    void WaitIdle()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this]() { return m_in_flight == 0; });
+    }
+
+    size_t InFlight() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_in_flight;
+    }
+
+private:
+    const size_t m_limit;
+    size_t m_in_flight = 0;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_changed;
+};
@@ -0,0 +1,365 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "concurrency_controller.h"
+
+/**
+ * Lock-free latency histogram with HDR-style log-linear buckets
+ *
+ * Latencies are kept in microseconds. Values below 64 have a bucket each;
+ * above, each power of two is split into 32 buckets, so every recorded
+ * value is within about 3% of its bucket's lower bound. Record() is a few
+ * relaxed atomic increments and may be called from any thread; readers see
+ * a consistent enough snapshot for reporting.
+ */
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 6;
+    static constexpr std::uint64_t SUB_BUCKET_COUNT = 1ull << SUB_BUCKET_BITS;
+    static constexpr std::uint64_t HALF_SUB_BUCKET_COUNT = SUB_BUCKET_COUNT / 2;
+    static constexpr unsigned MAX_SHIFT = 32;    // Up to 2^38 us, about 3 days
+    static constexpr size_t BUCKET_COUNT = SUB_BUCKET_COUNT + MAX_SHIFT * HALF_SUB_BUCKET_COUNT;
+
+    static constexpr size_t BucketIndex(std::uint64_t micros)
+    {
+        if (micros < SUB_BUCKET_COUNT)
+            return static_cast<size_t>(micros);
+        unsigned shift = 0;
+        while ((micros >> shift) >= SUB_BUCKET_COUNT)
+            ++shift;
+        if (shift > MAX_SHIFT)
+            return BUCKET_COUNT - 1;
+        return static_cast<size_t>(SUB_BUCKET_COUNT + (shift - 1) * HALF_SUB_BUCKET_COUNT +
+            ((micros >> shift) - HALF_SUB_BUCKET_COUNT));
+    }
+
+    static constexpr std::uint64_t BucketLowerBound(size_t index)
+    {
+        if (index < SUB_BUCKET_COUNT)
+            return index;
+        size_t shift = (index - SUB_BUCKET_COUNT) / HALF_SUB_BUCKET_COUNT + 1;
+        std::uint64_t sub_bucket = (index - SUB_BUCKET_COUNT) % HALF_SUB_BUCKET_COUNT +
+            HALF_SUB_BUCKET_COUNT;
+        return sub_bucket << shift;
+    }
+
+    void Record(std::chrono::steady_clock::duration latency)
+    {
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        Record(static_cast<std::uint64_t>(std::max<decltype(micros)>(micros, 0)));
+    }
+
+    void Record(std::uint64_t micros)
+    {
+        m_buckets[BucketIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_total.fetch_add(micros, std::memory_order_relaxed);
+        std::uint64_t max = m_max.load(std::memory_order_relaxed);
+        while (micros > max &&
+            !m_max.compare_exchange_weak(max, micros, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    std::uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+    std::uint64_t MaxMicros() const { return m_max.load(std::memory_order_relaxed); }
+
+    double MeanMicros() const
+    {
+        std::uint64_t count = Count();
+        return count ? static_cast<double>(m_total.load(std::memory_order_relaxed)) / count : 0;
+    }
+
+    /**
+     * Latency that at least fraction of the recorded latencies do not
+     * exceed, rounded up to the top of its bucket as HdrHistogram does
+     */
+    std::uint64_t PercentileMicros(double fraction) const
+    {
+        std::uint64_t count = Count();
+        if (count == 0)
+            return 0;
+        std::uint64_t rank = static_cast<std::uint64_t>(fraction * count);
+        rank = std::min(std::max<std::uint64_t>(rank, 1), count);
+        std::uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(BucketLowerBound(i + 1) - 1, MaxMicros());
+        }
+        return MaxMicros();
+    }
+
+    /**
+     * Forget all recorded latencies; not atomic with respect to Record()
+     */
+    void Reset()
+    {
+        for (auto& bucket : m_buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        m_count.store(0, std::memory_order_relaxed);
+        m_total.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, BUCKET_COUNT> m_buckets{};
+    std::atomic<std::uint64_t> m_count{ 0 };
+    std::atomic<std::uint64_t> m_total{ 0 };
+    std::atomic<std::uint64_t> m_max{ 0 };
+};
+
+static_assert(LatencyHistogram::BucketIndex(63) == 63 &&
+    LatencyHistogram::BucketIndex(64) == 64, "linear range");
+static_assert(LatencyHistogram::BucketLowerBound(LatencyHistogram::BucketIndex(1000)) <= 1000 &&
+    1000 - LatencyHistogram::BucketLowerBound(LatencyHistogram::BucketIndex(1000)) < 1000 / 32,
+    "precision");
+
+/**
+ * S3 operations whose latencies are recorded
+ */
+enum class S3Operation
+{
+    GetBucketAcl,
+    PutBucketAcl,
+    GetObjectAcl,
+    PutObjectAcl,
+    PutObject,
+    CreateMultipartUpload,
+    UploadPart,
+    CompleteMultipartUpload,
+    HeadObject,
+    Count
+};
+
+enum class S3OperationOutcome
+{
+    Success,
+    Throttled,  // See IsThrottlingError()
+    Error,
+    Count
+};
+
+inline const char* S3OperationName(S3Operation operation)
+{
+    static const char* const names[] = { "GetBucketAcl", "PutBucketAcl",
+        "GetObjectAcl", "PutObjectAcl", "PutObject", "CreateMultipartUpload", "UploadPart",
+        "CompleteMultipartUpload", "HeadObject" };
+    return names[static_cast<size_t>(operation)];
+}
+
+inline const char* S3OperationOutcomeName(S3OperationOutcome outcome)
+{
+    static const char* const names[] = { "success", "throttled", "error" };
+    return names[static_cast<size_t>(outcome)];
+}
+
+/**
+ * Latency histograms of every S3Operation, split by outcome
+ *
+ * Metrics() is the process-wide instance that the ACL and upload code
+ * records into; recording takes no lock.
+ */
+class LatencyMetrics
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    LatencyMetrics()
+        : m_start(Clock::now())
+    {
+    }
+
+    LatencyHistogram& Histogram(S3Operation operation, S3OperationOutcome outcome)
+    {
+        return m_histograms[static_cast<size_t>(operation)][static_cast<size_t>(outcome)];
+    }
+
+    const LatencyHistogram& Histogram(S3Operation operation, S3OperationOutcome outcome) const
+    {
+        return m_histograms[static_cast<size_t>(operation)][static_cast<size_t>(outcome)];
+    }
+
+    /**
+     * Record a request started at start from its SDK outcome
+     */
+    template <typename Outcome>
+    void Record(S3Operation operation, Clock::time_point start, const Outcome& outcome)
+    {
+        S3OperationOutcome result = outcome.IsSuccess() ? S3OperationOutcome::Success
+            : IsThrottlingError(outcome.GetError()) ? S3OperationOutcome::Throttled
+            : S3OperationOutcome::Error;
+        Histogram(operation, result).Record(Clock::now() - start);
+    }
+
+    double ElapsedSeconds() const
+    {
+        return std::chrono::duration<double>(Clock::now() - m_start).count();
+    }
+
+    /**
+     * Print count, throughput and percentiles of each histogram in use
+     */
+    void Report(std::ostream& out) const
+    {
+        const double elapsed = ElapsedSeconds();
+        out << "Latency (us) over " << std::fixed << std::setprecision(1) << elapsed
+            << " s:\n";
+        out << std::left << std::setw(25) << "operation" << std::setw(10) << "outcome"
+            << std::right << std::setw(10) << "count" << std::setw(12) << "per sec"
+            << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99"
+            << std::setw(10) << "p999" << std::setw(10) << "max" << "\n";
+        ForEachInUse([&](S3Operation operation, S3OperationOutcome outcome,
+            const LatencyHistogram& histogram)
+        {
+            out << std::left << std::setw(25) << S3OperationName(operation)
+                << std::setw(10) << S3OperationOutcomeName(outcome) << std::right
+                << std::setw(10) << histogram.Count()
+                << std::setw(12) << (elapsed > 0 ? histogram.Count() / elapsed : 0)
+                << std::setw(10) << histogram.PercentileMicros(0.50)
+                << std::setw(10) << histogram.PercentileMicros(0.90)
+                << std::setw(10) << histogram.PercentileMicros(0.99)
+                << std::setw(10) << histogram.PercentileMicros(0.999)
+                << std::setw(10) << histogram.MaxMicros() << "\n";
+        });
+        out << std::defaultfloat << std::flush;
+    }
+
+    /**
+     * Write a JSON snapshot of the histograms in use to path, replacing it
+     * atomically so that readers never see a partial file
+     */
+    bool WriteFile(const std::string& path) const
+    {
+        const std::string temp_path = path + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios_base::out | std::ios_base::trunc);
+            if (!out)
+                return false;
+            const double elapsed = ElapsedSeconds();
+            out << "{\"elapsed_seconds\":" << elapsed << ",\"operations\":[";
+            const char* separator = "";
+            ForEachInUse([&](S3Operation operation, S3OperationOutcome outcome,
+                const LatencyHistogram& histogram)
+            {
+                out << separator << "{\"operation\":\"" << S3OperationName(operation)
+                    << "\",\"outcome\":\"" << S3OperationOutcomeName(outcome)
+                    << "\",\"count\":" << histogram.Count()
+                    << ",\"per_second\":" << (elapsed > 0 ? histogram.Count() / elapsed : 0)
+                    << ",\"mean_us\":" << histogram.MeanMicros()
+                    << ",\"p50_us\":" << histogram.PercentileMicros(0.50)
+                    << ",\"p90_us\":" << histogram.PercentileMicros(0.90)
+                    << ",\"p99_us\":" << histogram.PercentileMicros(0.99)
+                    << ",\"p999_us\":" << histogram.PercentileMicros(0.999)
+                    << ",\"max_us\":" << histogram.MaxMicros() << "}";
+                separator = ",";
+            });
+            out << "]}\n";
+            if (!out.flush())
+                return false;
+        }
+        return std::rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    template <typename Visit>
+    void ForEachInUse(Visit visit) const
+    {
+        for (size_t op = 0; op < static_cast<size_t>(S3Operation::Count); ++op)
+        {
+            for (size_t result = 0; result < static_cast<size_t>(S3OperationOutcome::Count); ++result)
+            {
+                const LatencyHistogram& histogram = m_histograms[op][result];
+                if (histogram.Count())
+                    visit(static_cast<S3Operation>(op),
+                        static_cast<S3OperationOutcome>(result), histogram);
+            }
+        }
+    }
+
+    const Clock::time_point m_start;
+    LatencyHistogram m_histograms[static_cast<size_t>(S3Operation::Count)]
+        [static_cast<size_t>(S3OperationOutcome::Count)];
+};
+
+inline LatencyMetrics& Metrics()
+{
+    static LatencyMetrics metrics;
+    return metrics;
+}
+
+/**
+ * Write Metrics() to a file every interval, and once more when destroyed
+ */
+class MetricsFileWriter
+{
+public:
+    MetricsFileWriter(const std::string& path,
+        std::chrono::milliseconds interval = std::chrono::seconds(10))
+        : m_path(path), m_interval(interval)
+    {
+        m_thread = std::thread([this]()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_stop_wakeup.wait_for(lock, m_interval, [this]() { return m_stop; }))
+                Write();
+        });
+    }
+
+    ~MetricsFileWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_stop_wakeup.notify_all();
+        m_thread.join();
+        Write();
+    }
+
+    MetricsFileWriter(const MetricsFileWriter&) = delete;
+    MetricsFileWriter& operator=(const MetricsFileWriter&) = delete;
+
+private:
+    void Write()
+    {
+        if (!Metrics().WriteFile(m_path))
+            std::cout << "Cannot write metrics file " << m_path << std::endl;
+    }
+
+    const std::string m_path;
+    const std::chrono::milliseconds m_interval;
+    std::mutex m_mutex;
+    std::condition_variable m_stop_wakeup;
+    bool m_stop = false;
+    std::thread m_thread;
+};
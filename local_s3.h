@@ -0,0 +1,936 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/core/http/HttpClient.h>
+#include <aws/core/http/HttpClientFactory.h>
+#include <aws/core/http/HttpRequest.h>
+#include <aws/core/http/HttpResponse.h>
+#include <aws/core/http/URI.h>
+#include <aws/core/http/standard/StandardHttpRequest.h>
+#include <aws/core/http/standard/StandardHttpResponse.h>
+#include <aws/core/utils/HashingUtils.h>
+#include <aws/core/utils/crypto/MD5.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include "checksum.h"
+
+/**
+ * Behavior of the local S3 stand-in
+ */
+struct LocalS3Settings
+{
+    // Latency of each request: log-normal with this median and sigma
+    double latency_ms = 0;
+    double latency_sigma = 0.5;
+
+    // Aggregate cap on request body bytes (uploads); 0 is unlimited
+    double bandwidth_mbps = 0;
+
+    // Fraction of requests failed with 503 SlowDown and 500 InternalError
+    double throttle_rate = 0;
+    double error_rate = 0;
+
+    // Objects created up front under seed_prefix in seed_bucket, so that
+    // ACL jobs have something to work on
+    size_t seed_objects = 0;
+    Aws::String seed_bucket = "BUCKET_NAME";
+    Aws::String seed_prefix = "";
+    std::uint64_t seed_object_size = 1024;
+
+    Aws::String owner_id = "local-owner-canonical-id";
+
+    // Whether body checksums are checked; off, only what the client itself
+    // computes costs CPU
+    bool verify_checksums = true;
+
+    /**
+     * Parse "name=value,name=value,..." (names as above, without the seed_
+     * and _ms/_mbps parts: latency, sigma, bandwidth, throttle, error,
+     * objects, bucket, prefix, size, owner, verify)
+     */
+    static bool Parse(const Aws::String& text, LocalS3Settings& settings)
+    {
+        std::istringstream fields(text);
+        Aws::String field;
+        while (std::getline(fields, field, ','))
+        {
+            if (field.empty())
+                continue;
+            size_t equals = field.find('=');
+            if (equals == Aws::String::npos)
+                return false;
+            const Aws::String name = field.substr(0, equals);
+            const Aws::String value = field.substr(equals + 1);
+            const char* number = value.c_str();
+            if (name == "latency")
+                settings.latency_ms = std::strtod(number, nullptr);
+            else if (name == "sigma")
+                settings.latency_sigma = std::strtod(number, nullptr);
+            else if (name == "bandwidth")
+                settings.bandwidth_mbps = std::strtod(number, nullptr);
+            else if (name == "throttle")
+                settings.throttle_rate = std::strtod(number, nullptr);
+            else if (name == "error")
+                settings.error_rate = std::strtod(number, nullptr);
+            else if (name == "objects")
+                settings.seed_objects = std::strtoull(number, nullptr, 10);
+            else if (name == "bucket")
+                settings.seed_bucket = value;
+            else if (name == "prefix")
+                settings.seed_prefix = value;
+            else if (name == "size")
+                settings.seed_object_size = std::strtoull(number, nullptr, 10);
+            else if (name == "owner")
+                settings.owner_id = value;
+            else if (name == "verify")
+                settings.verify_checksums = value != "0";
+            else
+                return false;
+        }
+        return true;
+    }
+};
+
+/**
+ * In-memory buckets, objects and ACLs behind the stand-in
+ *
+ * Object bodies are read and discarded; only sizes and ETags are kept, so
+ * multi-gigabyte uploads cost no memory. The ETags are those S3 gives
+ * unencrypted objects: the hex MD5 of the body, or for a multipart upload
+ * the hex MD5 of the parts' MD5s followed by "-" and the number of parts.
+ * Seeded objects have seed_object_size zero bytes for their ETag. ACLs
+ * are kept as the policy XML the client sent (or one built from
+ * canned/grant headers), and every object with the default ACL shares a
+ * single copy.
+ */
+class LocalS3Store
+{
+public:
+    explicit LocalS3Store(const LocalS3Settings& settings)
+        : m_settings(settings),
+        m_default_acl(std::make_shared<const Aws::String>(
+            AclXml(settings.owner_id, { { "id", settings.owner_id, "FULL_CONTROL" } })))
+    {
+        char name[32];
+        const Aws::String seed_etag = settings.seed_objects == 0 ? Aws::String()
+            : ETag(Aws::Utils::HashingUtils::CalculateMD5(
+                Aws::String(static_cast<size_t>(settings.seed_object_size), '\0')));
+        for (size_t i = 0; i < settings.seed_objects; ++i)
+        {
+            std::snprintf(name, sizeof(name), "object-%08zu", i);
+            PutObject(settings.seed_bucket, settings.seed_prefix + name,
+                settings.seed_object_size, seed_etag);
+        }
+    }
+
+    const LocalS3Settings& Settings() const { return m_settings; }
+
+    struct Grant
+    {
+        const char* kind;       // "id", "uri" or "emailAddress"
+        Aws::String grantee;
+        const char* permission;
+    };
+
+    static Aws::String XmlEscape(const Aws::String& text)
+    {
+        Aws::String escaped;
+        escaped.reserve(text.size());
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case '&': escaped += "&amp;"; break;
+            case '<': escaped += "&lt;"; break;
+            case '>': escaped += "&gt;"; break;
+            case '"': escaped += "&quot;"; break;
+            default: escaped += c; break;
+            }
+        }
+        return escaped;
+    }
+
+    static Aws::String AclXml(const Aws::String& owner_id, const Aws::Vector<Grant>& grants)
+    {
+        Aws::String xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+            "<AccessControlPolicy xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\"><Owner><ID>" +
+            XmlEscape(owner_id) + "</ID></Owner><AccessControlList>";
+        for (const Grant& grant : grants)
+        {
+            const bool group = std::string(grant.kind) == "uri";
+            const bool email = std::string(grant.kind) == "emailAddress";
+            xml += "<Grant><Grantee xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+                "xsi:type=\"";
+            xml += group ? "Group\"><URI>" : email ? "AmazonCustomerByEmail\"><EmailAddress>"
+                : "CanonicalUser\"><ID>";
+            xml += XmlEscape(grant.grantee);
+            xml += group ? "</URI>" : email ? "</EmailAddress>" : "</ID>";
+            xml += "</Grantee><Permission>";
+            xml += grant.permission;
+            xml += "</Permission></Grant>";
+        }
+        return xml + "</AccessControlList></AccessControlPolicy>";
+    }
+
+    // Quoted hex of an MD5 digest, as ETags are sent
+    static Aws::String ETag(const Aws::Utils::ByteBuffer& md5)
+    {
+        return "\"" + Aws::Utils::HashingUtils::HexEncode(md5) + "\"";
+    }
+
+    void PutObject(const Aws::String& bucket_name, const Aws::String& key, std::uint64_t size,
+        const Aws::String& etag)
+    {
+        Object object{ size, etag, m_default_acl };
+        std::lock_guard<std::mutex> lock(m_mutex);
+        BucketLocked(bucket_name).objects[key] = std::move(object);
+    }
+
+    bool HeadObject(const Aws::String& bucket_name, const Aws::String& key,
+        std::uint64_t& size, Aws::String& etag)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Bucket& bucket = BucketLocked(bucket_name);
+        auto found = bucket.objects.find(key);
+        if (found == bucket.objects.end())
+            return false;
+        size = found->second.size;
+        etag = found->second.etag;
+        return true;
+    }
+
+    /**
+     * ACL XML of a bucket (key empty) or object; nullptr if there is none
+     */
+    std::shared_ptr<const Aws::String> GetAcl(const Aws::String& bucket_name, const Aws::String& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Bucket& bucket = BucketLocked(bucket_name);
+        if (key.empty())
+            return bucket.acl;
+        auto found = bucket.objects.find(key);
+        return found == bucket.objects.end() ? nullptr : found->second.acl;
+    }
+
+    bool SetAcl(const Aws::String& bucket_name, const Aws::String& key, Aws::String&& acl_xml)
+    {
+        auto acl = std::make_shared<const Aws::String>(std::move(acl_xml));
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Bucket& bucket = BucketLocked(bucket_name);
+        if (key.empty())
+        {
+            bucket.acl = std::move(acl);
+            return true;
+        }
+        auto found = bucket.objects.find(key);
+        if (found == bucket.objects.end())
+            return false;
+        found->second.acl = std::move(acl);
+        return true;
+    }
+
+    /**
+     * ListObjectsV2 result XML for up to max_keys keys under prefix from
+     * start_key on
+     */
+    Aws::String List(const Aws::String& bucket_name, const Aws::String& prefix,
+        const Aws::String& start_key, size_t max_keys, bool fetch_owner)
+    {
+        Aws::String contents;
+        Aws::String next_key;
+        size_t count = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Bucket& bucket = BucketLocked(bucket_name);
+            auto it = bucket.objects.lower_bound(std::max(start_key, prefix));
+            for (; it != bucket.objects.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+                ++it)
+            {
+                if (count == max_keys)
+                {
+                    next_key = it->first;
+                    break;
+                }
+                contents += "<Contents><Key>" + XmlEscape(it->first) + "</Key><Size>" +
+                    std::to_string(it->second.size) + "</Size><ETag>" +
+                    XmlEscape(it->second.etag) + "</ETag>";
+                if (fetch_owner)
+                    contents += "<Owner><ID>" + XmlEscape(m_settings.owner_id) + "</ID></Owner>";
+                contents += "<StorageClass>STANDARD</StorageClass></Contents>";
+                ++count;
+            }
+        }
+
+        Aws::String xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+            "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\"><Name>" +
+            XmlEscape(bucket_name) + "</Name><Prefix>" + XmlEscape(prefix) + "</Prefix><KeyCount>" +
+            std::to_string(count) + "</KeyCount><MaxKeys>" + std::to_string(max_keys) +
+            "</MaxKeys><IsTruncated>" + (next_key.empty() ? "false" : "true") + "</IsTruncated>";
+        if (!next_key.empty())
+            xml += "<NextContinuationToken>" + XmlEscape(next_key) + "</NextContinuationToken>";
+        return xml + contents + "</ListBucketResult>";
+    }
+
+    Aws::String CreateUpload(const Aws::String& bucket_name, const Aws::String& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Aws::String upload_id = "local-upload-" + std::to_string(++m_next_upload);
+        m_uploads[upload_id] = Upload{ bucket_name, key, {} };
+        return upload_id;
+    }
+
+    bool PutPart(const Aws::String& upload_id, int part_number, std::uint64_t size,
+        const Aws::Utils::ByteBuffer& md5, Aws::String& etag)
+    {
+        etag = ETag(md5);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_uploads.find(upload_id);
+        if (found == m_uploads.end())
+            return false;
+        found->second.parts[part_number] = Part{ size, md5 };
+        return true;
+    }
+
+    bool CompleteUpload(const Aws::String& upload_id, Aws::String& bucket_name,
+        Aws::String& key, Aws::String& etag)
+    {
+        Upload upload;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto found = m_uploads.find(upload_id);
+            if (found == m_uploads.end())
+                return false;
+            upload = std::move(found->second);
+            m_uploads.erase(found);
+        }
+        std::uint64_t size = 0;
+        Aws::String part_digests;
+        for (auto& part : upload.parts)
+        {
+            size += part.second.size;
+            part_digests.append(reinterpret_cast<const char*>(part.second.md5.GetUnderlyingData()),
+                part.second.md5.GetLength());
+        }
+        etag = "\"" + Aws::Utils::HashingUtils::HexEncode(
+            Aws::Utils::HashingUtils::CalculateMD5(part_digests)) + "-" +
+            std::to_string(upload.parts.size()).c_str() + "\"";
+        PutObject(upload.bucket_name, upload.key, size, etag);
+        bucket_name = upload.bucket_name;
+        key = upload.key;
+        return true;
+    }
+
+    bool AbortUpload(const Aws::String& upload_id)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_uploads.erase(upload_id) != 0;
+    }
+
+    size_t ObjectCount(const Aws::String& bucket_name)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return BucketLocked(bucket_name).objects.size();
+    }
+
+private:
+    struct Object
+    {
+        std::uint64_t size;
+        Aws::String etag;
+        std::shared_ptr<const Aws::String> acl;
+    };
+
+    struct Bucket
+    {
+        std::shared_ptr<const Aws::String> acl;
+        std::map<Aws::String, Object> objects;
+    };
+
+    struct Part
+    {
+        std::uint64_t size;
+        Aws::Utils::ByteBuffer md5;
+    };
+
+    struct Upload
+    {
+        Aws::String bucket_name;
+        Aws::String key;
+        std::map<int, Part> parts;
+    };
+
+    // Buckets spring into existence on first use; m_mutex must be held
+    Bucket& BucketLocked(const Aws::String& bucket_name)
+    {
+        Bucket& bucket = m_buckets[bucket_name];
+        if (!bucket.acl)
+            bucket.acl = m_default_acl;
+        return bucket;
+    }
+
+    const LocalS3Settings m_settings;
+    const std::shared_ptr<const Aws::String> m_default_acl;
+    std::mutex m_mutex;
+    std::map<Aws::String, Bucket> m_buckets;
+    std::map<Aws::String, Upload> m_uploads;
+    std::uint64_t m_next_upload = 0;
+};
+
+/**
+ * HTTP client that answers S3 requests from a LocalS3Store
+ *
+ * Serves GetBucketAcl/GetObjectAcl, PutBucketAcl/PutObjectAcl (policy body,
+ * canned ACL or x-amz-grant-* headers), ListObjectsV2, PutObject,
+ * HeadObject and the multipart upload calls, for virtual-hosted and
+ * path-style URLs. Requests are delayed, paced and failed according to the
+ * store's LocalS3Settings. Anything else is answered 501 NotImplemented.
+ *
+ * Bodies sent with a CRC32C, CRC64NVME or SHA-256 checksum, in a header or
+ * a trailer, are checked as S3 does: a mismatch is answered 400 BadDigest,
+ * and a match is echoed in the x-amz-checksum-* response header, unless
+ * verify_checksums is off.
+ */
+class LocalS3HttpClient : public Aws::Http::HttpClient
+{
+public:
+    explicit LocalS3HttpClient(std::shared_ptr<LocalS3Store> store)
+        : m_store(std::move(store))
+    {
+    }
+
+    std::shared_ptr<Aws::Http::HttpResponse> MakeRequest(
+        const std::shared_ptr<Aws::Http::HttpRequest>& request,
+        Aws::Utils::RateLimits::RateLimiterInterface* = nullptr,
+        Aws::Utils::RateLimits::RateLimiterInterface* = nullptr) const override
+    {
+        auto response = Aws::MakeShared<Aws::Http::Standard::StandardHttpResponse>(
+            "LocalS3HttpClient", request);
+        const LocalS3Settings& settings = m_store->Settings();
+
+        // Consume the body, paced to the bandwidth cap, and checksum it
+        BodyChecksum checksum = settings.verify_checksums ? RequestedChecksum(*request)
+            : BodyChecksum();
+        Aws::Utils::ByteBuffer body_md5;
+        const std::uint64_t body_size = ReadBody(*request, checksum, body_md5);
+
+        if (settings.latency_ms > 0)
+            std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(
+                Random().Latency(settings.latency_ms, settings.latency_sigma)));
+
+        double draw = Random().Uniform();
+        if (draw < settings.throttle_rate)
+            Error(*response, Aws::Http::HttpResponseCode::SERVICE_UNAVAILABLE, "SlowDown",
+                "Please reduce your request rate.");
+        else if (draw < settings.throttle_rate + settings.error_rate)
+            Error(*response, Aws::Http::HttpResponseCode::INTERNAL_SERVER_ERROR,
+                "InternalError", "Injected error.");
+        else if (checksum.computed && checksum.expected != checksum.actual)
+            Error(*response, Aws::Http::HttpResponseCode::BAD_REQUEST, "BadDigest",
+                "The checksum you specified did not match the calculated checksum.");
+        else
+        {
+            Serve(*request, *response, body_size, body_md5);
+            if (checksum.computed)
+                response->AddHeader(checksum.header, checksum.actual);
+        }
+
+        auto& on_received = request->GetDataReceivedEventHandler();
+        if (on_received)
+            on_received(request.get(), response.get(), 0);
+        return response;
+    }
+
+private:
+    class RandomSource
+    {
+    public:
+        RandomSource() : m_engine(std::random_device{}()) {}
+
+        double Uniform()
+        {
+            return std::uniform_real_distribution<double>(0, 1)(m_engine);
+        }
+
+        double Latency(double median, double sigma)
+        {
+            return std::lognormal_distribution<double>(std::log(median), sigma)(m_engine);
+        }
+
+    private:
+        std::mt19937_64 m_engine;
+    };
+
+    static RandomSource& Random()
+    {
+        thread_local RandomSource source;
+        return source;
+    }
+
+    // Checksum of a request body, taken as the body is read, and the value
+    // the client sent for it
+    struct BodyChecksum
+    {
+        Aws::String header;         // x-amz-checksum-<algorithm>
+        std::optional<StreamingChecksum> computed;
+        Aws::String expected;
+        Aws::String actual;
+    };
+
+    // The checksum named by the x-amz-trailer or
+    // x-amz-sdk-checksum-algorithm header, if it is one that is checked
+    static BodyChecksum RequestedChecksum(const Aws::Http::HttpRequest& request)
+    {
+        BodyChecksum checksum;
+        Aws::String header;
+        if (request.HasHeader("x-amz-trailer"))
+            header = request.GetHeaderValue("x-amz-trailer");
+        else if (request.HasHeader("x-amz-sdk-checksum-algorithm"))
+            header = "x-amz-checksum-" + request.GetHeaderValue("x-amz-sdk-checksum-algorithm");
+        std::transform(header.begin(), header.end(), header.begin(),
+            [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+        const Aws::String prefix = "x-amz-checksum-";
+        if (header.compare(0, prefix.size(), prefix) != 0)
+            return checksum;
+        Aws::String name = header.substr(prefix.size());
+        std::transform(name.begin(), name.end(), name.begin(),
+            [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+        auto algorithm =
+            Aws::S3::Model::ChecksumAlgorithmMapper::GetChecksumAlgorithmForName(name);
+        if (!StreamingChecksum::Supported(algorithm))
+            return checksum;
+
+        checksum.header = header;
+        checksum.computed.emplace(algorithm);
+        if (request.HasHeader(header.c_str()))
+            checksum.expected = request.GetHeaderValue(header.c_str());
+        return checksum;
+    }
+
+    /**
+     * Read the body, checksumming it, and return its size; md5 is set to
+     * its MD5, for the ETag of an object or part
+     *
+     * A trailing checksum comes one of two ways. When the SDK attaches a
+     * hash to the request, the HTTP client frames the body and appends the
+     * hash as the trailer, so it is fed the body here as a client would.
+     * Otherwise an aws-chunked body carries its own trailer.
+     */
+    std::uint64_t ReadBody(Aws::Http::HttpRequest& request, BodyChecksum& checksum,
+        Aws::Utils::ByteBuffer& md5) const
+    {
+        Aws::Utils::Crypto::MD5 body_md5;
+        auto body = request.GetContentBody();
+        if (!body)
+        {
+            md5 = body_md5.GetHash().GetResult();
+            return 0;
+        }
+        const double bytes_per_second = m_store->Settings().bandwidth_mbps * 1e6 / 8;
+        auto& on_sent = request.GetDataSentEventHandler();
+        const auto& request_hash = request.GetRequestHash().second;
+        const bool chunked = !request_hash && request.HasHeader("content-encoding") &&
+            request.GetHeaderValue("content-encoding").find("aws-chunked") != Aws::String::npos;
+
+        char buffer[64 * 1024];
+        std::uint64_t total = 0;
+        auto consume = [&](std::streamsize count)
+        {
+            total += static_cast<std::uint64_t>(count);
+            body_md5.Update(reinterpret_cast<unsigned char*>(buffer), static_cast<size_t>(count));
+            if (checksum.computed)
+                checksum.computed->Update(buffer, static_cast<size_t>(count));
+            if (request_hash)
+                request_hash->Update(reinterpret_cast<unsigned char*>(buffer),
+                    static_cast<size_t>(count));
+            if (bytes_per_second > 0)
+                Pace(static_cast<double>(count) / bytes_per_second);
+            if (on_sent)
+                on_sent(&request, count);
+        };
+
+        if (chunked)
+            ReadChunks(*body, buffer, sizeof(buffer), consume, checksum);
+        else
+            while (body->read(buffer, sizeof(buffer)), body->gcount() > 0)
+                consume(body->gcount());
+
+        if (request_hash && checksum.expected.empty())
+            checksum.expected =
+                Aws::Utils::HashingUtils::Base64Encode(request_hash->GetHash().GetResult());
+        if (checksum.computed)
+            checksum.actual = checksum.computed->Base64();
+        md5 = body_md5.GetHash().GetResult();
+        return total;
+    }
+
+    // Read an aws-chunked body: chunks of a hex size line, the data and a
+    // CRLF, up to one of size 0, then the trailer lines
+    template <typename Consume>
+    static void ReadChunks(Aws::IOStream& body, char* buffer, size_t buffer_size,
+        Consume consume, BodyChecksum& checksum)
+    {
+        std::string line;
+        while (std::getline(body, line))
+        {
+            std::uint64_t size = std::strtoull(line.c_str(), nullptr, 16);
+            if (size == 0)
+                break;
+            while (size > 0)
+            {
+                body.read(buffer, static_cast<std::streamsize>(std::min<std::uint64_t>(size,
+                    buffer_size)));
+                if (body.gcount() <= 0)
+                    return;
+                size -= static_cast<std::uint64_t>(body.gcount());
+                consume(body.gcount());
+            }
+            std::getline(body, line);
+        }
+        while (std::getline(body, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty())
+                break;
+            size_t colon = line.find(':');
+            if (colon != std::string::npos && line.compare(0, colon, checksum.header) == 0)
+                checksum.expected = line.substr(colon + 1);
+        }
+    }
+
+    // Reserve the next seconds of the shared link and wait for them to pass
+    void Pace(double seconds) const
+    {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point done;
+        {
+            std::lock_guard<std::mutex> lock(m_link_mutex);
+            auto now = Clock::now();
+            if (m_link_free < now)
+                m_link_free = now;
+            m_link_free += std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(seconds));
+            done = m_link_free;
+        }
+        std::this_thread::sleep_until(done);
+    }
+
+    static void Error(Aws::Http::HttpResponse& response, Aws::Http::HttpResponseCode code,
+        const char* error_code, const char* message)
+    {
+        response.SetResponseCode(code);
+        response.AddHeader("Content-Type", "application/xml");
+        response.GetResponseBody() << "<?xml version=\"1.0\" encoding=\"UTF-8\"?><Error><Code>"
+            << error_code << "</Code><Message>" << message << "</Message></Error>";
+    }
+
+    static void Xml(Aws::Http::HttpResponse& response, const Aws::String& xml)
+    {
+        response.SetResponseCode(Aws::Http::HttpResponseCode::OK);
+        response.AddHeader("Content-Type", "application/xml");
+        response.GetResponseBody() << xml;
+    }
+
+    // Split the URL into bucket and key, for virtual-hosted
+    // (bucket.s3.region.amazonaws.com/key) or path-style (host/bucket/key)
+    static void ParseTarget(const Aws::Http::URI& uri, Aws::String& bucket_name, Aws::String& key)
+    {
+        const Aws::String& host = uri.GetAuthority();
+        Aws::String path = uri.GetPath();
+        if (!path.empty() && path[0] == '/')
+            path.erase(0, 1);
+
+        size_t s3_label = host.find(".s3");
+        if (s3_label != Aws::String::npos && s3_label > 0)
+        {
+            bucket_name = host.substr(0, s3_label);
+            key = path;
+            return;
+        }
+        size_t slash = path.find('/');
+        bucket_name = path.substr(0, slash);
+        key = slash == Aws::String::npos ? "" : path.substr(slash + 1);
+    }
+
+    // ACL from canned or x-amz-grant-* headers, or the policy body
+    Aws::String RequestedAcl(Aws::Http::HttpRequest& request) const
+    {
+        const Aws::String& owner_id = m_store->Settings().owner_id;
+        Aws::Vector<LocalS3Store::Grant> grants{ { "id", owner_id, "FULL_CONTROL" } };
+        bool from_headers = false;
+
+        if (request.HasHeader("x-amz-acl"))
+        {
+            const Aws::String& canned = request.GetHeaderValue("x-amz-acl");
+            const char* all_users = "http://acs.amazonaws.com/groups/global/AllUsers";
+            if (canned == "public-read" || canned == "public-read-write")
+                grants.push_back({ "uri", all_users, "READ" });
+            if (canned == "public-read-write")
+                grants.push_back({ "uri", all_users, "WRITE" });
+            if (canned == "authenticated-read")
+                grants.push_back({ "uri",
+                    "http://acs.amazonaws.com/groups/global/AuthenticatedUsers", "READ" });
+            // bucket-owner-*: the local bucket owner is the object owner
+            from_headers = true;
+        }
+
+        static const std::pair<const char*, const char*> grant_headers[] = {
+            { "x-amz-grant-full-control", "FULL_CONTROL" },
+            { "x-amz-grant-read", "READ" },
+            { "x-amz-grant-write", "WRITE" },
+            { "x-amz-grant-read-acp", "READ_ACP" },
+            { "x-amz-grant-write-acp", "WRITE_ACP" } };
+        for (auto& header : grant_headers)
+        {
+            if (!request.HasHeader(header.first))
+                continue;
+            if (!from_headers)
+                grants.clear();
+            from_headers = true;
+
+            // Values look like id="...", uri="...", emailAddress="..."
+            std::istringstream values(request.GetHeaderValue(header.first));
+            Aws::String value;
+            while (std::getline(values, value, ','))
+            {
+                size_t equals = value.find('=');
+                if (equals == Aws::String::npos)
+                    continue;
+                Aws::String kind = value.substr(value.find_first_not_of(' '),
+                    equals - value.find_first_not_of(' '));
+                Aws::String grantee = value.substr(equals + 1);
+                grantee.erase(std::remove(grantee.begin(), grantee.end(), '"'), grantee.end());
+                grants.push_back({ kind == "uri" ? "uri" : kind == "emailAddress" ?
+                    "emailAddress" : "id", grantee, header.second });
+            }
+        }
+        if (from_headers)
+            return LocalS3Store::AclXml(owner_id, grants);
+
+        auto body = request.GetContentBody();
+        if (!body)
+            return LocalS3Store::AclXml(owner_id, grants);
+        body->clear();
+        body->seekg(0);
+        std::ostringstream policy;
+        policy << body->rdbuf();
+        return policy.str();
+    }
+
+    void Serve(Aws::Http::HttpRequest& request, Aws::Http::HttpResponse& response,
+        std::uint64_t body_size, const Aws::Utils::ByteBuffer& body_md5) const
+    {
+        using Aws::Http::HttpMethod;
+        const Aws::Http::URI& uri = request.GetUri();
+        Aws::String bucket_name;
+        Aws::String key;
+        ParseTarget(uri, bucket_name, key);
+        auto query = uri.GetQueryStringParameters();
+        auto parameter = [&query](const char* name) -> Aws::String
+        {
+            auto found = query.find(name);
+            return found == query.end() ? Aws::String() : found->second;
+        };
+        const bool acl = query.count("acl") != 0;
+        const HttpMethod method = request.GetMethod();
+
+        if (acl && method == HttpMethod::HTTP_GET)
+        {
+            auto policy = m_store->GetAcl(bucket_name, key);
+            if (!policy)
+                return Error(response, Aws::Http::HttpResponseCode::NOT_FOUND, "NoSuchKey",
+                    "The specified key does not exist.");
+            return Xml(response, *policy);
+        }
+        if (acl && method == HttpMethod::HTTP_PUT)
+        {
+            if (!m_store->SetAcl(bucket_name, key, RequestedAcl(request)))
+                return Error(response, Aws::Http::HttpResponseCode::NOT_FOUND, "NoSuchKey",
+                    "The specified key does not exist.");
+            return response.SetResponseCode(Aws::Http::HttpResponseCode::OK);
+        }
+        if (key.empty() && method == HttpMethod::HTTP_GET && parameter("list-type") == "2")
+        {
+            Aws::String max_keys = parameter("max-keys");
+            return Xml(response, m_store->List(bucket_name, parameter("prefix"),
+                parameter("continuation-token"),
+                max_keys.empty() ? 1000 : std::strtoul(max_keys.c_str(), nullptr, 10),
+                parameter("fetch-owner") == "true"));
+        }
+        if (query.count("uploads") && method == HttpMethod::HTTP_POST)
+        {
+            return Xml(response, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                "<InitiateMultipartUploadResult><Bucket>" + LocalS3Store::XmlEscape(bucket_name) +
+                "</Bucket><Key>" + LocalS3Store::XmlEscape(key) + "</Key><UploadId>" +
+                m_store->CreateUpload(bucket_name, key) +
+                "</UploadId></InitiateMultipartUploadResult>");
+        }
+
+        const Aws::String upload_id = parameter("uploadId");
+        if (!upload_id.empty())
+        {
+            Aws::String etag;
+            if (method == HttpMethod::HTTP_PUT)
+            {
+                int part_number = std::atoi(parameter("partNumber").c_str());
+                if (!m_store->PutPart(upload_id, part_number, body_size, body_md5, etag))
+                    return Error(response, Aws::Http::HttpResponseCode::NOT_FOUND,
+                        "NoSuchUpload", "The specified upload does not exist.");
+                response.SetResponseCode(Aws::Http::HttpResponseCode::OK);
+                return response.AddHeader("ETag", etag);
+            }
+            if (method == HttpMethod::HTTP_POST)
+            {
+                if (!m_store->CompleteUpload(upload_id, bucket_name, key, etag))
+                    return Error(response, Aws::Http::HttpResponseCode::NOT_FOUND,
+                        "NoSuchUpload", "The specified upload does not exist.");
+                return Xml(response, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                    "<CompleteMultipartUploadResult><Bucket>" +
+                    LocalS3Store::XmlEscape(bucket_name) + "</Bucket><Key>" +
+                    LocalS3Store::XmlEscape(key) + "</Key><ETag>" +
+                    LocalS3Store::XmlEscape(etag) + "</ETag></CompleteMultipartUploadResult>");
+            }
+            if (method == HttpMethod::HTTP_DELETE)
+            {
+                m_store->AbortUpload(upload_id);
+                return response.SetResponseCode(Aws::Http::HttpResponseCode::NO_CONTENT);
+            }
+        }
+
+        if (!key.empty() && method == HttpMethod::HTTP_PUT)
+        {
+            const Aws::String etag = LocalS3Store::ETag(body_md5);
+            m_store->PutObject(bucket_name, key, body_size, etag);
+            response.SetResponseCode(Aws::Http::HttpResponseCode::OK);
+            return response.AddHeader("ETag", etag);
+        }
+        if (!key.empty() && method == HttpMethod::HTTP_HEAD)
+        {
+            std::uint64_t size;
+            Aws::String etag;
+            if (!m_store->HeadObject(bucket_name, key, size, etag))
+                return response.SetResponseCode(Aws::Http::HttpResponseCode::NOT_FOUND);
+            response.SetResponseCode(Aws::Http::HttpResponseCode::OK);
+            response.AddHeader("Content-Length", std::to_string(size));
+            return response.AddHeader("ETag", etag);
+        }
+
+        Error(response, Aws::Http::HttpResponseCode::NOT_IMPLEMENTED, "NotImplemented",
+            "The local S3 stand-in does not implement this request.");
+    }
+
+    std::shared_ptr<LocalS3Store> m_store;
+    mutable std::mutex m_link_mutex;
+    mutable std::chrono::steady_clock::time_point m_link_free;
+};
+
+/**
+ * HttpClientFactory that hands every SDK client a LocalS3HttpClient
+ */
+class LocalS3HttpClientFactory : public Aws::Http::HttpClientFactory
+{
+public:
+    explicit LocalS3HttpClientFactory(std::shared_ptr<LocalS3Store> store)
+        : m_store(std::move(store))
+    {
+    }
+
+    std::shared_ptr<Aws::Http::HttpClient> CreateHttpClient(
+        const Aws::Client::ClientConfiguration&) const override
+    {
+        return Aws::MakeShared<LocalS3HttpClient>("LocalS3HttpClientFactory", m_store);
+    }
+
+    std::shared_ptr<Aws::Http::HttpRequest> CreateHttpRequest(const Aws::String& uri,
+        Aws::Http::HttpMethod method, const Aws::IOStreamFactory& stream_factory) const override
+    {
+        return CreateHttpRequest(Aws::Http::URI(uri), method, stream_factory);
+    }
+
+    std::shared_ptr<Aws::Http::HttpRequest> CreateHttpRequest(const Aws::Http::URI& uri,
+        Aws::Http::HttpMethod method, const Aws::IOStreamFactory& stream_factory) const override
+    {
+        auto request = Aws::MakeShared<Aws::Http::Standard::StandardHttpRequest>(
+            "LocalS3HttpClientFactory", uri, method);
+        request->SetResponseStreamFactory(stream_factory);
+        return request;
+    }
+
+private:
+    std::shared_ptr<LocalS3Store> m_store;
+};
+
+/**
+ * Route all SDK HTTP traffic to an in-memory S3 stand-in
+ *
+ * Call before Aws::InitAPI(options). Placeholder credentials are set
+ * unless some are configured, and instance metadata lookups are disabled,
+ * so that no request leaves the process. Returns the store, to seed or
+ * inspect.
+ */
+inline std::shared_ptr<LocalS3Store> InstallLocalS3(Aws::SDKOptions& options,
+    const LocalS3Settings& settings)
+{
+    auto store = std::make_shared<LocalS3Store>(settings);
+    options.httpOptions.httpClientFactory_create_fn = [store]()
+    {
+        return Aws::MakeShared<LocalS3HttpClientFactory>("InstallLocalS3", store);
+    };
+    setenv("AWS_ACCESS_KEY_ID", "LOCALS3ACCESSKEY", 0);
+    setenv("AWS_SECRET_ACCESS_KEY", "local-s3-secret-key", 0);
+    setenv("AWS_EC2_METADATA_DISABLED", "true", 1);
+    return store;
+}
+
+/**
+ * InstallLocalS3() if the S3_LOCAL environment variable is set, e.g.
+ *
+ *   S3_LOCAL="latency=20,sigma=0.8,throttle=0.01,objects=100000,prefix=data/"
+ *
+ * (see LocalS3Settings::Parse(); S3_LOCAL=1 takes the defaults). This is
+ * how the sample programs are run offline without other changes.
+ */
+inline std::shared_ptr<LocalS3Store> InstallLocalS3FromEnvironment(Aws::SDKOptions& options)
+{
+    const char* text = std::getenv("S3_LOCAL");
+    if (!text || !*text)
+        return nullptr;
+    LocalS3Settings settings;
+    if (std::string(text) != "1" && !LocalS3Settings::Parse(text, settings))
+    {
+        std::cout << "Invalid S3_LOCAL: " << text << std::endl;
+        return nullptr;
+    }
+    std::cout << "Using the local S3 stand-in (S3_LOCAL=" << text << ")" << std::endl;
+    return InstallLocalS3(options, settings);
+}
@@ -0,0 +1,184 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Read-only mapping of a whole file
+ *
+ * Shared by the streams over it (see MappedFileStream), so that the parts
+ * of a multipart upload map the file once. The file may be empty, in which
+ * case nothing is mapped. Bytes produced in memory rather than read, such
+ * as compressed parts (see BlockCompressor), are wrapped the same way.
+ */
+class MappedFile
+{
+public:
+    /**
+     * Map path, or return nullptr if it cannot be opened or mapped
+     */
+    static std::shared_ptr<const MappedFile> Open(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+        struct stat file_stat;
+        if (::fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
+        {
+            ::close(fd);
+            return nullptr;
+        }
+
+        const std::uint64_t size = static_cast<std::uint64_t>(file_stat.st_size);
+        void* data = nullptr;
+        if (size > 0)
+        {
+            data = ::mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                ::close(fd);
+                return nullptr;
+            }
+            // Uploads read front to back: read ahead aggressively and drop
+            // pages behind
+            ::madvise(data, static_cast<size_t>(size), MADV_SEQUENTIAL);
+        }
+        // The mapping stays valid without the descriptor
+        ::close(fd);
+        return std::shared_ptr<const MappedFile>(
+            new MappedFile(static_cast<const char*>(data), size));
+    }
+
+    /**
+     * Wrap bytes held in memory, which it takes over
+     */
+    static std::shared_ptr<const MappedFile> FromMemory(std::vector<char> bytes)
+    {
+        auto memory = std::make_shared<const std::vector<char>>(std::move(bytes));
+        auto file = std::shared_ptr<MappedFile>(new MappedFile(memory->data(), memory->size()));
+        file->m_memory = std::move(memory);
+        return file;
+    }
+
+    ~MappedFile()
+    {
+        if (m_size > 0 && !m_memory)
+            ::munmap(const_cast<char*>(m_data), static_cast<size_t>(m_size));
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* Data() const { return m_data; }
+    std::uint64_t Size() const { return m_size; }
+
+private:
+    MappedFile(const char* data, std::uint64_t size)
+        : m_data(data), m_size(size)
+    {
+    }
+
+    const char* const m_data;
+    const std::uint64_t m_size;
+    std::shared_ptr<const std::vector<char>> m_memory;  // Set if not mapped
+};
+
+/**
+ * Request body stream over a range of a MappedFile
+ *
+ * The stream buffer's get area is the mapping itself, so the HTTP client's
+ * reads copy straight from the page cache into its socket buffer, where an
+ * Aws::FStream first copies every byte into its own buffer. Seeking, which
+ * the SDK does to size, sign and rewind bodies, only moves a pointer.
+ */
+class MappedFileStream : public Aws::IOStream
+{
+public:
+    /**
+     * Stream over the whole file
+     */
+    explicit MappedFileStream(std::shared_ptr<const MappedFile> file)
+        : MappedFileStream(file, 0, file->Size())
+    {
+    }
+
+    /**
+     * Stream over length bytes from offset (clamped to the file)
+     */
+    MappedFileStream(std::shared_ptr<const MappedFile> file, std::uint64_t offset,
+        std::uint64_t length)
+        : Aws::IOStream(&m_buffer), m_buffer(std::move(file), offset, length)
+    {
+    }
+
+private:
+    class Buffer : public std::streambuf
+    {
+    public:
+        Buffer(std::shared_ptr<const MappedFile> file, std::uint64_t offset,
+            std::uint64_t length)
+            : m_file(std::move(file))
+        {
+            offset = std::min(offset, m_file->Size());
+            length = std::min(length, m_file->Size() - offset);
+            // The get area is never written through: the base class only
+            // moves the pointers, and the pages are mapped read-only
+            char* begin = const_cast<char*>(m_file->Data()) + offset;
+            setg(begin, begin, begin + length);
+        }
+
+    protected:
+        std::streamsize showmanyc() override
+        {
+            return egptr() - gptr();
+        }
+
+        pos_type seekoff(off_type offset, std::ios_base::seekdir direction,
+            std::ios_base::openmode which) override
+        {
+            if (!(which & std::ios_base::in))
+                return pos_type(off_type(-1));
+            off_type base = direction == std::ios_base::beg ? 0
+                : direction == std::ios_base::cur ? gptr() - eback()
+                : egptr() - eback();
+            off_type position = base + offset;
+            if (position < 0 || position > egptr() - eback())
+                return pos_type(off_type(-1));
+            setg(eback(), eback() + position, egptr());
+            return pos_type(position);
+        }
+
+        pos_type seekpos(pos_type position, std::ios_base::openmode which) override
+        {
+            return seekoff(off_type(position), std::ios_base::beg, which);
+        }
+
+    private:
+        std::shared_ptr<const MappedFile> m_file;
+    };
+
+    Buffer m_buffer;
+};
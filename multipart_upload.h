@@ -0,0 +1,471 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/S3Client.h>
+#include <aws/s3/model/AbortMultipartUploadRequest.h>
+#include <aws/s3/model/ChecksumAlgorithm.h>
+#include <aws/s3/model/CompleteMultipartUploadRequest.h>
+#include <aws/s3/model/CompletedMultipartUpload.h>
+#include <aws/s3/model/CompletedPart.h>
+#include <aws/s3/model/CreateMultipartUploadRequest.h>
+#include <aws/s3/model/UploadPartRequest.h>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "block_compressor.h"
+#include "latency_metrics.h"
+#include "mapped_file_stream.h"
+#include "prefix_rate_limiter.h"
+
+/**
+ * When and how a file is uploaded in parts
+ */
+struct MultipartSettings
+{
+    // Files of at least this size are uploaded in parts
+    std::uint64_t threshold = 64 * 1024 * 1024;
+
+    // Size of every part but the last; raised when the file would otherwise
+    // need more than MAX_PARTS parts
+    std::uint64_t part_size = 16 * 1024 * 1024;
+
+    // Parts of one upload in flight at once. Each part holds an executor
+    // thread and an HTTP connection while it is sent, so the client's
+    // executor and maxConnections should allow at least this many.
+    size_t concurrency = 16;
+
+    // Times a part is sent before the upload is given up; each attempt
+    // already includes the retries of the client's retry strategy
+    int part_attempts = 3;
+
+    // Paces every UploadPart, CompleteMultipartUpload and
+    // AbortMultipartUpload to the write limit of the key's prefix
+    // (optional). CreateMultipartUpload is paced by the caller, before the
+    // upload starts; put_s3_object_async() sets this from its options.
+    PrefixRateLimiter* rate_limiter = nullptr;
+
+    static constexpr std::uint64_t MIN_PART_SIZE = 5 * 1024 * 1024;
+    static constexpr std::uint64_t MAX_PARTS = 10000;
+
+    /**
+     * Part size for a file of file_size bytes within the S3 limits
+     */
+    std::uint64_t PartSize(std::uint64_t file_size) const
+    {
+        std::uint64_t size = std::max(part_size, MIN_PART_SIZE);
+        if (file_size > size * MAX_PARTS)
+        {
+            size = (file_size + MAX_PARTS - 1) / MAX_PARTS;
+            size = (size + 1024 * 1024 - 1) / (1024 * 1024) * (1024 * 1024);
+        }
+        return size;
+    }
+};
+
+/**
+ * Called once when a multipart upload has completed or failed; a failed
+ * outcome carries the first error that stopped the upload
+ */
+using MultipartUploadCallback =
+    std::function<void(const Aws::S3::Model::CompleteMultipartUploadOutcome& outcome)>;
+
+/**
+ * Upload of one file in parts, sent concurrently
+ *
+ * CreateMultipartUpload is followed by up to settings.concurrency
+ * UploadPart requests at a time, each started from the response handler of
+ * the previous one, so no thread waits for the transfer. A failed part is
+ * sent again up to settings.part_attempts times; when a part fails for
+ * good, the upload is aborted and the callback gets that part's error.
+ * When all parts are in, CompleteMultipartUpload lists them in order.
+ *
+ * Parts are streamed from a single read-only mapping of the file (see
+ * MappedFileStream), so they take no memory besides the page cache. With a
+ * checksum algorithm, each part carries a trailing checksum, which is
+ * listed again in CompleteMultipartUpload.
+ *
+ * With compression, parts are the output of a BlockCompressor instead,
+ * taken as they are ready, so their number is only known once the last one
+ * is; each part is held in memory until it is stored.
+ */
+class MultipartUpload : public std::enable_shared_from_this<MultipartUpload>
+{
+public:
+    /**
+     * Start uploading file_name (file_size bytes) to bucket_name/key, with
+     * checksum unless it is NOT_SET, compressed if compression.enabled;
+     * s3_client must outlive the upload
+     */
+    static void Start(const Aws::S3::S3Client& s3_client,
+        const Aws::String& bucket_name,
+        const Aws::String& key,
+        const std::string& file_name,
+        std::uint64_t file_size,
+        const MultipartSettings& settings,
+        Aws::S3::Model::ChecksumAlgorithm checksum,
+        const CompressionSettings& compression,
+        MultipartUploadCallback on_finished)
+    {
+        auto file = MappedFile::Open(file_name);
+        if (!file)
+        {
+            on_finished(Aws::S3::Model::CompleteMultipartUploadOutcome(Aws::S3::S3Error(
+                Aws::S3::S3Errors::INTERNAL_FAILURE, "ReadFailed",
+                "Cannot map " + file_name, false)));
+            return;
+        }
+        file_size = std::min(file_size, file->Size());
+        auto upload = std::shared_ptr<MultipartUpload>(new MultipartUpload(s3_client,
+            bucket_name, key, std::move(file), file_size, settings, checksum,
+            std::move(on_finished)));
+
+        Aws::S3::Model::CreateMultipartUploadRequest request;
+        request.SetBucket(bucket_name);
+        request.SetKey(key);
+        if (checksum != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
+            request.SetChecksumAlgorithm(checksum);
+
+        // Compress while the upload is created; the part count is unknown
+        if (compression.enabled)
+        {
+            request.SetContentEncoding("zstd");
+            upload->m_part_count = -1;
+            upload->m_parts.clear();
+            upload->m_compressor = BlockCompressor::Start(upload->m_file, compression,
+                upload->m_part_size, std::max<size_t>(settings.concurrency / 4, 2),
+                [upload](BlockCompressor&) { upload->SendParts(); });
+        }
+        s3_client.CreateMultipartUploadAsync(request,
+            [upload, started = LatencyMetrics::Clock::now()](const Aws::S3::S3Client*,
+                const Aws::S3::Model::CreateMultipartUploadRequest&,
+                const Aws::S3::Model::CreateMultipartUploadOutcome& outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            Metrics().Record(S3Operation::CreateMultipartUpload, started, outcome);
+            if (!outcome.IsSuccess())
+            {
+                if (upload->m_compressor)
+                    upload->m_compressor->Cancel();
+                upload->m_on_finished(
+                    Aws::S3::Model::CompleteMultipartUploadOutcome(outcome.GetError()));
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(upload->m_mutex);
+                upload->m_upload_id = outcome.GetResult().GetUploadId();
+            }
+            upload->SendParts();
+        });
+    }
+
+private:
+    MultipartUpload(const Aws::S3::S3Client& s3_client,
+        const Aws::String& bucket_name,
+        const Aws::String& key,
+        std::shared_ptr<const MappedFile> file,
+        std::uint64_t file_size,
+        const MultipartSettings& settings,
+        Aws::S3::Model::ChecksumAlgorithm checksum,
+        MultipartUploadCallback on_finished)
+        : m_client(s3_client), m_bucket_name(bucket_name), m_key(key),
+        m_file(std::move(file)), m_file_size(file_size),
+        m_part_size(settings.PartSize(file_size)),
+        m_part_count(static_cast<int>(std::max<std::uint64_t>(
+            (file_size + m_part_size - 1) / m_part_size, 1))),
+        m_settings(settings), m_checksum(checksum), m_on_finished(std::move(on_finished)),
+        m_parts(static_cast<size_t>(m_part_count))
+    {
+    }
+
+    // Start parts until the window is full or none are left (or, when
+    // compressing, none are ready yet)
+    void SendParts()
+    {
+        std::vector<int> parts;
+        bool complete = false;
+        bool abort = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_upload_id.empty())
+                return;
+            while (!m_error && m_in_flight < std::max<size_t>(m_settings.concurrency, 1))
+            {
+                if (!m_compressor || m_part_count >= 0)
+                {
+                    if (m_next_part > m_part_count)
+                        break;
+                }
+                else
+                {
+                    std::shared_ptr<const MappedFile> body;
+                    BlockCompressor::Status status = m_compressor->NextPart(body);
+                    if (status == BlockCompressor::Status::Pending)
+                        break;
+                    if (status == BlockCompressor::Status::Done)
+                    {
+                        m_part_count = m_next_part - 1;
+                        complete = m_completed == m_part_count;
+                        break;
+                    }
+                    if (status == BlockCompressor::Status::Failed)
+                    {
+                        m_error = Aws::S3::S3Error(Aws::S3::S3Errors::INTERNAL_FAILURE,
+                            "CompressionFailed", "Cannot compress " + m_key, false);
+                        abort = m_in_flight == 0;
+                        break;
+                    }
+                    m_part_bodies.push_back(std::move(body));
+                    m_parts.emplace_back();
+                }
+                parts.push_back(m_next_part++);
+                ++m_in_flight;
+            }
+        }
+        if (abort)
+            Abort();
+        else if (complete)
+            Complete();
+        for (int part_number : parts)
+            SendPart(part_number, 1);
+    }
+
+    // Call send once the rate limiter, if any, has a write token for it;
+    // called on executor and pool threads, so it never waits
+    void Paced(std::function<void()> send)
+    {
+        if (m_settings.rate_limiter)
+            m_settings.rate_limiter->AcquireAsync(m_key, 0, 1, std::move(send));
+        else
+            send();
+    }
+
+    void SendPart(int part_number, int attempt)
+    {
+        auto self = shared_from_this();
+        Paced([self, part_number, attempt]() { self->StartPart(part_number, attempt); });
+    }
+
+    void StartPart(int part_number, int attempt)
+    {
+        std::shared_ptr<const MappedFile> file = m_file;
+        std::uint64_t offset = static_cast<std::uint64_t>(part_number - 1) * m_part_size;
+        std::uint64_t length = std::min(m_part_size, m_file_size - offset);
+        if (m_compressor)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            file = m_part_bodies[static_cast<size_t>(part_number - 1)];
+            offset = 0;
+            length = file->Size();
+        }
+
+        Aws::S3::Model::UploadPartRequest request;
+        request.SetBucket(m_bucket_name);
+        request.SetKey(m_key);
+        request.SetUploadId(m_upload_id);
+        request.SetPartNumber(part_number);
+        request.SetContentLength(static_cast<long long>(length));
+        if (m_checksum != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
+            request.SetChecksumAlgorithm(m_checksum);
+        request.SetBody(Aws::MakeShared<MappedFileStream>("MultipartUpload", std::move(file),
+            offset, length));
+
+        auto self = shared_from_this();
+        m_client.UploadPartAsync(request,
+            [self, part_number, attempt, started = LatencyMetrics::Clock::now()](
+                const Aws::S3::S3Client*,
+                const Aws::S3::Model::UploadPartRequest&,
+                const Aws::S3::Model::UploadPartOutcome& outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            Metrics().Record(S3Operation::UploadPart, started, outcome);
+            self->PartFinished(part_number, attempt, outcome);
+        });
+    }
+
+    void PartFinished(int part_number, int attempt,
+        const Aws::S3::Model::UploadPartOutcome& outcome)
+    {
+        if (!outcome.IsSuccess())
+        {
+            auto& error = outcome.GetError();
+            if (attempt < m_settings.part_attempts && !Stopped())
+            {
+                std::cout << "UploadPart " << part_number << " of " << m_key << " failed ("
+                    << error.GetExceptionName() << "), sending it again" << std::endl;
+                SendPart(part_number, attempt + 1);
+                return;
+            }
+            PartFailed(part_number, error);
+            return;
+        }
+
+        bool complete = false;
+        bool abort = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Aws::S3::Model::CompletedPart& part = m_parts[static_cast<size_t>(part_number - 1)];
+            part.SetPartNumber(part_number);
+            part.SetETag(outcome.GetResult().GetETag());
+            SetPartChecksum(part, outcome.GetResult());
+            if (m_compressor)
+                m_part_bodies[static_cast<size_t>(part_number - 1)].reset();
+            --m_in_flight;
+            complete = ++m_completed == m_part_count;
+            abort = m_error && m_in_flight == 0;
+        }
+        if (abort)
+            Abort();
+        else if (complete)
+            Complete();
+        else
+            SendParts();
+    }
+
+    void PartFailed(int part_number, const Aws::S3::S3Error& error)
+    {
+        std::cout << "UploadPart " << part_number << " of " << m_key << " error: "
+            << error.GetExceptionName() << " - " << error.GetMessage() << std::endl;
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_error)
+                m_error = error;
+            last = --m_in_flight == 0;
+        }
+        // Abort once no part is in flight, so that none is left behind
+        if (last)
+            Abort();
+    }
+
+    // Copy the part's checksum, as S3 computed it, into its entry in the
+    // CompleteMultipartUpload list
+    void SetPartChecksum(Aws::S3::Model::CompletedPart& part,
+        const Aws::S3::Model::UploadPartResult& result) const
+    {
+        using Aws::S3::Model::ChecksumAlgorithm;
+        switch (m_checksum)
+        {
+        case ChecksumAlgorithm::CRC32C: part.SetChecksumCRC32C(result.GetChecksumCRC32C()); break;
+        case ChecksumAlgorithm::CRC64NVME:
+            part.SetChecksumCRC64NVME(result.GetChecksumCRC64NVME());
+            break;
+        case ChecksumAlgorithm::SHA256: part.SetChecksumSHA256(result.GetChecksumSHA256()); break;
+        default: break;
+        }
+    }
+
+    bool Stopped()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_error.has_value();
+    }
+
+    void Complete()
+    {
+        auto self = shared_from_this();
+        Paced([self]() { self->StartComplete(); });
+    }
+
+    void StartComplete()
+    {
+        Aws::S3::Model::CompletedMultipartUpload completed;
+        completed.SetParts(std::move(m_parts));
+
+        Aws::S3::Model::CompleteMultipartUploadRequest request;
+        request.SetBucket(m_bucket_name);
+        request.SetKey(m_key);
+        request.SetUploadId(m_upload_id);
+        request.SetMultipartUpload(std::move(completed));
+
+        auto self = shared_from_this();
+        m_client.CompleteMultipartUploadAsync(request,
+            [self, started = LatencyMetrics::Clock::now()](const Aws::S3::S3Client*,
+                const Aws::S3::Model::CompleteMultipartUploadRequest&,
+                const Aws::S3::Model::CompleteMultipartUploadOutcome& outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            Metrics().Record(S3Operation::CompleteMultipartUpload, started, outcome);
+            if (!outcome.IsSuccess())
+            {
+                self->m_error = outcome.GetError();
+                self->Abort();
+                return;
+            }
+            self->m_on_finished(outcome);
+        });
+    }
+
+    // Discard the parts stored so far, then report m_error
+    void Abort()
+    {
+        if (m_compressor)
+            m_compressor->Cancel();
+
+        auto self = shared_from_this();
+        Paced([self]() { self->StartAbort(); });
+    }
+
+    void StartAbort()
+    {
+        Aws::S3::Model::AbortMultipartUploadRequest request;
+        request.SetBucket(m_bucket_name);
+        request.SetKey(m_key);
+        request.SetUploadId(m_upload_id);
+
+        auto self = shared_from_this();
+        m_client.AbortMultipartUploadAsync(request,
+            [self](const Aws::S3::S3Client*,
+                const Aws::S3::Model::AbortMultipartUploadRequest&,
+                const Aws::S3::Model::AbortMultipartUploadOutcome& outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            if (!outcome.IsSuccess())
+                std::cout << "AbortMultipartUpload error: " << self->m_key << ": "
+                    << outcome.GetError().GetExceptionName() << " - "
+                    << outcome.GetError().GetMessage() << std::endl;
+            self->m_on_finished(Aws::S3::Model::CompleteMultipartUploadOutcome(*self->m_error));
+        });
+    }
+
+    const Aws::S3::S3Client& m_client;
+    const Aws::String m_bucket_name;
+    const Aws::String m_key;
+    const std::shared_ptr<const MappedFile> m_file;
+    const std::uint64_t m_file_size;
+    const std::uint64_t m_part_size;
+    int m_part_count;               // -1 while compressed parts are still coming
+    const MultipartSettings m_settings;
+    const Aws::S3::Model::ChecksumAlgorithm m_checksum;
+    const MultipartUploadCallback m_on_finished;
+    std::shared_ptr<BlockCompressor> m_compressor;
+
+    std::mutex m_mutex;
+    Aws::String m_upload_id;
+    Aws::Vector<Aws::S3::Model::CompletedPart> m_parts;
+    std::vector<std::shared_ptr<const MappedFile>> m_part_bodies;   // While compressing
+    int m_next_part = 1;
+    size_t m_in_flight = 0;
+    int m_completed = 0;
+    std::optional<Aws::S3::S3Error> m_error;
+};
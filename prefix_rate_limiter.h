@@ -0,0 +1,365 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * Per-prefix token-bucket rate limiter
+ *
+ * S3 limits request rates per key prefix (by default 5,500 GET/HEAD and
+ * 3,500 PUT/COPY/POST/DELETE requests per second). The limiter keeps one
+ * read and one write token bucket per prefix, where the prefix of a key is
+ * its first prefix_depth delimiter-separated components. A request takes a
+ * token from its prefix's bucket; buckets refill continuously at the
+ * configured rate, up to burst_seconds' worth of tokens.
+ *
+ * Acquire() waits for tokens on the calling thread; AcquireAsync() instead
+ * defers the request to a timer thread, started on first use, so that SDK
+ * executor and worker pool threads never block on a limit. The limiter
+ * must outlive the requests deferred through it.
+ *
+ * All members are thread-safe.
+ */
+class PrefixRateLimiter
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Settings
+    {
+        size_t prefix_depth = 1;
+        char delimiter = '/';
+        double reads_per_second = 5500;
+        double writes_per_second = 3500;
+        double burst_seconds = 0.1;
+
+        /**
+         * Settings of --prefix-depth=<n> and --prefix-rate=<writes/sec>
+         * (optional; reads then get S3's 5,500:3,500 share of it). A rate
+         * that is not positive, which would never refill the buckets, is
+         * rejected: the rates are left as they were and false is returned.
+         */
+        static bool Parse(const char* prefix_depth, const char* writes_per_second,
+            Settings& settings)
+        {
+            settings.prefix_depth = std::strtoul(prefix_depth, nullptr, 10);
+            if (!writes_per_second)
+                return true;
+            double writes = std::strtod(writes_per_second, nullptr);
+            if (!(writes > 0))
+                return false;
+            settings.writes_per_second = writes;
+            settings.reads_per_second = writes * 5500 / 3500;
+            return true;
+        }
+    };
+
+    explicit PrefixRateLimiter(const Settings& settings)
+        : m_settings(settings)
+    {
+    }
+
+    /**
+     * Deferred requests not yet sent are dropped
+     */
+    ~PrefixRateLimiter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_timer_mutex);
+            m_stop = true;
+        }
+        m_timer_wakeup.notify_all();
+        if (m_timer.joinable())
+            m_timer.join();
+    }
+
+    PrefixRateLimiter(const PrefixRateLimiter&) = delete;
+    PrefixRateLimiter& operator=(const PrefixRateLimiter&) = delete;
+
+    const Settings& GetSettings() const { return m_settings; }
+
+    /**
+     * The rate-limited prefix of a key
+     */
+    Aws::String PrefixOf(const Aws::String& key) const
+    {
+        size_t end = 0;
+        for (size_t depth = 0; depth < m_settings.prefix_depth; ++depth)
+        {
+            end = key.find(m_settings.delimiter, end);
+            if (end == Aws::String::npos)
+                return key;
+            ++end;
+        }
+        return key.substr(0, end);
+    }
+
+    /**
+     * Take reads read tokens and writes write tokens from the bucket of
+     * prefix if both are available. Otherwise take nothing and set wait to
+     * the time until they will be.
+     */
+    bool TryAcquire(const Aws::String& prefix, unsigned reads, unsigned writes,
+        Clock::duration& wait)
+    {
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        PrefixBuckets& buckets = BucketsFor(prefix, now);
+        Refill(buckets, now);
+
+        double read_shortfall = reads - buckets.read_tokens;
+        double write_shortfall = writes - buckets.write_tokens;
+        double wait_seconds = std::max(read_shortfall / m_settings.reads_per_second,
+            write_shortfall / m_settings.writes_per_second);
+        if (wait_seconds > 0)
+        {
+            wait = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(wait_seconds));
+            return false;
+        }
+
+        buckets.read_tokens -= reads;
+        buckets.write_tokens -= writes;
+        return true;
+    }
+
+    /**
+     * Take tokens for a request on key, waiting as long as necessary
+     */
+    void Acquire(const Aws::String& key, unsigned reads, unsigned writes)
+    {
+        const Aws::String prefix = PrefixOf(key);
+        Clock::duration wait;
+        while (!TryAcquire(prefix, reads, writes, wait))
+            std::this_thread::sleep_for(wait);
+    }
+
+    /**
+     * Take tokens for a request on key, then call send: at once if they are
+     * available, otherwise on the timer thread once they are. Never blocks.
+     */
+    void AcquireAsync(const Aws::String& key, unsigned reads, unsigned writes,
+        std::function<void()> send)
+    {
+        const Aws::String prefix = PrefixOf(key);
+        Clock::duration wait;
+        if (TryAcquire(prefix, reads, writes, wait))
+        {
+            send();
+            return;
+        }
+        Defer(prefix, reads, writes, std::move(send), wait);
+    }
+
+private:
+    struct PrefixBuckets
+    {
+        double read_tokens;
+        double write_tokens;
+        Clock::time_point refilled;
+    };
+
+    double ReadCapacity() const
+    {
+        return std::max(1.0, m_settings.reads_per_second * m_settings.burst_seconds);
+    }
+
+    double WriteCapacity() const
+    {
+        return std::max(1.0, m_settings.writes_per_second * m_settings.burst_seconds);
+    }
+
+    // m_mutex must be held
+    void Refill(PrefixBuckets& buckets, Clock::time_point now) const
+    {
+        double elapsed = std::chrono::duration<double>(now - buckets.refilled).count();
+        buckets.read_tokens = std::min(ReadCapacity(),
+            buckets.read_tokens + elapsed * m_settings.reads_per_second);
+        buckets.write_tokens = std::min(WriteCapacity(),
+            buckets.write_tokens + elapsed * m_settings.writes_per_second);
+        buckets.refilled = now;
+    }
+
+    // m_mutex must be held
+    PrefixBuckets& BucketsFor(const Aws::String& prefix, Clock::time_point now)
+    {
+        auto found = m_buckets.find(prefix);
+        if (found != m_buckets.end())
+            return found->second;
+
+        // Full, idle buckets carry no state; drop them now and then so that
+        // a job over millions of prefixes does not keep one per prefix
+        if (m_buckets.size() >= m_prune_at)
+        {
+            for (auto it = m_buckets.begin(); it != m_buckets.end();)
+            {
+                Refill(it->second, now);
+                if (it->second.read_tokens >= ReadCapacity() &&
+                    it->second.write_tokens >= WriteCapacity())
+                    it = m_buckets.erase(it);
+                else
+                    ++it;
+            }
+            m_prune_at = std::max<size_t>(1024, 2 * m_buckets.size());
+        }
+
+        PrefixBuckets buckets{ ReadCapacity(), WriteCapacity(), now };
+        return m_buckets.emplace(prefix, buckets).first->second;
+    }
+
+    // Try again for the tokens of a deferred request after wait
+    void Defer(const Aws::String& prefix, unsigned reads, unsigned writes,
+        std::function<void()> send, Clock::duration wait)
+    {
+        auto retry = [this, prefix, reads, writes, send = std::move(send)]()
+        {
+            Clock::duration next_wait;
+            if (TryAcquire(prefix, reads, writes, next_wait))
+                send();
+            else
+                Defer(prefix, reads, writes, send, next_wait);
+        };
+        {
+            std::lock_guard<std::mutex> lock(m_timer_mutex);
+            m_tasks.emplace(Clock::now() + wait, std::move(retry));
+            if (!m_timer.joinable())
+                m_timer = std::thread([this]() { TimerLoop(); });
+        }
+        m_timer_wakeup.notify_one();
+    }
+
+    void TimerLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_timer_mutex);
+        while (!m_stop)
+        {
+            if (m_tasks.empty())
+            {
+                m_timer_wakeup.wait(lock);
+                continue;
+            }
+            auto first = m_tasks.begin();
+            if (first->first > Clock::now())
+            {
+                m_timer_wakeup.wait_until(lock, first->first);
+                continue;
+            }
+            std::function<void()> task = std::move(first->second);
+            m_tasks.erase(first);
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    const Settings m_settings;
+    std::mutex m_mutex;
+    std::unordered_map<Aws::String, PrefixBuckets> m_buckets;
+    size_t m_prune_at = 1024;
+
+    std::mutex m_timer_mutex;
+    std::condition_variable m_timer_wakeup;
+    std::multimap<Clock::time_point, std::function<void()>> m_tasks;
+    bool m_stop = false;
+    std::thread m_timer;
+};
+
+/**
+ * Reorder work so that requests are spread across rate-limited prefixes
+ *
+ * Listings return keys in order, so consecutive keys usually share a
+ * prefix and would queue behind one prefix's limit. Items are queued per
+ * prefix and Pop() takes them round-robin from the prefixes whose token
+ * buckets have room, so the aggregate rate approaches the sum of the
+ * per-prefix limits. Not thread-safe; meant for the dispatching thread.
+ */
+template <typename Item>
+class PrefixInterleaver
+{
+public:
+    PrefixInterleaver(PrefixRateLimiter& limiter, unsigned reads, unsigned writes)
+        : m_limiter(limiter), m_reads(reads), m_writes(writes)
+    {
+    }
+
+    void Push(const Aws::String& key, Item item)
+    {
+        Aws::String prefix = m_limiter.PrefixOf(key);
+        auto& queue = m_queues[prefix];
+        if (queue.empty())
+            m_ready.push_back(prefix);
+        queue.push_back(std::move(item));
+        ++m_size;
+    }
+
+    size_t Size() const { return m_size; }
+
+    /**
+     * Take the next item whose prefix has tokens, waiting if none has.
+     * Returns false if no items are queued.
+     */
+    bool Pop(Item& item)
+    {
+        while (m_size > 0)
+        {
+            PrefixRateLimiter::Clock::duration shortest_wait =
+                PrefixRateLimiter::Clock::duration::max();
+            for (size_t tried = 0; tried < m_ready.size(); ++tried)
+            {
+                Aws::String prefix = std::move(m_ready.front());
+                m_ready.pop_front();
+
+                PrefixRateLimiter::Clock::duration wait;
+                if (m_limiter.TryAcquire(prefix, m_reads, m_writes, wait))
+                {
+                    auto found = m_queues.find(prefix);
+                    item = std::move(found->second.front());
+                    found->second.pop_front();
+                    --m_size;
+                    if (found->second.empty())
+                        m_queues.erase(found);
+                    else
+                        m_ready.push_back(std::move(prefix));
+                    return true;
+                }
+                shortest_wait = std::min(shortest_wait, wait);
+                m_ready.push_back(std::move(prefix));
+            }
+            std::this_thread::sleep_for(shortest_wait);
+        }
+        return false;
+    }
+
+private:
+    PrefixRateLimiter& m_limiter;
+    const unsigned m_reads;
+    const unsigned m_writes;
+    std::unordered_map<Aws::String, std::deque<Item>> m_queues;
+    std::deque<Aws::String> m_ready;
+    size_t m_size = 0;
+};
@@ -23,116 +23,662 @@
 //snippet-start:[s3.cpp.put_object_async.inc]
 #include <aws/core/Aws.h>
 #include <aws/s3/S3Client.h>
+#include <aws/s3/model/HeadObjectRequest.h>
 #include <aws/s3/model/PutObjectRequest.h>
+#include <algorithm>
+#include <cctype>
 #include <chrono>
-#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <mutex>
+#include <optional>
 #include <sys/stat.h>
 #include <thread>
 //snippet-end:[s3.cpp.put_object_async.inc]
+#include "checksum.h"
+#include "block_compressor.h"
+#include "command_line.h"
+#include "concurrency_controller.h"
+#include "etag.h"
+#include "latency_metrics.h"
+#include "local_s3.h"
+#include "mapped_file_stream.h"
+#include "multipart_upload.h"
+#include "prefix_rate_limiter.h"
+#include "put_object_async.h"
+#include "request_hedger.h"
+#include "request_trace.h"
+#include "s3_runtime.h"
+#include "work_pool.h"
 
 /**
- * Check if file exists
+ * Caller context of an upload
+ */
+class UploadContext : public Aws::Client::AsyncCallerContext
+{
+public:
+    LatencyMetrics::Clock::time_point started;
+    std::shared_ptr<RequestTrace> trace;
+    ConcurrencyController* controller = nullptr;
+    ConcurrencyController::Ticket ticket;
+    std::function<void(const Aws::String&, bool)> on_finished;
+    std::function<void(const Aws::String&)> on_skipped;
+    bool verbose = true;
+    UploadHandle handle;
+
+    // Where a successful upload is recorded (see UploadOptions::manifest)
+    UploadManifest* manifest = nullptr;
+    std::string file_name;
+    std::string target;
+    struct stat file_stat;
+
+    // Whether the CRC64NVME S3 returns for the upload is that of the file:
+    // it was sent with that checksum and not compressed
+    bool file_checksum = false;
+};
+
+/**
+ * Record the upload's file in the manifest, with etag, then call done
  *
- * Note: If using C++17, can use std::filesystem::exists()
+ * The content hash is taken from crc64nvme, the checksum S3 computed, when
+ * there is one. Otherwise the file is hashed by a WorkPool task, so that
+ * no executor thread reads the whole file, and done is called from it.
  */
-inline bool file_exists(const std::string& name)
+void record_in_manifest(const std::shared_ptr<const UploadContext>& upload,
+    const Aws::String& etag,
+    const Aws::String& crc64nvme,
+    std::function<void()> done)
 {
-    struct stat buffer;
-    return (stat(name.c_str(), &buffer) == 0);
+    if (!crc64nvme.empty()) {
+        upload->manifest->Record(upload->file_name, upload->target, upload->file_stat,
+            etag.c_str(), UploadManifest::ContentHashOf(crc64nvme));
+        done();
+        return;
+    }
+    WorkPool::Instance().Submit([upload, etag, done = std::move(done)]()
+    {
+        upload->manifest->Record(upload->file_name, upload->target, upload->file_stat,
+            etag.c_str(), UploadManifest::ContentHash(upload->file_name));
+        done();
+    });
 }
 
 /**
- * Function called when PutObjectAsync() finishes
+ * Report a finished upload, single or multipart (see MultipartUpload); its
+ * latency is recorded as PutObject either way
  *
- * The thread that started the async operation is waiting for the operation
- * to finish. A std::condition_variable is used to communicate between the
- * two threads.
-*/
-// snippet-start:[s3.cpp.put_object_async_finished.code]
-std::mutex upload_mutex;
-std::condition_variable upload_variable;
-bool upload_finished = false;
+ * The upload's handle is completed last, so that a thread waiting on it
+ * sees every other effect of the upload. With a manifest, the upload keeps
+ * its place in the controller's window until it is recorded.
+ */
+template <typename Outcome>
+void finish_upload(const std::shared_ptr<const Aws::Client::AsyncCallerContext>& context,
+    const Outcome& outcome)
+{
+    auto upload = std::dynamic_pointer_cast<const UploadContext>(context);
+    std::optional<RequestTraceCallback> trace_callback;
+    trace_callback.emplace(upload ? upload->trace : nullptr);
+
+    // Output operation status
+    if (outcome.IsSuccess()) {
+        if (!upload || upload->verbose)
+            std::cout << "Finished uploading " << context->GetUUID() << std::endl;
+    }
+    else {
+        auto error = outcome.GetError();
+        std::cout << "ERROR: " << context->GetUUID() << ": " << error.GetExceptionName()
+            << ": " << error.GetMessage() << std::endl;
+    }
+    if (!upload)
+        return;
+
+    // Record the latency, and finish the trace before the waiting thread
+    // can close it
+    Metrics().Record(S3Operation::PutObject, upload->started, outcome);
+    trace_callback.reset();
 
+    // Let the controller adapt its window and start the next upload, then
+    // wake the threads waiting for this one
+    const bool success = outcome.IsSuccess();
+    const ConcurrencyController::Signal signal = success ?
+        ConcurrencyController::Signal::Success :
+        IsThrottlingError(outcome.GetError()) ? ConcurrencyController::Signal::Throttled :
+        ConcurrencyController::Signal::Error;
+    auto done = [upload, success, signal]()
+    {
+        if (upload->on_finished)
+            upload->on_finished(upload->GetUUID(), success);
+        if (upload->controller)
+            upload->controller->Release(upload->ticket, signal);
+        upload->handle.Complete(success);
+    };
+    if (upload->manifest && success)
+        record_in_manifest(upload, outcome.GetResult().GetETag(),
+            upload->file_checksum ? outcome.GetResult().GetChecksumCRC64NVME() : Aws::String(),
+            done);
+    else
+        done();
+}
+
+/**
+ * Function called when PutObjectAsync() finishes
+ */
+// snippet-start:[s3.cpp.put_object_async_finished.code]
 void put_object_async_finished(const Aws::S3::S3Client* client, 
     const Aws::S3::Model::PutObjectRequest& request, 
     const Aws::S3::Model::PutObjectOutcome& outcome,
     const std::shared_ptr<const Aws::Client::AsyncCallerContext>& context)
 {
-    // Output operation status
-    if (outcome.IsSuccess()) {
-        std::cout << "Finished uploading " << context->GetUUID() << std::endl;
+    finish_upload(context, outcome);
+}
+// snippet-end:[s3.cpp.put_object_async_finished.code]
+
+/**
+ * Send body as the object in one PutObject
+ */
+void put_object(const Aws::String& s3_bucket_name,
+    const Aws::String& s3_object_name,
+    const std::shared_ptr<Aws::IOStream>& body,
+    const UploadOptions& options,
+    const std::shared_ptr<UploadContext>& context)
+{
+    // Set up request
+    Aws::S3::Model::PutObjectRequest object_request;
+
+    object_request.SetBucket(s3_bucket_name);
+    object_request.SetKey(s3_object_name);
+    if (options.checksum != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
+        object_request.SetChecksumAlgorithm(options.checksum);
+    if (options.compression.enabled)
+        object_request.SetContentEncoding("zstd");
+    object_request.SetBody(body);
+    RequestTrace::Attach(context->trace, object_request);
+
+    // Put the object asynchronously
+    S3Runtime::Instance().Client().PutObjectAsync(object_request, 
+                             put_object_async_finished,
+                             context);
+}
+
+/**
+ * Send the upload of context, single or multipart by the file's size
+ *
+ * With compression, a file below the multipart threshold still goes up in
+ * a single PutObject, once all of its blocks are compressed.
+ */
+void start_upload(const Aws::String& s3_bucket_name,
+    const Aws::String& s3_object_name,
+    const std::string& file_name,
+    std::uint64_t file_size,
+    const UploadOptions& options,
+    const std::shared_ptr<UploadContext>& context)
+{
+    // Large files go up in parts, several at a time, each part paced on
+    // its own
+    if (file_size >= options.multipart.threshold) {
+        context->trace = RequestTrace::Start("MultipartUpload", s3_object_name);
+        context->started = LatencyMetrics::Clock::now();
+        MultipartSettings multipart = options.multipart;
+        multipart.rate_limiter = options.rate_limiter;
+        MultipartUpload::Start(S3Runtime::Instance().Client(), s3_bucket_name,
+            s3_object_name, file_name, file_size, multipart, options.checksum,
+            options.compression,
+            [context](const Aws::S3::Model::CompleteMultipartUploadOutcome& outcome)
+            {
+                finish_upload(context, outcome);
+            });
+        return;
+    }
+
+    context->trace = RequestTrace::Start("PutObject", s3_object_name);
+    context->started = LatencyMetrics::Clock::now();
+    // Send the body straight from the page cache (see MappedFileStream),
+    // through an FStream if the file cannot be mapped
+    auto mapped_file = MappedFile::Open(file_name);
+    if (!options.compression.enabled) {
+        std::shared_ptr<Aws::IOStream> input_data;
+        if (mapped_file)
+            input_data = Aws::MakeShared<MappedFileStream>("SampleAllocationTag",
+                mapped_file);
+        else
+            input_data = Aws::MakeShared<Aws::FStream>("SampleAllocationTag",
+                file_name.c_str(),
+                std::ios_base::in | std::ios_base::binary);
+        put_object(s3_bucket_name, s3_object_name, input_data, options, context);
+        return;
+    }
+
+    if (!mapped_file) {
+        finish_upload(context, Aws::S3::Model::PutObjectOutcome(Aws::S3::S3Error(
+            Aws::S3::S3Errors::INTERNAL_FAILURE, "ReadFailed", "Cannot map " + file_name,
+            false)));
+        return;
+    }
+    BlockCompressor::Start(mapped_file, options.compression,
+        std::numeric_limits<std::uint64_t>::max(), 1,
+        [s3_bucket_name, s3_object_name, options, context](BlockCompressor& compressor)
+        {
+            std::shared_ptr<const MappedFile> body;
+            BlockCompressor::Status status = compressor.NextPart(body);
+            if (status == BlockCompressor::Status::Ready)
+                put_object(s3_bucket_name, s3_object_name,
+                    Aws::MakeShared<MappedFileStream>("SampleAllocationTag", body),
+                    options, context);
+            else if (status == BlockCompressor::Status::Failed)
+                finish_upload(context, Aws::S3::Model::PutObjectOutcome(Aws::S3::S3Error(
+                    Aws::S3::S3Errors::INTERNAL_FAILURE, "CompressionFailed",
+                    "Cannot compress " + s3_object_name, false)));
+        });
+}
+
+/**
+ * An upload waiting for its ETag comparison (see UploadOptions::compare_etag)
+ *
+ * The HeadObject and the hashing of the file run at once; whichever
+ * finishes second decides, on its own thread, whether the upload is sent.
+ */
+struct ETagComparison
+{
+    Aws::String s3_bucket_name;
+    Aws::String s3_object_name;
+    std::string file_name;
+    std::uint64_t file_size = 0;
+    UploadOptions options;
+    std::shared_ptr<UploadContext> context;
+
+    std::mutex mutex;
+    int pending = 2;
+    Aws::String local_etag;     // Empty if the file could not be mapped
+    Aws::String remote_etag;    // Empty if the HeadObject failed
+
+    // Store one side's ETag; returns true for the second to arrive
+    bool Arrive(Aws::String& side, Aws::String etag)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        side = std::move(etag);
+        return --pending == 0;
+    }
+};
+
+/**
+ * Upload unless the object already has the file's ETag; an unchanged file
+ * is reported like one the manifest skips, and recorded in the manifest
+ */
+void etag_compared(const std::shared_ptr<ETagComparison>& comparison)
+{
+    const UploadContext& upload = *comparison->context;
+    if (!same_etag(comparison->local_etag, comparison->remote_etag)) {
+        // The HeadObject took the upload's first token, a read. This runs on
+        // an executor or pool thread, so the upload waits for its write
+        // token on the limiter's timer instead.
+        auto upload_file = [comparison]()
+        {
+            start_upload(comparison->s3_bucket_name, comparison->s3_object_name,
+                comparison->file_name, comparison->file_size, comparison->options,
+                comparison->context);
+        };
+        if (comparison->options.rate_limiter)
+            comparison->options.rate_limiter->AcquireAsync(comparison->s3_object_name,
+                0, 1, upload_file);
+        else
+            upload_file();
+        return;
+    }
+
+    if (upload.verbose)
+        std::cout << "Unchanged " << comparison->s3_object_name << std::endl;
+    auto done = [comparison]()
+    {
+        const UploadContext& upload = *comparison->context;
+        if (upload.on_skipped)
+            upload.on_skipped(comparison->s3_object_name);
+        if (upload.controller)
+            upload.controller->Release(upload.ticket, ConcurrencyController::Signal::Success);
+        upload.handle.Complete(true);
+    };
+    if (upload.manifest)
+        record_in_manifest(comparison->context, comparison->remote_etag, Aws::String(), done);
+    else
+        done();
+}
+
+/**
+ * Ask S3 for the object's ETag and, while the request is in flight, hash
+ * the file the way S3 would for this upload (see local_etag_async()), its
+ * parts in parallel off the calling thread; then upload only if they differ
+ */
+void compare_etag_and_upload(const Aws::String& s3_bucket_name,
+    const Aws::String& s3_object_name,
+    const std::string& file_name,
+    std::uint64_t file_size,
+    const UploadOptions& options,
+    const std::shared_ptr<UploadContext>& context)
+{
+    auto comparison = std::make_shared<ETagComparison>();
+    comparison->s3_bucket_name = s3_bucket_name;
+    comparison->s3_object_name = s3_object_name;
+    comparison->file_name = file_name;
+    comparison->file_size = file_size;
+    comparison->options = options;
+    comparison->context = context;
+
+    Aws::S3::Model::HeadObjectRequest head_request;
+    head_request.SetBucket(s3_bucket_name);
+    head_request.SetKey(s3_object_name);
+
+    // A hedged read may be sent twice, so its copies are not hooked: it is
+    // traced as one span from the call to the answer
+    RequestHedger* hedger = options.head_hedger;
+    auto head_trace = RequestTrace::Start(hedger ? "HeadObjectHedged" : "HeadObject",
+        s3_object_name);
+    if (!hedger)
+        RequestTrace::Attach(head_trace, head_request);
+
+    auto on_head = [comparison, head_trace, started = LatencyMetrics::Clock::now()](
+        const Aws::S3::Model::HeadObjectOutcome& outcome)
+    {
+        bool second;
+        {
+            RequestTraceCallback trace_callback(head_trace);
+            Metrics().Record(S3Operation::HeadObject, started, outcome);
+            second = comparison->Arrive(comparison->remote_etag,
+                outcome.IsSuccess() ? outcome.GetResult().GetETag() : Aws::String());
+        }
+        if (second)
+            etag_compared(comparison);
+    };
+    if (hedger) {
+        SendHedged<Aws::S3::Model::HeadObjectRequest, Aws::S3::Model::HeadObjectOutcome>(
+            *hedger, head_request, HeadObjectStarter(S3Runtime::Instance().Client()), on_head);
     }
     else {
-        auto error = outcome.GetError();
-        std::cout << "ERROR: " << error.GetExceptionName() << ": "
-            << error.GetMessage() << std::endl;
+        S3Runtime::Instance().Client().HeadObjectAsync(head_request,
+            [on_head](const Aws::S3::S3Client*,
+                const Aws::S3::Model::HeadObjectRequest&,
+                const Aws::S3::Model::HeadObjectOutcome& outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+            {
+                on_head(outcome);
+            });
     }
 
-    // Update global flag and notify waiting function
-#if 0
-    std::unique_lock<std::mutex> lock(upload_mutex);
-    upload_finished = true;
-    lock.unlock();
-#endif
-    upload_variable.notify_one();
+    auto mapped_file = MappedFile::Open(file_name);
+    if (!mapped_file) {
+        if (comparison->Arrive(comparison->local_etag, Aws::String()))
+            etag_compared(comparison);
+        return;
+    }
+    local_etag_async(std::move(mapped_file), file_size >= options.multipart.threshold
+        ? options.multipart.PartSize(file_size) : 0,
+        [comparison](Aws::String etag)
+        {
+            if (comparison->Arrive(comparison->local_etag, std::move(etag)))
+                etag_compared(comparison);
+        });
 }
-// snippet-end:[s3.cpp.put_object_async_finished.code]
 
 /**
  * Asynchronously put an object into an Amazon S3 bucket
+ *
+ * The upload runs on the shared client of the process-wide S3Runtime, which
+ * outlives the request. (A client local to this function was destroyed while
+ * the upload was still in flight.)
+ *
+ * The call may wait before starting the upload: for a token of
+ * options.rate_limiter, then for room in the window of options.controller,
+ * so that no place in the window is held while waiting for a token.
+ *
+ * Files of options.multipart.threshold bytes or more are sent as a
+ * multipart upload whose parts go up concurrently and are retried one by
+ * one (see MultipartUpload), instead of as a single stream.
+ *
+ * Returns the upload's own handle (see UploadHandle) to wait on. An upload
+ * that cannot start, because the file does not exist, is reported through
+ * options.on_finished and the handle like any other failure. A file
+ * options.manifest records as unchanged is not sent at all: it goes to
+ * options.on_skipped and its handle completes successfully, as does one
+ * whose object already has its ETag when options.compare_etag is set.
  */
 // snippet-start:[s3.cpp.put_object_async.code]
-bool put_s3_object_async(const Aws::String& s3_bucket_name,
+UploadHandle put_s3_object_async(const Aws::String& s3_bucket_name,
     const Aws::String& s3_object_name,
     const std::string& file_name,
-    const Aws::String& region = "")
+    const UploadOptions& options)
 {
+    UploadHandle handle = UploadHandle::Create(s3_object_name);
+
     // Verify file_name exists
-    if (!file_exists(file_name)) {
+    struct stat file_stat;
+    if (stat(file_name.c_str(), &file_stat) != 0) {
         std::cout << "ERROR: NoSuchFile: The specified file does not exist"
             << std::endl;
-        return false;
+        if (options.on_finished)
+            options.on_finished(s3_object_name, false);
+        handle.Complete(false);
+        return handle;
     }
+    const std::uint64_t file_size = static_cast<std::uint64_t>(file_stat.st_size);
 
-    // If region is specified, use it
-    Aws::Client::ClientConfiguration clientConfig;
-    if (!region.empty())
-        clientConfig.region = region;
-
-    // Set up request
-    Aws::S3::S3Client s3_client(clientConfig);
-    Aws::S3::Model::PutObjectRequest object_request;
+    // Skip a file unchanged since its last upload to this object, before it
+    // takes a place in the window or a request
+    const std::string target =
+        std::string(s3_bucket_name.c_str()) + "/" + s3_object_name.c_str();
+    if (options.manifest &&
+        options.manifest->Unchanged(file_name, target, file_stat, options.verify_hash)) {
+        if (options.verbose)
+            std::cout << "Unchanged " << s3_object_name << std::endl;
+        if (options.on_skipped)
+            options.on_skipped(s3_object_name);
+        handle.Complete(true);
+        return handle;
+    }
 
-    object_request.SetBucket(s3_bucket_name);
-    object_request.SetKey(s3_object_name);
-    const std::shared_ptr<Aws::IOStream> input_data =
-        Aws::MakeShared<Aws::FStream>("SampleAllocationTag",
-            file_name.c_str(),
-            std::ios_base::in | std::ios_base::binary);
-    object_request.SetBody(input_data);
     auto context =
-        Aws::MakeShared<Aws::Client::AsyncCallerContext>("PutObjectAllocationTag");
+        Aws::MakeShared<UploadContext>("PutObjectAllocationTag");
     context->SetUUID(s3_object_name);
+    context->on_finished = options.on_finished;
+    context->on_skipped = options.on_skipped;
+    context->verbose = options.verbose;
+    context->handle = handle;
+    if (options.manifest) {
+        context->manifest = options.manifest;
+        context->file_name = file_name;
+        context->target = target;
+        context->file_stat = file_stat;
+        context->file_checksum =
+            options.checksum == Aws::S3::Model::ChecksumAlgorithm::CRC64NVME &&
+            !options.compression.enabled;
+    }
+    if (options.rate_limiter && !options.first_request_paced) {
+        if (options.compare_etag)
+            options.rate_limiter->Acquire(s3_object_name, 1, 0);
+        else
+            options.rate_limiter->Acquire(s3_object_name, 0, 1);
+    }
+    if (options.controller) {
+        context->controller = options.controller;
+        context->ticket = options.controller->Acquire(file_size);
+    }
 
-    // Put the object asynchronously
-    s3_client.PutObjectAsync(object_request, 
-                             put_object_async_finished,
-                             context);
-#if 0
-	// This works, but how to return to main() and execute the wait or other operations there?
-	// Wait for upload to finish
-	std::cout << "Waiting for file upload to complete..." << std::endl;
-	std::unique_lock<std::mutex> lock(upload_mutex);
-	upload_variable.wait(lock);
-#endif
-    return true;
-	// Exception thrown after function exits and before returning to main()
+    // With compare_etag, the upload waits for the object's ETag
+    if (options.compare_etag) {
+        compare_etag_and_upload(s3_bucket_name, s3_object_name, file_name, file_size,
+            options, context);
+        return handle;
+    }
+    start_upload(s3_bucket_name, s3_object_name, file_name, file_size, options, context);
+    return handle;
     // snippet-end:[s3.cpp.put_object_async.code]
 }
 
+/**
+ * Upload the files produced by for_each_file(start), which calls
+ * start(file_name, object_path, size) for each, up to options.in_flight at
+ * a time
+ *
+ * A ConcurrencyController adapts the number in flight to what S3 sustains
+ * without throttling, as SetAclForPrefix() does for ACL updates.
+ *
+ * Files are started as they are enumerated, so a listing of any length is
+ * never held in memory. With a rate_limiter, they are queued per key
+ * prefix and started round-robin from the prefixes under their limits,
+ * the enumeration running up to a few thousand files ahead to find files
+ * on other prefixes.
+ */
+template <typename ForEachFile>
+BatchUploadResult upload_files(const Aws::String& s3_bucket_name,
+    const BatchUploadOptions& options,
+    ForEachFile for_each_file)
+{
+    ConcurrencyController::Settings window;
+    window.max_window = std::max<size_t>(options.in_flight, 1);
+    window.initial_window = std::min(window.initial_window, window.max_window);
+    ConcurrencyController controller(window);
+
+    std::mutex result_mutex;
+    BatchUploadResult result;
+    auto start_time = std::chrono::steady_clock::now();
+
+    struct PendingFile
+    {
+        std::string file_name;
+        Aws::String s3_object_name;
+        std::uint64_t size = 0;
+    };
+
+    // The interleaver takes the token of each upload's first request
+    PrefixRateLimiter* rate_limiter = options.upload.rate_limiter;
+    const size_t interleave_lookahead = 4 * 1000;
+    std::unique_ptr<PrefixInterleaver<PendingFile>> interleaver;
+    if (rate_limiter)
+        interleaver.reset(new PrefixInterleaver<PendingFile>(*rate_limiter,
+            options.upload.compare_etag ? 1 : 0, options.upload.compare_etag ? 0 : 1));
+
+    auto dispatch = [&](const PendingFile& file)
+    {
+        UploadOptions upload_options = options.upload;
+        upload_options.controller = &controller;
+        upload_options.first_request_paced = interleaver != nullptr;
+        upload_options.verbose = false;
+        upload_options.on_finished = [&, file_name = file.file_name, size = file.size,
+            on_finished = options.upload.on_finished](
+            const Aws::String& s3_object_name, bool success)
+        {
+            {
+                std::lock_guard<std::mutex> lock(result_mutex);
+                if (success) {
+                    ++result.succeeded;
+                    result.bytes += size;
+                }
+                else {
+                    ++result.failed;
+                    result.failed_files.push_back(file_name);
+                }
+            }
+            if (on_finished)
+                on_finished(s3_object_name, success);
+        };
+        upload_options.on_skipped = [&, on_skipped = options.upload.on_skipped](
+            const Aws::String& s3_object_name)
+        {
+            {
+                std::lock_guard<std::mutex> lock(result_mutex);
+                ++result.skipped;
+            }
+            if (on_skipped)
+                on_skipped(s3_object_name);
+        };
+        put_s3_object_async(s3_bucket_name, file.s3_object_name, file.file_name,
+            upload_options);
+    };
+
+    for_each_file([&](const std::string& file_name, const std::string& object_path,
+        std::uint64_t size)
+    {
+        PendingFile file{ file_name, options.key_prefix + object_path.c_str(), size };
+        if (!interleaver) {
+            dispatch(file);
+            return;
+        }
+        Aws::String key = file.s3_object_name;
+        interleaver->Push(key, std::move(file));
+        PendingFile next;
+        while (interleaver->Size() > interleave_lookahead && interleaver->Pop(next))
+            dispatch(next);
+    });
+    if (interleaver) {
+        PendingFile next;
+        while (interleaver->Pop(next))
+            dispatch(next);
+    }
+    controller.WaitIdle();
+
+    std::lock_guard<std::mutex> lock(result_mutex);
+    result.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start_time).count();
+    result.final_window = controller.Window();
+    result.throttles = controller.ThrottleCount();
+    return result;
+}
+
+BatchUploadResult upload_directory(const Aws::String& s3_bucket_name,
+    const std::string& directory,
+    const BatchUploadOptions& options)
+{
+    return upload_files(s3_bucket_name, options, [&directory](auto start)
+    {
+        namespace fs = std::filesystem;
+        std::error_code error;
+        fs::recursive_directory_iterator it(directory,
+            fs::directory_options::skip_permission_denied, error);
+        for (; !error && it != fs::recursive_directory_iterator(); it.increment(error)) {
+            std::error_code entry_error;
+            if (!it->is_regular_file(entry_error))
+                continue;
+            start(it->path().string(),
+                it->path().lexically_relative(directory).generic_string(),
+                it->file_size(entry_error));
+        }
+        if (error)
+            std::cout << "ERROR: cannot list " << directory << ": " << error.message()
+                << std::endl;
+    });
+}
+
+BatchUploadResult upload_file_list(const Aws::String& s3_bucket_name,
+    const std::string& list_file,
+    const BatchUploadOptions& options)
+{
+    return upload_files(s3_bucket_name, options, [&list_file](auto start)
+    {
+        std::ifstream list(list_file);
+        if (!list)
+            std::cout << "ERROR: cannot read " << list_file << std::endl;
+        std::string file_name;
+        while (std::getline(list, file_name)) {
+            if (!file_name.empty() && file_name.back() == '\r')
+                file_name.pop_back();
+            if (file_name.empty())
+                continue;
+            size_t skip = 0;
+            while (file_name.compare(skip, 2, "./") == 0)
+                skip += 2;
+            skip = file_name.find_first_not_of('/', skip);
+            if (skip == std::string::npos)
+                continue;
+            std::error_code error;
+            std::uint64_t size = std::filesystem::file_size(file_name, error);
+            start(file_name, file_name.substr(skip), error ? 0 : size);
+        }
+    });
+}
+
+#ifndef S3_SAMPLE_NO_MAIN
 /**
  * Exercise put_s3_object_async()
  */
@@ -140,7 +686,10 @@ int main(int argc, char** argv)
 {
 
     Aws::SDKOptions options;
+    // S3_LOCAL=... runs against the in-memory stand-in (see local_s3.h)
+    InstallLocalS3FromEnvironment(options);
     Aws::InitAPI(options);
+    int exit_code = 0;
     {
         // Assign these values before running the program
         const Aws::String bucket_name = "bucket-name-scalwas";
@@ -148,31 +697,153 @@ int main(int argc, char** argv)
 		const std::string file_name = "\\EraseMe\\python-3.7.3-amd64.exe";
         const Aws::String region = "";      // Optional
 
-        // Put the file into the S3 bucket
-#if 0
-        std::unique_lock<std::mutex> lock(upload_mutex);
-        upload_finished = false;
-#endif
-        if (put_s3_object_async(bucket_name, object_name, file_name, region)) {
+        // --metrics=<path> writes the latency histograms to path every 10 s
+        std::unique_ptr<MetricsFileWriter> metrics_writer;
+        if (const char* metrics_path = GetOption(argc, argv, "--metrics"))
+            metrics_writer.reset(new MetricsFileWriter(metrics_path));
+
+        // --trace=<path> writes a Chrome trace of the upload to path
+        const char* trace_path = GetOption(argc, argv, "--trace");
+        if (trace_path && !Trace().Open(trace_path))
+            std::cout << "Continuing without a trace" << std::endl;
+
+        // Files of --multipart-threshold=<MB> (64) or more are uploaded in
+        // parts of --part-size=<MB> (16), --part-concurrency=<n> (16) at once
+        UploadOptions upload_options;
+        if (const char* threshold = GetOption(argc, argv, "--multipart-threshold"))
+            upload_options.multipart.threshold = std::strtoull(threshold, nullptr, 10) << 20;
+        if (const char* part_size = GetOption(argc, argv, "--part-size"))
+            upload_options.multipart.part_size = std::strtoull(part_size, nullptr, 10) << 20;
+        if (const char* part_concurrency = GetOption(argc, argv, "--part-concurrency"))
+            upload_options.multipart.concurrency = std::max<size_t>(
+                std::strtoul(part_concurrency, nullptr, 10), 1);
+
+        // --checksum=<crc32c|crc64nvme|sha256> has S3 verify the upload
+        // against a trailing checksum
+        if (const char* checksum = GetOption(argc, argv, "--checksum")) {
+            Aws::String name = checksum;
+            std::transform(name.begin(), name.end(), name.begin(),
+                [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+            upload_options.checksum =
+                Aws::S3::Model::ChecksumAlgorithmMapper::GetChecksumAlgorithmForName(name);
+            if (!StreamingChecksum::Supported(upload_options.checksum)) {
+                std::cout << "Unknown checksum: " << checksum << std::endl;
+                upload_options.checksum = Aws::S3::Model::ChecksumAlgorithm::NOT_SET;
+            }
+        }
+
+        // --manifest=<path> skips files unchanged since the upload recorded
+        // there, by their size, mtime and inode, and with --verify-hash also
+        // their content hash; the uploads of this run are saved to it
+        std::unique_ptr<UploadManifest> manifest;
+        if (const char* manifest_path = GetOption(argc, argv, "--manifest")) {
+            manifest.reset(new UploadManifest(manifest_path));
+            upload_options.manifest = manifest.get();
+            upload_options.verify_hash = HasFlag(argc, argv, "--verify-hash");
+        }
+
+        // --compress (or --compress=<level>) compresses uploads with zstd
+        const char* compress_level = GetOption(argc, argv, "--compress");
+        if (compress_level || HasFlag(argc, argv, "--compress")) {
+            if (CompressionSettings::Available()) {
+                upload_options.compression.enabled = true;
+                if (compress_level)
+                    upload_options.compression.level = std::atoi(compress_level);
+            }
+            else
+                std::cout << "Compression needs a build with zstd" << std::endl;
+        }
+
+        // --compare-etag uploads a file only if the object's ETag differs
+        // from the one computed from the file
+        upload_options.compare_etag = HasFlag(argc, argv, "--compare-etag");
+
+        // --hedge[=<percent>] with --compare-etag hedges slow HeadObject
+        // requests, sending at most percent (default 5) more of them
+        std::unique_ptr<RequestHedger> head_hedger;
+        const char* hedge_budget = GetOption(argc, argv, "--hedge");
+        if (upload_options.compare_etag && (hedge_budget || HasFlag(argc, argv, "--hedge"))) {
+            RequestHedger::Settings hedger_settings;
+            if (hedge_budget)
+                hedger_settings.budget = std::strtod(hedge_budget, nullptr) / 100;
+            head_hedger.reset(new RequestHedger(hedger_settings));
+            upload_options.head_hedger = head_hedger.get();
+        }
+
+        // --prefix-depth=<n> paces the requests of each key prefix of n
+        // '/'-separated components to S3's limits, or --prefix-rate=<n>
+        // writes/sec
+        std::unique_ptr<PrefixRateLimiter> rate_limiter;
+        if (const char* prefix_depth = GetOption(argc, argv, "--prefix-depth")) {
+            const char* prefix_rate = GetOption(argc, argv, "--prefix-rate");
+            PrefixRateLimiter::Settings limiter_settings;
+            if (!PrefixRateLimiter::Settings::Parse(prefix_depth, prefix_rate, limiter_settings))
+                std::cout << "Invalid --prefix-rate value: " << prefix_rate
+                    << " (using the S3 default)" << std::endl;
+            rate_limiter.reset(new PrefixRateLimiter(limiter_settings));
+            upload_options.rate_limiter = rate_limiter.get();
+        }
+
+        // Batch mode: --dir=<directory> uploads every file under it, or
+        // --file-list=<file> every file it names, up to --in-flight=<n> (64)
+        // at a time, under the object names --key-prefix=<prefix> + their paths
+        const char* directory = GetOption(argc, argv, "--dir");
+        const char* file_list = GetOption(argc, argv, "--file-list");
+        BatchUploadOptions batch_options;
+        batch_options.upload = upload_options;
+        if (const char* in_flight = GetOption(argc, argv, "--in-flight"))
+            batch_options.in_flight = std::max<size_t>(std::strtoul(in_flight, nullptr, 10), 1);
+        if (const char* key_prefix = GetOption(argc, argv, "--key-prefix"))
+            batch_options.key_prefix = key_prefix;
+
+        // Build the shared client once for every operation in the process,
+        // with a connection and an executor thread for every request in
+        // flight
+        const size_t requests_in_flight = std::max(upload_options.multipart.concurrency,
+            directory || file_list ? batch_options.in_flight : 1);
+        auto config = S3Runtime::DefaultConfiguration(region,
+            static_cast<unsigned>(std::max<size_t>(requests_in_flight, 25)),
+            std::max<size_t>(requests_in_flight, std::thread::hardware_concurrency()));
+        TracingExecutor::Install(config);
+        S3Runtime runtime(config);
+
+        if (directory || file_list) {
+            BatchUploadResult result = directory
+                ? upload_directory(bucket_name, directory, batch_options)
+                : upload_file_list(bucket_name, file_list, batch_options);
+            std::cout << "Uploaded " << result.succeeded << " files ("
+                << result.bytes << " bytes) in " << result.seconds << " s: "
+                << result.FilesPerSecond() << " files/s, "
+                << result.MegabytesPerSecond() << " MB/s; "
+                << result.skipped << " unchanged, "
+                << result.failed << " failed; final window " << result.final_window
+                << " (" << result.throttles << " throttles)" << std::endl;
+            for (const std::string& failed_file : result.failed_files)
+                std::cout << "  failed: " << failed_file << std::endl;
+            exit_code = result.failed == 0 ? 0 : 1;
+        }
+        // Otherwise put the one file into the S3 bucket
+        else {
+            UploadHandle upload = put_s3_object_async(bucket_name, object_name, file_name,
+                upload_options);
             // Wait for upload to finish
             std::cout << "Waiting for file upload to complete..." << std::endl;
-			std::unique_lock<std::mutex> lock(upload_mutex);
-			upload_variable.wait(lock);
-            // upload_variable.wait(lock, []{return upload_finished;});
-#if 0
-            // Temporarily remove mutex/condition_variable; sleep instead
-            upload_finished = true;
-            while (!upload_finished) {
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-            }
-#endif
-            std::cout << "File upload completed" << std::endl;
+            if (upload.Wait())
+                std::cout << "File upload completed" << std::endl;
+            else
+                exit_code = 1;
             // We can terminate the program now
         }
-#if 0
-		put_s3_object_async(bucket_name, object_name, file_name, region);
-		std::cout << "File upload completed" << std::endl;
-#endif
+        if (manifest && !manifest->Save())
+            std::cout << "ERROR: cannot save the manifest" << std::endl;
+        if (head_hedger)
+            std::cout << "Hedged " << head_hedger->HedgeCount() << " of "
+                << head_hedger->ReadCount() << " HeadObject requests ("
+                << head_hedger->HedgeWinCount() << " answered first)" << std::endl;
+        Metrics().Report(std::cout);
+        Trace().Close();
     }
     Aws::ShutdownAPI(options);
+    return exit_code;
 }
+#endif
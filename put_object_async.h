@@ -0,0 +1,151 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/model/ChecksumAlgorithm.h>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "block_compressor.h"
+#include "concurrency_controller.h"
+#include "multipart_upload.h"
+#include "prefix_rate_limiter.h"
+#include "request_hedger.h"
+#include "upload_handle.h"
+#include "upload_manifest.h"
+
+/**
+ * Options of put_s3_object_async()
+ */
+struct UploadOptions
+{
+    // Waits for room in its window before each upload and is told of each
+    // completion (optional)
+    ConcurrencyController* controller = nullptr;
+
+    // Paces every request of an upload to the limits of its key prefix:
+    // the first (PutObject, CreateMultipartUpload, or the HeadObject of
+    // compare_etag) before the upload takes a place in the controller's
+    // window, the others as they are sent (optional)
+    PrefixRateLimiter* rate_limiter = nullptr;
+
+    // The first request's token was already taken, by the PrefixInterleaver
+    // of upload_directory() and upload_file_list()
+    bool first_request_paced = false;
+
+    // Files of at least multipart.threshold bytes are uploaded in parts
+    MultipartSettings multipart;
+
+    // Checksum S3 verifies the object (or each part) against, if set. The
+    // SDK computes it as it streams the body and sends it as a trailer, so
+    // the file is not read twice.
+    Aws::S3::Model::ChecksumAlgorithm checksum = Aws::S3::Model::ChecksumAlgorithm::NOT_SET;
+
+    // Compress the body on every core as it is sent (see BlockCompressor);
+    // files of multipart.threshold bytes or more go up in compressed parts.
+    // The ETag is then that of the compressed bytes, which compare_etag
+    // never matches.
+    CompressionSettings compression;
+
+    // Called with the object name and whether the upload succeeded, on an
+    // executor thread (a WorkPool thread when the manifest hashes the
+    // file), before the controller learns of it (optional)
+    std::function<void(const Aws::String& s3_object_name, bool success)> on_finished;
+
+    // Files it records as unchanged since their last upload to the same
+    // bucket and key are skipped without a request, and each successful
+    // upload is recorded in it (optional; save it when done). Its content
+    // hash is the CRC64NVME S3 returns with checksum CRC64NVME; otherwise
+    // the file is read once more to compute it.
+    UploadManifest* manifest = nullptr;
+
+    // Also compare the content hash of a file that looks unchanged
+    bool verify_hash = false;
+
+    // Before sending a file, compare the ETag S3 would give it (see
+    // local_etag_async()) with the object's, from a HeadObject sent while
+    // the file is hashed, and skip the upload if they are the same. For
+    // when the manifest is missing or stale; the file is read once more.
+    bool compare_etag = false;
+
+    // Hedges the HeadObject of compare_etag (optional); a hedger of its
+    // own, since HeadObject latencies are unlike those of other requests
+    RequestHedger* head_hedger = nullptr;
+
+    // Called instead of on_finished for a file the manifest or the ETag
+    // comparison skips (optional)
+    std::function<void(const Aws::String& s3_object_name)> on_skipped;
+
+    // Print a line for every successful upload; errors are always printed
+    bool verbose = true;
+};
+
+// Defined in put_object_async.cpp, which is linked without its main() by
+// programs built with S3_SAMPLE_NO_MAIN (see bench_s3_throughput.cpp).
+// Returns a handle that completes when the upload does; wait on several
+// with wait_all() or wait_any().
+UploadHandle put_s3_object_async(const Aws::String& s3_bucket_name,
+    const Aws::String& s3_object_name,
+    const std::string& file_name,
+    const UploadOptions& options = UploadOptions());
+
+/**
+ * Options of upload_directory() and upload_file_list()
+ */
+struct BatchUploadOptions
+{
+    // Most uploads in flight at once; the window adapts below it
+    size_t in_flight = 64;
+
+    // Prepended to the path of each file to form its object name
+    Aws::String key_prefix;
+
+    // Options of each upload; the controller is the batch's own. With a
+    // rate_limiter, files are started round-robin across key prefixes (see
+    // PrefixInterleaver) instead of in the order they are listed.
+    UploadOptions upload;
+};
+
+/**
+ * Aggregate result of a batch upload
+ */
+struct BatchUploadResult
+{
+    size_t succeeded = 0;
+    size_t failed = 0;
+    size_t skipped = 0;             // Unchanged according to the manifest
+    std::uint64_t bytes = 0;        // Size of the files uploaded
+    double seconds = 0;
+    size_t final_window = 0;        // Uploads in flight at once at the end
+    size_t throttles = 0;           // Uploads throttled (503 SlowDown)
+    std::vector<std::string> failed_files;
+
+    double FilesPerSecond() const { return seconds > 0 ? succeeded / seconds : 0; }
+    double MegabytesPerSecond() const { return seconds > 0 ? bytes / seconds / 1e6 : 0; }
+};
+
+// Upload every regular file under directory, recursively, as key_prefix +
+// its path relative to directory
+BatchUploadResult upload_directory(const Aws::String& s3_bucket_name,
+    const std::string& directory,
+    const BatchUploadOptions& options = BatchUploadOptions());
+
+// Upload every file named in list_file, one path per line, as key_prefix +
+// the path without leading "./" or "/"
+BatchUploadResult upload_file_list(const Aws::String& s3_bucket_name,
+    const std::string& list_file,
+    const BatchUploadOptions& options = BatchUploadOptions());
@@ -0,0 +1,371 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/S3Client.h>
+#include <aws/s3/model/GetBucketAclRequest.h>
+#include <aws/s3/model/GetObjectAclRequest.h>
+#include <aws/s3/model/HeadObjectRequest.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Hedging of idempotent reads
+ *
+ * A read that has not answered within the hedge delay is sent a second
+ * time, and whichever copy answers first is used. The delay follows the
+ * configured percentile (p95 by default) of the latencies recently seen, so
+ * only the slowest few percent of reads are hedged. A budget caps the extra
+ * load: every read earns budget hedges (0.05 by default), up to max_burst
+ * saved, and every hedge spends one.
+ *
+ * One RequestHedger should serve one kind of request, since the latencies
+ * of different operations differ. It must outlive the reads sent through
+ * it. Hedges are sent from its timer thread.
+ */
+class RequestHedger
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Settings
+    {
+        double percentile = 0.95;
+        size_t min_samples = 50;        // No hedging until this many latencies are known
+        size_t sample_window = 1024;    // Latencies the percentile is taken over
+        Clock::duration min_delay = std::chrono::milliseconds(2);
+        double budget = 0.05;           // Hedges per read
+        double max_burst = 10;
+    };
+
+    explicit RequestHedger(const Settings& settings)
+        : m_settings(settings),
+        m_samples(std::max<size_t>(settings.sample_window, 1)),
+        m_delay(Clock::duration::max())
+    {
+        m_timer = std::thread([this]() { TimerLoop(); });
+    }
+
+    /**
+     * Pending hedges are dropped; reads already sent still complete
+     */
+    ~RequestHedger()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_timer_mutex);
+            m_stop = true;
+        }
+        m_timer_wakeup.notify_all();
+        m_timer.join();
+    }
+
+    RequestHedger(const RequestHedger&) = delete;
+    RequestHedger& operator=(const RequestHedger&) = delete;
+
+    /**
+     * Delay after which a read is hedged; Clock::duration::max() while too
+     * few latencies are known
+     */
+    Clock::duration HedgeDelay() const
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        return m_delay;
+    }
+
+    /**
+     * Count a read sent and earn its share of the budget
+     */
+    void NoteRead()
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        ++m_read_count;
+        m_budget = std::min(m_budget + m_settings.budget, m_settings.max_burst);
+    }
+
+    /**
+     * Spend one hedge from the budget if it has one
+     */
+    bool TryTakeHedge()
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        if (m_budget < 1)
+            return false;
+        m_budget -= 1;
+        ++m_hedge_count;
+        return true;
+    }
+
+    /**
+     * Record the latency of a first (not hedged) copy of a read
+     */
+    void RecordLatency(Clock::duration latency)
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        m_samples[m_next_sample] = latency;
+        m_next_sample = (m_next_sample + 1) % m_samples.size();
+        m_sample_count = std::min(m_sample_count + 1, m_samples.size());
+
+        // Recompute the percentile now and then rather than on every read
+        if (m_sample_count >= m_settings.min_samples && ++m_since_update >= 32)
+        {
+            m_since_update = 0;
+            std::vector<Clock::duration> sorted(m_samples.begin(),
+                m_samples.begin() + m_sample_count);
+            auto nth = sorted.begin() + static_cast<ptrdiff_t>(
+                m_settings.percentile * (m_sample_count - 1));
+            std::nth_element(sorted.begin(), nth, sorted.end());
+            m_delay = std::max(*nth, m_settings.min_delay);
+        }
+    }
+
+    void NoteHedgeWon()
+    {
+        m_hedge_wins.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Run task on the timer thread after delay
+     */
+    void Schedule(Clock::duration delay, std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_timer_mutex);
+            m_tasks.emplace(Clock::now() + delay, std::move(task));
+        }
+        m_timer_wakeup.notify_one();
+    }
+
+    size_t ReadCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        return m_read_count;
+    }
+
+    size_t HedgeCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        return m_hedge_count;
+    }
+
+    size_t HedgeWinCount() const
+    {
+        return m_hedge_wins.load(std::memory_order_relaxed);
+    }
+
+private:
+    void TimerLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_timer_mutex);
+        while (!m_stop)
+        {
+            if (m_tasks.empty())
+            {
+                m_timer_wakeup.wait(lock);
+                continue;
+            }
+            auto first = m_tasks.begin();
+            if (first->first > Clock::now())
+            {
+                m_timer_wakeup.wait_until(lock, first->first);
+                continue;
+            }
+            std::function<void()> task = std::move(first->second);
+            m_tasks.erase(first);
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    const Settings m_settings;
+
+    mutable std::mutex m_stats_mutex;
+    std::vector<Clock::duration> m_samples;
+    size_t m_next_sample = 0;
+    size_t m_sample_count = 0;
+    size_t m_since_update = 0;
+    Clock::duration m_delay;
+    double m_budget = 0;
+    size_t m_read_count = 0;
+    size_t m_hedge_count = 0;
+    std::atomic<size_t> m_hedge_wins{ 0 };
+
+    std::mutex m_timer_mutex;
+    std::condition_variable m_timer_wakeup;
+    std::multimap<Clock::time_point, std::function<void()>> m_tasks;
+    bool m_stop = false;
+    std::thread m_timer;
+};
+
+/**
+ * Send an idempotent read, hedged by hedger
+ *
+ * start(request, on_copy_outcome) sends one copy of the read and calls
+ * on_copy_outcome with its outcome. on_outcome is called exactly once: with
+ * the first successful outcome, or with an error once no copy is left that
+ * could still succeed. It is called on the SDK thread that received the
+ * outcome, before that outcome is destroyed.
+ */
+template <typename Request, typename Outcome, typename Start>
+void SendHedged(RequestHedger& hedger, const Request& request, Start start,
+    std::function<void(const Outcome&)> on_outcome)
+{
+    struct HedgedRead
+    {
+        std::mutex mutex;
+        bool done = false;
+        int pending = 1;    // Copies sent and not answered
+        std::function<void(const Outcome&)> on_outcome;
+    };
+    auto read = std::make_shared<HedgedRead>();
+    read->on_outcome = std::move(on_outcome);
+
+    // Deliver the outcome of a copy if it is the answer
+    auto on_copy_outcome = [read, &hedger](const Outcome& outcome, bool hedge)
+    {
+        {
+            std::lock_guard<std::mutex> lock(read->mutex);
+            --read->pending;
+            if (read->done || (!outcome.IsSuccess() && read->pending > 0))
+                return;
+            read->done = true;
+        }
+        if (hedge)
+            hedger.NoteHedgeWon();
+        read->on_outcome(outcome);
+    };
+
+    hedger.NoteRead();
+    const auto sent = RequestHedger::Clock::now();
+    start(request, [&hedger, sent, on_copy_outcome](const Outcome& outcome)
+    {
+        hedger.RecordLatency(RequestHedger::Clock::now() - sent);
+        on_copy_outcome(outcome, false);
+    });
+
+    const auto delay = hedger.HedgeDelay();
+    if (delay == RequestHedger::Clock::duration::max())
+        return;
+    hedger.Schedule(delay, [&hedger, read, request, start, on_copy_outcome]()
+    {
+        {
+            std::lock_guard<std::mutex> lock(read->mutex);
+            if (read->done || read->pending == 0 || !hedger.TryTakeHedge())
+                return;
+            ++read->pending;
+        }
+        start(request, [on_copy_outcome](const Outcome& outcome)
+        {
+            on_copy_outcome(outcome, true);
+        });
+    });
+}
+
+/**
+ * Send a read through SendHedged() and wait for its outcome
+ */
+template <typename Request, typename Outcome, typename Start>
+Outcome WaitHedged(RequestHedger& hedger, const Request& request, Start start)
+{
+    auto answer = std::make_shared<std::promise<Outcome>>();
+    std::future<Outcome> outcome = answer->get_future();
+    SendHedged<Request, Outcome>(hedger, request, start,
+        [answer](const Outcome& copy_outcome) { answer->set_value(copy_outcome); });
+    return outcome.get();
+}
+
+/**
+ * Starters of single read copies for SendHedged() and WaitHedged(). The
+ * client must outlive the reads.
+ */
+inline auto GetObjectAclStarter(const Aws::S3::S3Client& s3_client)
+{
+    return [&s3_client](const Aws::S3::Model::GetObjectAclRequest& request,
+        std::function<void(const Aws::S3::Model::GetObjectAclOutcome&)> on_copy_outcome)
+    {
+        s3_client.GetObjectAclAsync(request,
+            [on_copy_outcome](const Aws::S3::S3Client*,
+                const Aws::S3::Model::GetObjectAclRequest&,
+                const Aws::S3::Model::GetObjectAclOutcome& outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            on_copy_outcome(outcome);
+        });
+    };
+}
+
+inline auto GetBucketAclStarter(const Aws::S3::S3Client& s3_client)
+{
+    return [&s3_client](const Aws::S3::Model::GetBucketAclRequest& request,
+        std::function<void(const Aws::S3::Model::GetBucketAclOutcome&)> on_copy_outcome)
+    {
+        s3_client.GetBucketAclAsync(request,
+            [on_copy_outcome](const Aws::S3::S3Client*,
+                const Aws::S3::Model::GetBucketAclRequest&,
+                const Aws::S3::Model::GetBucketAclOutcome& outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            on_copy_outcome(outcome);
+        });
+    };
+}
+
+inline auto HeadObjectStarter(const Aws::S3::S3Client& s3_client)
+{
+    return [&s3_client](const Aws::S3::Model::HeadObjectRequest& request,
+        std::function<void(const Aws::S3::Model::HeadObjectOutcome&)> on_copy_outcome)
+    {
+        s3_client.HeadObjectAsync(request,
+            [on_copy_outcome](const Aws::S3::S3Client*,
+                const Aws::S3::Model::HeadObjectRequest&,
+                const Aws::S3::Model::HeadObjectOutcome& outcome,
+                const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+        {
+            on_copy_outcome(outcome);
+        });
+    };
+}
+
+/**
+ * Hedged forms of S3Client::GetObjectAcl() and GetBucketAcl()
+ */
+inline Aws::S3::Model::GetObjectAclOutcome GetObjectAclHedged(
+    const Aws::S3::S3Client& s3_client, RequestHedger& hedger,
+    const Aws::S3::Model::GetObjectAclRequest& request)
+{
+    return WaitHedged<Aws::S3::Model::GetObjectAclRequest,
+        Aws::S3::Model::GetObjectAclOutcome>(hedger, request, GetObjectAclStarter(s3_client));
+}
+
+inline Aws::S3::Model::GetBucketAclOutcome GetBucketAclHedged(
+    const Aws::S3::S3Client& s3_client, RequestHedger& hedger,
+    const Aws::S3::Model::GetBucketAclRequest& request)
+{
+    return WaitHedged<Aws::S3::Model::GetBucketAclRequest,
+        Aws::S3::Model::GetBucketAclOutcome>(hedger, request, GetBucketAclStarter(s3_client));
+}
+
@@ -0,0 +1,441 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/core/AmazonWebServiceRequest.h>
+#include <aws/core/client/ClientConfiguration.h>
+#include <aws/core/http/HttpRequest.h>
+#include <aws/core/utils/threading/Executor.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+
+/**
+ * Timeline of S3 requests in Chrome trace event format
+ *
+ * Trace() writes spans to a JSON file that chrome://tracing and Perfetto
+ * (ui.perfetto.dev) load, from Open() until Close(). Events are formatted
+ * into a batch that goes to the file whenever it reaches BATCH_BYTES, so a
+ * long job keeps no more than one batch in memory. While the log is
+ * closed, which is the default, nothing is recorded and
+ * RequestTrace::Start() returns nullptr.
+ */
+class TraceLog
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TraceLog()
+        : m_origin(Clock::now())
+    {
+    }
+
+    /**
+     * Create the trace file at path and start recording; fails, recording
+     * nothing, if the file cannot be written
+     */
+    bool Open(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (Enabled())
+            return false;
+
+        m_out.open(path, std::ios_base::out | std::ios_base::trunc);
+        m_out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        if (!m_out.flush())
+        {
+            std::cout << "Cannot write trace file " << path << std::endl;
+            m_out.close();
+            m_out.clear();
+            return false;
+        }
+        m_path = path;
+        m_batch.str(std::string());
+        m_separator = "";
+        m_enabled.store(true, std::memory_order_release);
+        return true;
+    }
+
+    bool Enabled() const { return m_enabled.load(std::memory_order_acquire); }
+
+    /**
+     * Record a span that ran on thread tid ("X" event)
+     */
+    void Span(const char* name, const char* category, std::uint64_t tid,
+        Clock::time_point start, Clock::time_point end, const Aws::String& key)
+    {
+        Add(Event{ name, category, 'X', tid, 0, Micros(start), Micros(end) - Micros(start), key });
+    }
+
+    /**
+     * Record a span that is not tied to a thread, e.g. time spent queued,
+     * as a pair of async events ("b"/"e") with the given id
+     */
+    void AsyncSpan(const char* name, const char* category, std::uint64_t id,
+        Clock::time_point start, Clock::time_point end, const Aws::String& key)
+    {
+        Add(Event{ name, category, 'b', 0, id, Micros(start), 0, key });
+        Add(Event{ name, category, 'e', 0, id, Micros(end), 0, key });
+    }
+
+    /**
+     * Stop recording and finish the trace file
+     */
+    bool Close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_enabled.exchange(false))
+            return true;
+
+        WriteBatchLocked();
+        m_out << "\n]}\n";
+        bool written = static_cast<bool>(m_out.flush());
+        m_out.close();
+        m_out.clear();
+        if (!written)
+        {
+            std::cout << "Cannot write trace file " << m_path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Small, stable id of the calling thread for the "tid" field
+     */
+    static std::uint64_t ThreadId()
+    {
+        static std::atomic<std::uint64_t> next_id{ 1 };
+        thread_local std::uint64_t id = next_id.fetch_add(1);
+        return id;
+    }
+
+    std::uint64_t NextId()
+    {
+        return m_next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    struct Event
+    {
+        const char* name;
+        const char* category;
+        char phase;
+        std::uint64_t tid;
+        std::uint64_t id;
+        std::int64_t ts;
+        std::int64_t dur;
+        Aws::String key;
+    };
+
+    static constexpr std::streamoff BATCH_BYTES = 1024 * 1024;
+
+    std::int64_t Micros(Clock::time_point time) const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(time - m_origin).count();
+    }
+
+    void Add(const Event& event)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!Enabled())
+            return;
+
+        m_batch << m_separator << "{\"name\":\"" << event.name << "\",\"cat\":\""
+            << event.category << "\",\"ph\":\"" << event.phase
+            << "\",\"pid\":1,\"tid\":" << event.tid << ",\"ts\":" << event.ts;
+        if (event.phase == 'X')
+            m_batch << ",\"dur\":" << event.dur;
+        else
+            m_batch << ",\"id\":" << event.id;
+        m_batch << ",\"args\":{\"key\":\"";
+        WriteJsonString(m_batch, event.key);
+        m_batch << "\"}}";
+        m_separator = ",\n";
+        if (m_batch.tellp() >= BATCH_BYTES)
+            WriteBatchLocked();
+    }
+
+    // m_mutex must be held
+    void WriteBatchLocked()
+    {
+        m_out << m_batch.str();
+        m_batch.str(std::string());
+    }
+
+    static void WriteJsonString(std::ostream& out, const Aws::String& text)
+    {
+        static const char hex[] = "0123456789abcdef";
+        for (unsigned char c : text)
+        {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (c < 0x20)
+                out << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+            else
+                out << c;
+        }
+    }
+
+    const Clock::time_point m_origin;
+    std::atomic<bool> m_enabled{ false };
+    std::atomic<std::uint64_t> m_next_id{ 1 };
+    std::mutex m_mutex;
+    std::string m_path;
+    std::ofstream m_out;
+    std::ostringstream m_batch;
+    const char* m_separator = "";
+};
+
+inline TraceLog& Trace()
+{
+    static TraceLog trace;
+    return trace;
+}
+
+/**
+ * Executor that notes when each task starts running
+ *
+ * The SDK runs an *Async() request as one task of the client's executor.
+ * Wrapping the executor lets RequestTrace tell the time a request waited
+ * for an executor thread from the time it spent on the network.
+ */
+class TracingExecutor : public Aws::Utils::Threading::Executor
+{
+public:
+    explicit TracingExecutor(std::shared_ptr<Aws::Utils::Threading::Executor> executor)
+        : m_executor(std::move(executor))
+    {
+    }
+
+    /**
+     * Start time of the task running on the calling thread
+     */
+    static TraceLog::Clock::time_point& TaskStarted()
+    {
+        thread_local TraceLog::Clock::time_point started;
+        return started;
+    }
+
+    /**
+     * Wrap the executor of config when tracing is enabled
+     */
+    static void Install(Aws::Client::ClientConfiguration& config)
+    {
+        if (Trace().Enabled() && config.executor)
+            config.executor = Aws::MakeShared<TracingExecutor>("TracingExecutor",
+                config.executor);
+    }
+
+protected:
+    bool SubmitToThread(std::function<void()>&& task) override
+    {
+        return m_executor->Submit([task = std::move(task)]()
+        {
+            TaskStarted() = TraceLog::Clock::now();
+            task();
+        });
+    }
+
+private:
+    std::shared_ptr<Aws::Utils::Threading::Executor> m_executor;
+};
+
+/**
+ * Lifecycle of one S3 request, recorded as the spans
+ *
+ *   queue      from the call until an executor thread picks the request up
+ *              (*Async() calls only; needs TracingExecutor)
+ *   sign       building and signing the HTTP request
+ *   send       sending the request body (requests with a body)
+ *   wait       until the first byte of the response
+ *   receive    reading and parsing the response
+ *   callback   the response handler
+ *
+ * Attach() hooks the request's signing and data handlers; the response
+ * handler calls CallbackStarted() on entry and Finish() on exit. Retries
+ * are folded into the spans of the first attempt.
+ */
+class RequestTrace
+{
+public:
+    using Clock = TraceLog::Clock;
+
+    /**
+     * A trace for one request of operation on key, or nullptr if tracing
+     * is off
+     */
+    static std::shared_ptr<RequestTrace> Start(const char* operation, const Aws::String& key)
+    {
+        if (!Trace().Enabled())
+            return nullptr;
+        return std::make_shared<RequestTrace>(operation, key);
+    }
+
+    RequestTrace(const char* operation, const Aws::String& key)
+        : m_operation(operation), m_key(key), m_issued(Clock::now())
+    {
+    }
+
+    /**
+     * Hook the handlers of request; the request must not be sent twice at
+     * once (e.g. hedged), since the handlers share this trace
+     */
+    static void Attach(const std::shared_ptr<RequestTrace>& trace,
+        Aws::AmazonWebServiceRequest& request)
+    {
+        if (!trace)
+            return;
+        request.SetRequestSignedHandler([trace](const Aws::Http::HttpRequest&)
+        {
+            if (trace->m_signed == Clock::time_point())
+            {
+                // The task start is only ours if it is not older than the call
+                Clock::time_point task_started = TracingExecutor::TaskStarted();
+                trace->m_started = task_started > trace->m_issued ? task_started
+                    : trace->m_issued;
+                trace->m_signed = Clock::now();
+            }
+        });
+        request.SetDataSentEventHandler([trace](const Aws::Http::HttpRequest*, long long)
+        {
+            trace->m_sent = Clock::now();
+        });
+        request.SetDataReceivedEventHandler(
+            [trace](const Aws::Http::HttpRequest*, Aws::Http::HttpResponse*, long long)
+        {
+            if (trace->m_first_byte == Clock::time_point())
+                trace->m_first_byte = Clock::now();
+        });
+    }
+
+    void CallbackStarted()
+    {
+        m_callback_started = Clock::now();
+    }
+
+    /**
+     * Record the spans; call at the end of the response handler
+     */
+    void Finish()
+    {
+        const Clock::time_point finished = Clock::now();
+        if (m_callback_started == Clock::time_point())
+            m_callback_started = finished;
+        TraceLog& trace = Trace();
+        const std::uint64_t tid = TraceLog::ThreadId();
+
+        // Without the signing hook (e.g. a failure before signing) the whole
+        // request is one span
+        if (m_signed == Clock::time_point())
+        {
+            trace.Span(m_operation, "request", tid, m_issued, m_callback_started, m_key);
+        }
+        else
+        {
+            if (m_started > m_issued)
+                trace.AsyncSpan("queue", m_operation, trace.NextId(), m_issued, m_started, m_key);
+            trace.Span("sign", m_operation, tid, m_started, m_signed, m_key);
+            Clock::time_point sent = m_signed;
+            if (m_sent > m_signed)
+            {
+                trace.Span("send", m_operation, tid, m_signed, m_sent, m_key);
+                sent = m_sent;
+            }
+            Clock::time_point first_byte = m_first_byte > sent ? m_first_byte
+                : m_callback_started;
+            trace.Span("wait", m_operation, tid, sent, first_byte, m_key);
+            if (m_callback_started > first_byte)
+                trace.Span("receive", m_operation, tid, first_byte, m_callback_started, m_key);
+        }
+        trace.Span("callback", m_operation, tid, m_callback_started, finished, m_key);
+    }
+
+private:
+    const char* const m_operation;
+    const Aws::String m_key;
+    const Clock::time_point m_issued;
+    Clock::time_point m_started;
+    Clock::time_point m_signed;
+    Clock::time_point m_sent;
+    Clock::time_point m_first_byte;
+    Clock::time_point m_callback_started;
+};
+
+/**
+ * Calls CallbackStarted() on construction and Finish() on destruction, so
+ * that a response handler with several returns is traced whole. trace may
+ * be nullptr.
+ */
+class RequestTraceCallback
+{
+public:
+    explicit RequestTraceCallback(const std::shared_ptr<RequestTrace>& trace)
+        : m_trace(trace)
+    {
+        if (m_trace)
+            m_trace->CallbackStarted();
+    }
+
+    ~RequestTraceCallback()
+    {
+        if (m_trace)
+            m_trace->Finish();
+    }
+
+    RequestTraceCallback(const RequestTraceCallback&) = delete;
+    RequestTraceCallback& operator=(const RequestTraceCallback&) = delete;
+
+private:
+    std::shared_ptr<RequestTrace> m_trace;
+};
+
+/**
+ * Records a span of the calling thread from construction to destruction
+ * when tracing is on
+ */
+class TraceScope
+{
+public:
+    TraceScope(const char* name, const char* category, const Aws::String& key)
+        : m_name(name), m_category(category), m_key(key), m_start(TraceLog::Clock::now())
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (Trace().Enabled())
+            Trace().Span(m_name, m_category, TraceLog::ThreadId(), m_start,
+                TraceLog::Clock::now(), m_key);
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* const m_name;
+    const char* const m_category;
+    const Aws::String& m_key;
+    const TraceLog::Clock::time_point m_start;
+};
@@ -0,0 +1,107 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/core/client/ClientConfiguration.h>
+#include <aws/core/utils/threading/Executor.h>
+#include <aws/s3/S3Client.h>
+#include <cassert>
+#include <memory>
+#include <thread>
+
+/**
+ * Process-wide S3 client runtime
+ *
+ * Constructing an S3Client resolves the credential provider chain, starts
+ * the executor that runs *Async() operations and creates an empty HTTP
+ * connection pool. S3Runtime does that once, from one ClientConfiguration,
+ * and every operation in the process then shares the same client and its
+ * warm connections.
+ *
+ * Create exactly one S3Runtime after Aws::InitAPI(). It must be destroyed
+ * before Aws::ShutdownAPI() is called, so declare it inside the block
+ * between the two calls.
+ */
+class S3Runtime
+{
+public:
+    explicit S3Runtime(const Aws::Client::ClientConfiguration& config)
+        : m_config(config),
+          m_client(Aws::MakeShared<Aws::S3::S3Client>("S3Runtime", m_config))
+    {
+        assert(Current() == nullptr && "only one S3Runtime may exist at a time");
+        Current() = this;
+    }
+
+    ~S3Runtime()
+    {
+        Current() = nullptr;
+    }
+
+    S3Runtime(const S3Runtime&) = delete;
+    S3Runtime& operator=(const S3Runtime&) = delete;
+
+    /**
+     * The runtime created by main()
+     */
+    static S3Runtime& Instance()
+    {
+        assert(Current() != nullptr && "S3Runtime has not been created");
+        return *Current();
+    }
+
+    /**
+     * Configuration suitable for sharing one client between many concurrent
+     * operations
+     *
+     * max_connections bounds the HTTP connection pool; executor_threads
+     * sizes the pool that runs *Async() operations and their callbacks
+     * (0 selects the number of hardware threads).
+     */
+    static Aws::Client::ClientConfiguration DefaultConfiguration(
+        const Aws::String& region = "",
+        unsigned max_connections = 25,
+        size_t executor_threads = 0)
+    {
+        Aws::Client::ClientConfiguration config;
+        if (!region.empty())
+            config.region = region;
+        config.maxConnections = max_connections;
+        config.enableTcpKeepAlive = true;
+
+        if (executor_threads == 0)
+            executor_threads = std::thread::hardware_concurrency();
+        if (executor_threads == 0)
+            executor_threads = 4;
+        config.executor = Aws::MakeShared<Aws::Utils::Threading::PooledThreadExecutor>(
+            "S3Runtime", executor_threads);
+        return config;
+    }
+
+    const Aws::S3::S3Client& Client() const { return *m_client; }
+
+    const Aws::Client::ClientConfiguration& Configuration() const { return m_config; }
+
+private:
+    static S3Runtime*& Current()
+    {
+        static S3Runtime* current = nullptr;
+        return current;
+    }
+
+    Aws::Client::ClientConfiguration m_config;
+    std::shared_ptr<Aws::S3::S3Client> m_client;
+};
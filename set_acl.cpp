@@ -33,249 +33,742 @@
 #include <aws/s3/model/Grant.h>
 #include <aws/s3/model/Grantee.h>
 #include <aws/s3/model/Permission.h>
+#include <aws/s3/model/ListObjectsV2Request.h>
 //snippet-end:[s3.cpp.set_acl.inc]
+#include "acl_async.h"
+#include "acl_grants.h"
+#include "acl_journal.h"
+#include "acl_permissions.h"
+#include "acl_policy_store.h"
+#include "acl_verify.h"
+#include "command_line.h"
+#include "concurrency_controller.h"
+#include "in_flight_limiter.h"
+#include "latency_metrics.h"
+#include "local_s3.h"
+#include "prefix_rate_limiter.h"
+#include "request_hedger.h"
+#include "request_trace.h"
+#include "s3_runtime.h"
+#include "set_acl.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+Aws::S3::Model::Permission GetPermission(std::string_view access)
+{
+    return ToPermission(ParsePermission(access));
+}
 
-Aws::S3::Model::Permission GetPermission(Aws::String access)
+/**
+ * Whether permission names an S3 permission; reports it if not
+ *
+ * An unknown name maps to NOT_SET, which has no permission bits, so it
+ * must be turned away before any ACL is read or written.
+ */
+bool ValidPermission(std::string_view permission)
 {
-    if (access == "FULL_CONTROL")
-        return Aws::S3::Model::Permission::FULL_CONTROL;
-    if (access == "WRITE")
-        return Aws::S3::Model::Permission::WRITE;
-    if (access == "READ")
-        return Aws::S3::Model::Permission::READ;
-    if (access == "WRITE_ACP")
-        return Aws::S3::Model::Permission::WRITE_ACP;
-    if (access == "READ_ACP")
-        return Aws::S3::Model::Permission::READ_ACP;
-    return Aws::S3::Model::Permission::NOT_SET;
+    if (GetPermission(permission) != Aws::S3::Model::Permission::NOT_SET)
+        return true;
+    std::cout << "Unknown permission: " << permission << std::endl;
+    return false;
 }
 
-void SetAclForBucket(Aws::String bucket_name,
-    Aws::String grantee_id,
-    Aws::String permission)
+/**
+ * Grant permission on a bucket
+ *
+ * verifier decides whether the updated ACL is read back: under the All
+ * policy it is retrieved and printed before returning, under Sampled it is
+ * checked in the background and only a mismatch is reported.
+ *
+ * hedger (optional) hedges the GetBucketAcl; see SendHedged().
+ */
+AclApplyResult SetAclForBucket(const Aws::S3::S3Client& s3_client,
+    const Aws::String& bucket_name,
+    const Aws::String& grantee_id,
+    const Aws::String& permission,
+    AclVerifier& verifier,
+    RequestHedger* hedger)
 {
+    if (!ValidPermission(permission))
+        return AclApplyResult::Failed;
+
     // snippet-start:[s3.cpp.set_acl_bucket.code]
     // Set up the get request
-    Aws::S3::S3Client s3_client;
     Aws::S3::Model::GetBucketAclRequest get_request;
     get_request.SetBucket(bucket_name);
 
     // Get the current access control policy
-    auto get_outcome = s3_client.GetBucketAcl(get_request);
+    auto get_started = LatencyMetrics::Clock::now();
+    auto get_outcome = hedger ? GetBucketAclHedged(s3_client, *hedger, get_request)
+        : s3_client.GetBucketAcl(get_request);
+    Metrics().Record(S3Operation::GetBucketAcl, get_started, get_outcome);
     if (!get_outcome.IsSuccess())
     {
         auto error = get_outcome.GetError();
         std::cout << "Original GetBucketAcl error: " << error.GetExceptionName()
             << " - " << error.GetMessage() << std::endl;
-        return;
+        return FailedResult(error);
     }
 
-    // Reference the retrieved access control policy
-    auto result = get_outcome.GetResult();
-
-    // Copy the result to an access control policy object (cannot type cast)
-    Aws::S3::Model::AccessControlPolicy acp;
-    acp.SetOwner(result.GetOwner());
-
-    acp.SetGrants(result.GetGrants());        // creates const Vector<Grants>
-    // Make non-const copy of Vector<Grants> with hard-set grantee type
-    auto &acp_grants = result.GetGrants();
-    Aws::Vector<Aws::S3::Model::Grant> updated_grants;
-    for (auto acp_grant : result.GetGrants())
+    // Nothing to do if the grantee already holds the permission
+    auto& result = get_outcome.GetResult();
+    const Aws::S3::Model::Permission new_permission = GetPermission(permission);
+    if (HasGrant(result.GetGrants(), grantee_id, new_permission))
     {
-        std::shared_ptr<Aws::S3::Model::Grant> updated_grant = std::make_shared<Aws::S3::Model::Grant>();
-        std::shared_ptr<Aws::S3::Model::Grantee> updated_grantee = std::make_shared<Aws::S3::Model::Grantee>();
-
-        // Copy current grant permission
-        updated_grant->SetPermission(acp_grant.GetPermission());
-
-        // Copy grantee fields
-        //auto original_grantee = acp_grant.GetGrantee();
-        *updated_grantee = acp_grant.GetGrantee();
-
-        // Grantee Type is required
-        updated_grantee->SetType(Aws::S3::Model::Type::CanonicalUser);
-
-        // Save updated grantee to updated grant
-        updated_grant->SetGrantee(*updated_grantee);
-
-        // Add updated_grant to vector
-        updated_grants.push_back(*updated_grant);
+        std::cout << "Bucket ACL already grants " << permission << " to "
+            << grantee_id << std::endl;
+        return AclApplyResult::Skipped;
     }
 
-    // Add new grant
-    Aws::S3::Model::Grant new_grant;
-    Aws::S3::Model::Grantee new_grantee;
-    new_grantee.SetID(grantee_id);
-    new_grantee.SetType(Aws::S3::Model::Type::CanonicalUser);
-    new_grant.SetGrantee(new_grantee);
-    new_grant.SetPermission(GetPermission(permission));
-    updated_grants.push_back(new_grant);
-    // If we had not needed to recreate the Vector<Grants>, we could
-    // have just added new_grant to the vector
-    // acp.AddGrants(new_grant);
-
-    // Set the updated grants to the ACP
-    acp.SetGrants(updated_grants);
+    // Move the retrieved access control policy into a new one (cannot type
+    // cast) and add the new grant; no existing grant is copied
+    Aws::S3::Model::AccessControlPolicy acp = MakeUpdatedPolicy(result,
+        MakeGrant(grantee_id, new_permission));
 
     // Set up the put request
     Aws::S3::Model::PutBucketAclRequest put_request;
-    put_request.SetAccessControlPolicy(acp);
+    put_request.SetAccessControlPolicy(std::move(acp));
     put_request.SetBucket(bucket_name);
 
     // Set the new access control policy
+    auto set_started = LatencyMetrics::Clock::now();
     auto set_outcome = s3_client.PutBucketAcl(put_request);
     // snippet-end:[s3.cpp.set_acl_bucket.code]
+    Metrics().Record(S3Operation::PutBucketAcl, set_started, set_outcome);
     if (!set_outcome.IsSuccess())
     {
         auto error = set_outcome.GetError();
         std::cout << "PutBucketAcl error: " << error.GetExceptionName() 
             << " - " << error.GetMessage() << std::endl;
-        return;
+        return FailedResult(error);
+    }
+
+    if (!verifier.Policy().ShouldVerify())
+        return AclApplyResult::Applied;
+    if (verifier.Policy().GetMode() == AclVerifyPolicy::Mode::Sampled)
+    {
+        verifier.VerifyBucketAsync(s3_client, bucket_name, grantee_id,
+            new_permission);
+        return AclApplyResult::Applied;
     }
 
     // Verify the operation by retrieving the updated ACP
-    get_outcome = s3_client.GetBucketAcl(get_request);
-    if (!get_outcome.IsSuccess())
+    auto verify_started = LatencyMetrics::Clock::now();
+    auto verify_outcome = s3_client.GetBucketAcl(get_request);
+    Metrics().Record(S3Operation::GetBucketAcl, verify_started, verify_outcome);
+    if (!verify_outcome.IsSuccess())
     {
-        auto error = get_outcome.GetError();
+        auto error = verify_outcome.GetError();
         std::cout << "Updated GetBucketAcl error: " << error.GetExceptionName()
             << " - " << error.GetMessage() << std::endl;
-        return;
+        return FailedResult(error);
     }
-    result = get_outcome.GetResult();
 
     // Output some settings of the updated ACP
     std::cout << "Updated Bucket ACL:\n";
-    auto grants = result.GetGrants();
+    auto& grants = verify_outcome.GetResult().GetGrants();
     for (auto & grant : grants) {
-        auto grantee = grant.GetGrantee();
+        auto& grantee = grant.GetGrantee();
         std::cout << "  Grantee Display Name: " 
             << grantee.GetDisplayName() << std::endl;
 
-        std::cout << "  Permission: ";
-        auto perm = grant.GetPermission();
-        switch (perm)
-        {
-        case Aws::S3::Model::Permission::NOT_SET:
-            std::cout << "NOT_SET\n";
-            break;
-        case Aws::S3::Model::Permission::FULL_CONTROL:
-            std::cout << "FULL_CONTROL\n";
-            break;
-        case Aws::S3::Model::Permission::WRITE:
-            std::cout << "WRITE\n";
-            break;
-        case Aws::S3::Model::Permission::WRITE_ACP:
-            std::cout << "WRITE_ACP\n";
-            break;
-        case Aws::S3::Model::Permission::READ:
-            std::cout << "READ\n";
-            break;
-        case Aws::S3::Model::Permission::READ_ACP:
-            std::cout << "READ_ACP\n";
-            break;
-        default:
-            std::cout << "UNKNOWN VALUE\n";
-            break;
-        }
+        std::cout << "  Permission: "
+            << PermissionName(grant.GetPermission()) << "\n";
     }
+    return AclApplyResult::Applied;
 }
 
-void SetAclForObject(Aws::String bucket_name, 
-    Aws::String object_name,
-    Aws::String grantee_id, 
-    Aws::String permission)
+void SetAclForBucket(Aws::String bucket_name,
+    Aws::String grantee_id,
+    Aws::String permission,
+    AclVerifyPolicy verify_policy = AclVerifyPolicy::All())
+{
+    AclVerifier verifier(verify_policy);
+    SetAclForBucket(S3Runtime::Instance().Client(), bucket_name, grantee_id,
+        permission, verifier);
+    verifier.WaitIdle();
+    if (verify_policy.GetMode() == AclVerifyPolicy::Mode::Sampled)
+        verifier.Report(std::cout);
+}
+
+/**
+ * Grant permission on an object
+ *
+ * rate_limiter (optional) paces the GET and the PUT to the limits of the
+ * object's key prefix. hedger (optional) hedges the GetObjectAcl; see
+ * SendHedged(). With tracing on, the cycle and both requests are traced
+ * (see RequestTrace); here the "callback" span is the code that handles
+ * the response after the call returns.
+ */
+AclApplyResult SetAclForObject(const Aws::S3::S3Client& s3_client,
+    const Aws::String& bucket_name,
+    const Aws::String& object_name,
+    const Aws::String& grantee_id,
+    const Aws::String& permission,
+    PrefixRateLimiter* rate_limiter,
+    RequestHedger* hedger)
 {
+    if (!ValidPermission(permission))
+        return AclApplyResult::Failed;
+    TraceScope trace_scope("SetAclForObject", "acl", object_name);
+
     // snippet-start:[s3.cpp.set_acl_object.code]
     // Set up the get request
-    Aws::S3::S3Client s3_client;
     Aws::S3::Model::GetObjectAclRequest get_request;
     get_request.SetBucket(bucket_name);
     get_request.SetKey(object_name);
+    auto get_trace = RequestTrace::Start(hedger ? "GetObjectAclHedged" : "GetObjectAcl",
+        object_name);
+    if (!hedger)
+        RequestTrace::Attach(get_trace, get_request);
 
     // Get the current access control policy
-    auto get_outcome = s3_client.GetObjectAcl(get_request);
+    if (rate_limiter)
+        rate_limiter->Acquire(object_name, 1, 0);
+    auto get_started = LatencyMetrics::Clock::now();
+    auto get_outcome = hedger ? GetObjectAclHedged(s3_client, *hedger, get_request)
+        : s3_client.GetObjectAcl(get_request);
+    Metrics().Record(S3Operation::GetObjectAcl, get_started, get_outcome);
+    std::optional<RequestTraceCallback> get_callback;
+    get_callback.emplace(get_trace);
     if (!get_outcome.IsSuccess())
     {
         auto error = get_outcome.GetError();
-        std::cout << "Original GetObjectAcl error: " << error.GetExceptionName()
-            << " - " << error.GetMessage() << std::endl;
-        return;
+        std::cout << "Original GetObjectAcl error: " << object_name << ": "
+            << error.GetExceptionName() << " - " << error.GetMessage() << std::endl;
+        return FailedResult(error);
     }
 
-    // Reference the retrieved access control policy
-    auto result = get_outcome.GetResult();
-
-    // Copy the result to an access control policy object (cannot type cast)
-    Aws::S3::Model::AccessControlPolicy acp;
-    acp.SetOwner(result.GetOwner());
-
-    //acp.SetGrants(result.GetGrants());        // creates const Vector<Grants>
-     // Make non-const copy of Vector<Grants> with hard-set grantee type
-    auto &acp_grants = result.GetGrants();
-    Aws::Vector<Aws::S3::Model::Grant> updated_grants;
-    for (auto acp_grant : result.GetGrants())
-    {
-        std::shared_ptr<Aws::S3::Model::Grant> updated_grant = std::make_shared<Aws::S3::Model::Grant>();
-        std::shared_ptr<Aws::S3::Model::Grantee> updated_grantee = std::make_shared<Aws::S3::Model::Grantee>();
-
-        // Copy current grant permission
-        updated_grant->SetPermission(acp_grant.GetPermission());
-
-        // Copy grantee fields
-        //auto original_grantee = acp_grant.GetGrantee();
-        *updated_grantee = acp_grant.GetGrantee();
-
-        // Grantee Type is required
-        updated_grantee->SetType(Aws::S3::Model::Type::CanonicalUser);
-
-        // Save updated grantee to updated grant
-        updated_grant->SetGrantee(*updated_grantee);
-
-        // Add updated_grant to vector
-        updated_grants.push_back(*updated_grant);
-}
+    // Nothing to do if the grantee already holds the permission
+    auto& result = get_outcome.GetResult();
+    const Aws::S3::Model::Permission new_permission = GetPermission(permission);
+    if (HasGrant(result.GetGrants(), grantee_id, new_permission))
+        return AclApplyResult::Skipped;
 
-    // Add new grant
-    Aws::S3::Model::Grant new_grant;
-    Aws::S3::Model::Grantee new_grantee;
-    new_grantee.SetID(grantee_id);
-    new_grantee.SetType(Aws::S3::Model::Type::CanonicalUser);
-    new_grant.SetGrantee(new_grantee);
-    new_grant.SetPermission(GetPermission(permission));
-    updated_grants.push_back(new_grant);
-    // If we had not needed to recreate the Vector<Grants>, we could
-    // have just added new_grant to the vector
-    // acp.AddGrants(new_grant);
-
-    // Set the updated grants to the ACP
-    acp.SetGrants(updated_grants);
+    // Move the retrieved access control policy into a new one (cannot type
+    // cast) and add the new grant; no existing grant is copied
+    Aws::S3::Model::AccessControlPolicy acp = MakeUpdatedPolicy(result,
+        MakeGrant(grantee_id, new_permission));
 
     // Set up the put request
     Aws::S3::Model::PutObjectAclRequest put_request;
-    put_request.SetAccessControlPolicy(acp);
+    put_request.SetAccessControlPolicy(std::move(acp));
     put_request.SetBucket(bucket_name);
     put_request.SetKey(object_name);
+    auto put_trace = RequestTrace::Start("PutObjectAcl", object_name);
+    RequestTrace::Attach(put_trace, put_request);
+    get_callback.reset();
 
     // Set the new access control policy
+    if (rate_limiter)
+        rate_limiter->Acquire(object_name, 0, 1);
+    auto set_started = LatencyMetrics::Clock::now();
     auto set_outcome = s3_client.PutObjectAcl(put_request);
     // snippet-end:[s3.cpp.set_acl_object.code]
+    Metrics().Record(S3Operation::PutObjectAcl, set_started, set_outcome);
+    RequestTraceCallback put_callback(put_trace);
     if (!set_outcome.IsSuccess())
     {
         auto error = set_outcome.GetError();
-        std::cout << "PutObjectAcl error: " << error.GetExceptionName()
-            << " - " << error.GetMessage() << std::endl;
+        std::cout << "PutObjectAcl error: " << object_name << ": "
+            << error.GetExceptionName() << " - " << error.GetMessage() << std::endl;
+        return FailedResult(error);
+    }
+    return AclApplyResult::Applied;
+}
+
+void SetAclForObject(Aws::String bucket_name, 
+    Aws::String object_name,
+    Aws::String grantee_id, 
+    Aws::String permission)
+{
+    if (SetAclForObject(S3Runtime::Instance().Client(), bucket_name,
+        object_name, grantee_id, permission) == AclApplyResult::Skipped)
+        std::cout << "Object ACL already grants " << permission << " to "
+            << grantee_id << std::endl;
+}
+
+/**
+ * Page through the objects under a key prefix with ListObjectsV2
+ *
+ * on_page is called on the calling thread for each page of up to 1000
+ * objects. With fetch_owner, each object carries its owner. A non-empty
+ * start_token continues an earlier listing from that continuation token.
+ * Returns false if a listing request failed.
+ */
+bool ListPrefix(const Aws::S3::S3Client& s3_client,
+    const Aws::String& bucket_name,
+    const Aws::String& prefix,
+    const std::function<void(const Aws::S3::Model::ListObjectsV2Result&)>& on_page,
+    bool fetch_owner = false,
+    const Aws::String& start_token = "")
+{
+    Aws::S3::Model::ListObjectsV2Request list_request;
+    list_request.SetBucket(bucket_name);
+    list_request.SetPrefix(prefix);
+    if (fetch_owner)
+        list_request.SetFetchOwner(true);
+    if (!start_token.empty())
+        list_request.SetContinuationToken(start_token);
+
+    for (;;)
+    {
+        auto list_outcome = s3_client.ListObjectsV2(list_request);
+        if (!list_outcome.IsSuccess())
+        {
+            auto error = list_outcome.GetError();
+            std::cout << "ListObjectsV2 error: " << error.GetExceptionName()
+                << " - " << error.GetMessage() << std::endl;
+            return false;
+        }
+
+        auto& list_result = list_outcome.GetResult();
+        on_page(list_result);
+
+        if (!list_result.GetIsTruncated())
+            return true;
+        list_request.SetContinuationToken(list_result.GetNextContinuationToken());
+    }
+}
+
+/**
+ * Options of SetAclForPrefix()
+ */
+struct BulkAclOptions
+{
+    // Most object updates in flight at once. The actual number adapts to
+    // throttling and latency; see ConcurrencyController.
+    size_t max_concurrency = 64;
+
+    // Decides which updates are read back (optional); see
+    // SetAclForObjectAsync()
+    AclVerifier* verifier = nullptr;
+
+    // The objects are known to have the default ACL, so each update is a
+    // single header-only PutObjectAcl (SetAclForObjectHeadersAsync())
+    // instead of a get-modify-put cycle
+    bool assume_default_acl = false;
+
+    // Paces updates to the request limits of each key prefix and
+    // interleaves them across prefixes (optional)
+    PrefixRateLimiter* rate_limiter = nullptr;
+
+    // Hedges the GetObjectAcl of each get-modify-put cycle (optional); see
+    // SendHedged()
+    RequestHedger* hedger = nullptr;
+
+    // Checkpoint/resume journal (optional); see AclJournal. A job that is
+    // interrupted and restarted with the same journal continues where the
+    // journal left off.
+    std::string journal_path;
+};
+
+/**
+ * An object waiting to be updated by SetAclForPrefix()
+ */
+struct PendingObject
+{
+    Aws::String key;
+    Aws::String owner_id;
+    std::uint64_t page = 0;     // Listing page the key came from
+    bool retry = false;         // A key that failed in a previous run
+};
+
+/**
+ * Set the access control list of every object under a key prefix
+ *
+ * The calling thread pages through the keys with ListObjectsV2 and starts
+ * an asynchronous get-modify-put cycle (SetAclForObjectAsync()) for each.
+ * A ConcurrencyController keeps the number in flight at what S3 sustains
+ * without throttling, up to max_concurrency. The listing never runs more
+ * than that many keys ahead of the updates, so memory stays bounded no
+ * matter how many objects are under the prefix.
+ *
+ * With a rate_limiter, keys are queued per prefix and dispatched
+ * round-robin from the prefixes that are under their limits; the listing
+ * then runs up to a few pages ahead to find keys on other prefixes.
+ *
+ * With a journal_path, each finished key is recorded in an AclJournal, and
+ * once every key of a listing page has finished, so is the continuation
+ * token of the next page. A failed key is recorded too and still lets its
+ * page close, so checkpoints keep advancing. A restarted job first retries
+ * the failed keys its listing will not meet again, then lists from the last
+ * checkpoint and skips the keys recorded as finished on its pages.
+ *
+ * The client should allow at least max_concurrency connections
+ * (ClientConfiguration::maxConnections) and executor threads, because the
+ * SDK runs each request of an *Async() call on an executor thread.
+ */
+void SetAclForPrefix(const Aws::S3::S3Client& s3_client,
+    const Aws::String& bucket_name,
+    const Aws::String& prefix,
+    const Aws::String& grantee_id,
+    const Aws::String& permission,
+    const BulkAclOptions& bulk_options)
+{
+    if (!ValidPermission(permission))
         return;
+    const Aws::S3::Model::Permission new_permission = GetPermission(permission);
+    AclVerifier* verifier = bulk_options.verifier;
+    ConcurrencyController::Settings controller_settings;
+    controller_settings.max_window = bulk_options.max_concurrency;
+    controller_settings.initial_window =
+        std::min(controller_settings.initial_window, bulk_options.max_concurrency);
+    ConcurrencyController in_flight(controller_settings);
+    AclApplyCounts counts;
+
+    // The bucket owner enables the bucket-owner-* canned ACLs in header mode
+    Aws::String bucket_owner_id;
+    if (bulk_options.assume_default_acl)
+    {
+        Aws::S3::Model::GetBucketAclRequest owner_request;
+        owner_request.SetBucket(bucket_name);
+        auto owner_started = LatencyMetrics::Clock::now();
+        auto owner_outcome = s3_client.GetBucketAcl(owner_request);
+        Metrics().Record(S3Operation::GetBucketAcl, owner_started, owner_outcome);
+        if (owner_outcome.IsSuccess())
+            bucket_owner_id = owner_outcome.GetResult().GetOwner().GetID();
+    }
+
+    // The journal is tied to the job it was started for
+    AclJournal journal;
+    const bool journaled = !bulk_options.journal_path.empty();
+    if (journaled)
+    {
+        const Aws::String job_id = bucket_name + "/" + prefix + " " + grantee_id +
+            " " + permission + (bulk_options.assume_default_acl ? " headers" : "");
+        if (!journal.Open(bulk_options.journal_path, job_id))
+            return;
+        if (journal.JobFinished())
+        {
+            std::cout << "Journal " << bulk_options.journal_path
+                << ": job already finished" << std::endl;
+            return;
+        }
+        if (journal.Resuming())
+            std::cout << "Resuming from journal " << bulk_options.journal_path
+                << (journal.JobListed() ? " after listing" :
+                    journal.ResumeToken().empty() ? " at the first page" : " at a checkpoint")
+                << ", " << journal.ResumedCompletedCount()
+                << " keys already finished past it, "
+                << journal.FailedKeys().size() << " failed keys to retry" << std::endl;
+    }
+
+    // Listing pages whose keys have not all finished, oldest first. A page
+    // closes when all its keys have finished or failed; then the token that
+    // lists the page after it is a checkpoint.
+    struct OpenPage
+    {
+        Aws::String next_token;     // Empty for the last page
+        size_t unfinished;
+    };
+    std::mutex page_mutex;
+    std::deque<OpenPage> open_pages;
+    std::uint64_t first_open_page = journal.ResumePage();
+
+    // Close the finished pages at the front and record the newest
+    // checkpoint reached; page_mutex must be held
+    auto close_pages = [&]()
+    {
+        bool closed = false;
+        Aws::String checkpoint;
+        while (!open_pages.empty() && open_pages.front().unfinished == 0)
+        {
+            checkpoint = std::move(open_pages.front().next_token);
+            open_pages.pop_front();
+            ++first_open_page;
+            closed = true;
+        }
+        if (closed && !checkpoint.empty())
+            journal.RecordCheckpoint(checkpoint, first_open_page);
+    };
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Start the update of one object
+    auto dispatch = [&](const PendingObject& object)
+    {
+        auto ticket = in_flight.Acquire();
+        auto on_finished = [&, ticket, page = object.page, retry = object.retry](
+            const Aws::String& key, AclApplyResult result)
+        {
+            counts.Add(result);
+            if (journaled)
+            {
+                if (result == AclApplyResult::Applied || result == AclApplyResult::Skipped)
+                    journal.RecordCompleted(key, page);
+                else
+                    journal.RecordFailed(key, page);
+
+                // A retried key belongs to a page closed in a previous run
+                if (!retry)
+                {
+                    std::lock_guard<std::mutex> lock(page_mutex);
+                    --open_pages[page - first_open_page].unfinished;
+                    close_pages();
+                }
+            }
+            in_flight.Release(ticket,
+                result == AclApplyResult::Throttled ? ConcurrencyController::Signal::Throttled :
+                result == AclApplyResult::Failed ? ConcurrencyController::Signal::Error :
+                ConcurrencyController::Signal::Success);
+        };
+
+        if (bulk_options.assume_default_acl)
+            SetAclForObjectHeadersAsync(s3_client, bucket_name, object.key,
+                object.owner_id, bucket_owner_id, grantee_id, new_permission,
+                verifier, on_finished, bulk_options.hedger);
+        else
+            SetAclForObjectAsync(s3_client, bucket_name, object.key,
+                grantee_id, new_permission, verifier, on_finished,
+                bulk_options.hedger);
+    };
+
+    // Header mode sends only the PUT; otherwise each update is a GET + PUT
+    const size_t interleave_lookahead = 4 * 1000;
+    std::unique_ptr<PrefixInterleaver<PendingObject>> interleaver;
+    if (bulk_options.rate_limiter)
+        interleaver.reset(new PrefixInterleaver<PendingObject>(
+            *bulk_options.rate_limiter, bulk_options.assume_default_acl ? 0 : 1, 1));
+
+    // Retry the keys that failed in a previous run. Their owners are not
+    // known, so header mode falls back to a get-modify-put cycle for them.
+    size_t listed_count = 0;
+    if (journaled)
+    {
+        for (auto& failed : journal.FailedKeys())
+        {
+            ++listed_count;
+            PendingObject pending{ failed.key, Aws::String(), failed.page, true };
+            if (interleaver)
+                interleaver->Push(pending.key, std::move(pending));
+            else
+                dispatch(pending);
+        }
     }
+
+    // List the keys a page at a time and start an update for each
+    size_t resumed_count = 0;
+    std::uint64_t page_count = journal.ResumePage();
+    auto last_report = start_time;
+    const bool listed = journal.JobListed() || ListPrefix(s3_client, bucket_name, prefix,
+        [&](const Aws::S3::Model::ListObjectsV2Result& page)
+    {
+        // Open the page with its count of keys before any of them can finish
+        Aws::Vector<PendingObject> page_objects;
+        page_objects.reserve(page.GetContents().size());
+        for (auto& object : page.GetContents())
+        {
+            ++listed_count;
+            if (journaled && journal.IsCompleted(object.GetKey()))
+            {
+                ++resumed_count;
+                continue;
+            }
+            page_objects.push_back(PendingObject{ object.GetKey(),
+                object.GetOwner().GetID(), page_count, false });
+        }
+        if (journaled)
+        {
+            std::lock_guard<std::mutex> lock(page_mutex);
+            open_pages.push_back(OpenPage{ page.GetIsTruncated() ?
+                page.GetNextContinuationToken() : Aws::String(),
+                page_objects.size() });
+            close_pages();
+        }
+        ++page_count;
+
+        for (auto& pending : page_objects)
+        {
+            if (interleaver)
+                interleaver->Push(pending.key, std::move(pending));
+            else
+                dispatch(pending);
+        }
+
+        if (interleaver)
+        {
+            PendingObject next;
+            while (interleaver->Size() > interleave_lookahead && interleaver->Pop(next))
+                dispatch(next);
+        }
+
+        // Report progress now and then
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_report >= std::chrono::seconds(10))
+        {
+            std::chrono::duration<double> elapsed = now - start_time;
+            size_t done = counts.Total();
+            std::cout << "Listed " << listed_count << ", finished " << done
+                << " (" << static_cast<size_t>(done / elapsed.count())
+                << " objects/sec, window " << in_flight.Window() << ")"
+                << std::endl;
+            last_report = now;
+        }
+    }, bulk_options.assume_default_acl, journal.ResumeToken());
+
+    if (interleaver)
+    {
+        PendingObject next;
+        while (interleaver->Pop(next))
+            dispatch(next);
+    }
+
+    // Wait for the updates and background verifications still in flight
+    in_flight.WaitIdle();
+    if (verifier)
+        verifier->WaitIdle();
+
+    // Every page closed and no key failed: nothing is left for a rerun.
+    // With failed keys left, a rerun retries only those.
+    if (journaled)
+    {
+        std::lock_guard<std::mutex> lock(page_mutex);
+        if (!listed || !open_pages.empty())
+            journal.Flush();
+        else if (counts.failed == 0 && counts.throttled == 0)
+            journal.RecordFinished();
+        else if (!journal.JobListed())
+            journal.RecordListed();
+        else
+            journal.Flush();
+    }
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_time;
+    std::cout << "Processed " << counts.Total() << " of " << listed_count
+        << " objects under \"" << prefix << "\": " << counts.applied
+        << " applied, " << counts.skipped << " skipped (already granted), "
+        << resumed_count << " finished before resuming, " << counts.failed
+        << " failed, " << counts.throttled << " throttled in "
+        << elapsed.count() << " s: "
+        << (elapsed.count() > 0 ? counts.Total() / elapsed.count() : 0)
+        << " objects/sec, final window " << in_flight.Window() << " ("
+        << in_flight.ThrottleCount() << " throttles)" << std::endl;
+    if (bulk_options.hedger)
+        std::cout << "Hedged " << bulk_options.hedger->HedgeCount() << " of "
+            << bulk_options.hedger->ReadCount() << " GetObjectAcl requests ("
+            << bulk_options.hedger->HedgeWinCount() << " answered first)" << std::endl;
+    if (verifier && verifier->Policy().GetMode() != AclVerifyPolicy::Mode::None)
+        verifier->Report(std::cout);
 }
 
+/**
+ * Report the distinct access control lists of the objects under a prefix
+ *
+ * Every object ACL is read with GetObjectAclAsync and interned in an
+ * AclPolicyStore, so the audit holds one AclPolicyId per object no matter
+ * how many objects there are. The report lists each distinct ACL with its
+ * object count and flags the ones that do not give grantee_id permission.
+ */
+void AuditAclForPrefix(const Aws::S3::S3Client& s3_client,
+    const Aws::String& bucket_name,
+    const Aws::String& prefix,
+    const Aws::String& grantee_id,
+    const Aws::String& permission,
+    size_t max_concurrency)
+{
+    if (!ValidPermission(permission))
+        return;
+    AclPolicyStore store;
+    InFlightLimiter in_flight(max_concurrency);
+    std::mutex audit_mutex;
+    Aws::Vector<size_t> objects_per_policy;
+    size_t failed_count = 0;
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    size_t listed_count = 0;
+    ListPrefix(s3_client, bucket_name, prefix,
+        [&](const Aws::S3::Model::ListObjectsV2Result& page)
+    {
+        for (auto& object : page.GetContents())
+        {
+            Aws::S3::Model::GetObjectAclRequest get_request;
+            get_request.SetBucket(bucket_name);
+            get_request.SetKey(object.GetKey());
+
+            in_flight.Acquire();
+            s3_client.GetObjectAclAsync(get_request,
+                [&, started = LatencyMetrics::Clock::now()](const Aws::S3::S3Client*,
+                    const Aws::S3::Model::GetObjectAclRequest& request,
+                    const Aws::S3::Model::GetObjectAclOutcome& get_outcome,
+                    const std::shared_ptr<const Aws::Client::AsyncCallerContext>&)
+            {
+                Metrics().Record(S3Operation::GetObjectAcl, started, get_outcome);
+                if (get_outcome.IsSuccess())
+                {
+                    AclPolicyId policy = store.Intern(get_outcome.GetResult());
+                    std::lock_guard<std::mutex> lock(audit_mutex);
+                    if (objects_per_policy.size() <= policy)
+                        objects_per_policy.resize(policy + 1);
+                    ++objects_per_policy[policy];
+                }
+                else
+                {
+                    auto& error = get_outcome.GetError();
+                    std::cout << "GetObjectAcl error: " << request.GetKey() << ": "
+                        << error.GetExceptionName() << " - "
+                        << error.GetMessage() << std::endl;
+                    std::lock_guard<std::mutex> lock(audit_mutex);
+                    ++failed_count;
+                }
+                in_flight.Release();
+            });
+            ++listed_count;
+        }
+    });
+    in_flight.WaitIdle();
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_time;
+    std::cout << "Audited " << listed_count << " objects under \"" << prefix
+        << "\" (" << failed_count << " failed) in " << elapsed.count() << " s: "
+        << store.PolicyCount() << " distinct ACLs, " << store.GranteeCount()
+        << " distinct grantees\n";
+
+    const PermissionMask wanted = ParsePermission(permission);
+    GranteeRef grantee = 0;
+    const bool grantee_known = store.FindGrantee(grantee_id, grantee);
+    for (AclPolicyId policy = 0; policy < objects_per_policy.size(); ++policy)
+    {
+        const bool granted = grantee_known &&
+            CoversPermissions(store.Permissions(policy, grantee), wanted);
+        std::cout << "ACL " << policy << ": " << objects_per_policy[policy]
+            << " objects, owner " << store.GranteeName(store.PolicyOwner(policy))
+            << (granted ? "" : ", MISSING grant") << "\n";
+        for (const auto& grant : store.Grants(policy))
+        {
+            std::cout << "  " << store.GranteeName(grant.grantee) << ":";
+            for (const auto& info : PERMISSION_TABLE)
+            {
+                if (grant.permissions & info.mask)
+                    std::cout << " " << info.name;
+            }
+            std::cout << "\n";
+        }
+    }
+    std::cout << std::flush;
+}
+
+#ifndef S3_SAMPLE_NO_MAIN
 /**
  * Exercise SetAclForBucket() and SetAclForObject()
  */
 int main(int argc, char** argv)
 {
     Aws::SDKOptions options;
+    // S3_LOCAL=... runs against the in-memory stand-in (see local_s3.h)
+    InstallLocalS3FromEnvironment(options);
     Aws::InitAPI(options);
     {
         // Assign these values before compiling the program
@@ -284,10 +777,103 @@ int main(int argc, char** argv)
         const Aws::String grantee_id = "AWS_USER_ID";
         const Aws::String permission = "READ";
 
+        // Bulk mode: --prefix=<key prefix> updates every object under the
+        // prefix instead of object_name, --concurrency=<n> objects at a time
+        const char* prefix = GetOption(argc, argv, "--prefix");
+        const char* concurrency = GetOption(argc, argv, "--concurrency");
+
+        // --audit with --prefix reports the distinct ACLs under the prefix
+        // instead of changing them
+        const bool audit = HasFlag(argc, argv, "--audit");
+
+        // --prefix-depth=<n> rate-limits requests per key prefix of n
+        // '/'-separated components, --prefix-rate=<n> writes/sec each
+        const char* prefix_depth = GetOption(argc, argv, "--prefix-depth");
+        const char* prefix_rate = GetOption(argc, argv, "--prefix-rate");
+        std::unique_ptr<PrefixRateLimiter> rate_limiter;
+        if (prefix_depth)
+        {
+            PrefixRateLimiter::Settings limiter_settings;
+            if (!PrefixRateLimiter::Settings::Parse(prefix_depth, prefix_rate, limiter_settings))
+                std::cout << "Invalid --prefix-rate value: " << prefix_rate
+                    << " (using the S3 default)" << std::endl;
+            rate_limiter.reset(new PrefixRateLimiter(limiter_settings));
+        }
+
+        // --verify=none|all|<percent> reads back all, none or a sample of
+        // the updated ACLs
+        const char* verify = GetOption(argc, argv, "--verify");
+        AclVerifyPolicy verify_policy = AclVerifyPolicy::None();
+        if (verify && !AclVerifyPolicy::Parse(verify, verify_policy))
+        {
+            std::cout << "Invalid --verify value: " << verify << std::endl;
+            verify_policy = AclVerifyPolicy::None();
+        }
+        AclVerifier verifier(verify_policy);
+
+        // --assume-default-acl: the objects under the prefix have the
+        // default ACL, so each is updated with one header-only PUT. The PUT
+        // replaces the whole ACL with the owner's FULL_CONTROL plus the new
+        // grant, without reading it first: any other grant an object has is
+        // deleted. Use it only on objects known to have the default ACL.
+        BulkAclOptions bulk_options;
+        bulk_options.verifier = &verifier;
+        bulk_options.assume_default_acl = HasFlag(argc, argv, "--assume-default-acl");
+        bulk_options.rate_limiter = rate_limiter.get();
+
+        // --hedge[=<percent>] hedges slow GetObjectAcl requests, sending at
+        // most percent (default 5) more requests
+        std::unique_ptr<RequestHedger> hedger;
+        const char* hedge_budget = GetOption(argc, argv, "--hedge");
+        if (hedge_budget || HasFlag(argc, argv, "--hedge"))
+        {
+            RequestHedger::Settings hedger_settings;
+            if (hedge_budget)
+                hedger_settings.budget = std::strtod(hedge_budget, nullptr) / 100;
+            hedger.reset(new RequestHedger(hedger_settings));
+            bulk_options.hedger = hedger.get();
+        }
+
+        // --journal=<path> checkpoints the job so that a rerun resumes it
+        if (const char* journal_path = GetOption(argc, argv, "--journal"))
+            bulk_options.journal_path = journal_path;
+
+        size_t max_concurrency = concurrency ? std::strtoul(concurrency, nullptr, 10) : 64;
+        if (max_concurrency == 0)
+            max_concurrency = 1;
+        bulk_options.max_concurrency = max_concurrency;
+
+        // --metrics=<path> writes the latency histograms to path every 10 s
+        std::unique_ptr<MetricsFileWriter> metrics_writer;
+        if (const char* metrics_path = GetOption(argc, argv, "--metrics"))
+            metrics_writer.reset(new MetricsFileWriter(metrics_path));
+
+        // --trace=<path> writes a Chrome trace of the requests to path
+        const char* trace_path = GetOption(argc, argv, "--trace");
+        if (trace_path && !Trace().Open(trace_path))
+            std::cout << "Continuing without a trace" << std::endl;
+
+        // Build the shared client once, with a connection and an executor
+        // thread for each update in flight
+        auto config = S3Runtime::DefaultConfiguration("",
+            static_cast<unsigned>(max_concurrency), max_concurrency);
+        TracingExecutor::Install(config);
+        S3Runtime runtime(config);
+
         // Set the access control lists for a bucket and an object
         //SetAclForBucket(bucket_name, grantee_id, permission);
-        SetAclForObject(bucket_name, object_name, grantee_id, permission);
+        if (prefix && audit)
+            AuditAclForPrefix(runtime.Client(), bucket_name, prefix, grantee_id,
+                permission, max_concurrency);
+        else if (prefix)
+            SetAclForPrefix(runtime.Client(), bucket_name, prefix, grantee_id,
+                permission, bulk_options);
+        else
+            SetAclForObject(bucket_name, object_name, grantee_id, permission);
+
+        Metrics().Report(std::cout);
+        Trace().Close();
     }
     Aws::ShutdownAPI(options);
 }
-
+#endif
@@ -0,0 +1,40 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <aws/s3/S3Client.h>
+#include "acl_grants.h"
+#include "acl_verify.h"
+#include "prefix_rate_limiter.h"
+#include "request_hedger.h"
+
+// The ACL operations of set_acl.cpp, for programs that link it without its
+// main() (built with S3_SAMPLE_NO_MAIN; see bench_s3_throughput.cpp)
+
+AclApplyResult SetAclForBucket(const Aws::S3::S3Client& s3_client,
+    const Aws::String& bucket_name,
+    const Aws::String& grantee_id,
+    const Aws::String& permission,
+    AclVerifier& verifier,
+    RequestHedger* hedger = nullptr);
+
+AclApplyResult SetAclForObject(const Aws::S3::S3Client& s3_client,
+    const Aws::String& bucket_name,
+    const Aws::String& object_name,
+    const Aws::String& grantee_id,
+    const Aws::String& permission,
+    PrefixRateLimiter* rate_limiter = nullptr,
+    RequestHedger* hedger = nullptr);
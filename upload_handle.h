@@ -0,0 +1,203 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <aws/core/Aws.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * Completion of one upload
+ *
+ * put_s3_object_async() returns one per call and completes it exactly once,
+ * after the upload's other bookkeeping. The state is set under the
+ * handle's own lock before anyone is woken, so a completion that comes
+ * before Wait() is never lost, and handles of different uploads share no
+ * lock. Copies refer to the same upload.
+ */
+class UploadHandle
+{
+public:
+    // An empty handle, not tied to an upload
+    UploadHandle() = default;
+
+    static UploadHandle Create(const Aws::String& object_name)
+    {
+        UploadHandle handle;
+        handle.m_state = std::make_shared<State>();
+        handle.m_state->object_name = object_name;
+        return handle;
+    }
+
+    bool Valid() const { return m_state != nullptr; }
+
+    const Aws::String& ObjectName() const { return m_state->object_name; }
+
+    bool Done() const { return m_state->done.load(std::memory_order_acquire); }
+
+    /**
+     * Whether the upload succeeded; false until it is Done()
+     */
+    bool Succeeded() const { return Done() && m_state->success; }
+
+    /**
+     * Wait for the upload and return whether it succeeded
+     */
+    bool Wait() const
+    {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        m_state->finished.wait(lock, [this]() { return Done(); });
+        return m_state->success;
+    }
+
+    /**
+     * Wait at most timeout; returns Done()
+     */
+    template <typename Rep, typename Period>
+    bool WaitFor(const std::chrono::duration<Rep, Period>& timeout) const
+    {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        return m_state->finished.wait_for(lock, timeout, [this]() { return Done(); });
+    }
+
+    /**
+     * Record the outcome and wake every waiter; only the first call counts
+     */
+    void Complete(bool success) const
+    {
+        std::vector<std::shared_ptr<AnyWaiter>> any_waiters;
+        {
+            std::lock_guard<std::mutex> lock(m_state->mutex);
+            if (Done())
+                return;
+            m_state->success = success;
+            m_state->done.store(true, std::memory_order_release);
+            any_waiters.swap(m_state->any_waiters);
+        }
+        m_state->finished.notify_all();
+        for (auto& waiter : any_waiters)
+            waiter->Notify();
+    }
+
+private:
+    // Woken by the first of several handles to complete (see wait_any())
+    struct AnyWaiter
+    {
+        std::mutex mutex;
+        std::condition_variable fired;
+        bool done = false;
+
+        void Notify()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+            }
+            fired.notify_one();
+        }
+    };
+
+    struct State
+    {
+        Aws::String object_name;
+        std::atomic<bool> done{ false };
+        bool success = false;
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::vector<std::shared_ptr<AnyWaiter>> any_waiters;
+    };
+
+    // Register waiter unless the upload is done; returns Done()
+    bool AddAnyWaiter(const std::shared_ptr<AnyWaiter>& waiter) const
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if (Done())
+            return true;
+        m_state->any_waiters.push_back(waiter);
+        return false;
+    }
+
+    void RemoveAnyWaiter(const std::shared_ptr<AnyWaiter>& waiter) const
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        auto& waiters = m_state->any_waiters;
+        waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter), waiters.end());
+    }
+
+    friend size_t wait_any(const std::vector<UploadHandle>& handles);
+
+    std::shared_ptr<State> m_state;
+};
+
+/**
+ * Wait for every upload; returns how many succeeded
+ */
+inline size_t wait_all(const std::vector<UploadHandle>& handles)
+{
+    size_t succeeded = 0;
+    for (const UploadHandle& handle : handles)
+        if (handle.Valid() && handle.Wait())
+            ++succeeded;
+    return succeeded;
+}
+
+/**
+ * Wait until one of the uploads is done and return its index (the lowest
+ * if several are), or handles.size() if there is no valid handle
+ *
+ * Done handles are returned again, so to wait for each upload in turn,
+ * remove the returned handle from the vector before the next call.
+ */
+inline size_t wait_any(const std::vector<UploadHandle>& handles)
+{
+    auto first_done = [&handles]()
+    {
+        for (size_t i = 0; i < handles.size(); ++i)
+            if (handles[i].Valid() && handles[i].Done())
+                return i;
+        return handles.size();
+    };
+
+    size_t index = first_done();
+    if (index != handles.size())
+        return index;
+
+    auto waiter = std::make_shared<UploadHandle::AnyWaiter>();
+    size_t registered = 0;
+    bool any_valid = false;
+    for (; registered < handles.size(); ++registered)
+    {
+        if (!handles[registered].Valid())
+            continue;
+        any_valid = true;
+        if (handles[registered].AddAnyWaiter(waiter))
+            break;
+    }
+    const bool found = registered < handles.size();
+    if (!found && any_valid)
+    {
+        std::unique_lock<std::mutex> lock(waiter->mutex);
+        waiter->fired.wait(lock, [&waiter]() { return waiter->done; });
+    }
+    for (size_t i = 0; i < std::min(registered, handles.size()); ++i)
+        if (handles[i].Valid())
+            handles[i].RemoveAnyWaiter(waiter);
+    return first_done();
+}
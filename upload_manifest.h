@@ -0,0 +1,423 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include <aws/core/utils/HashingUtils.h>
+#include "mapped_file_stream.h"
+
+/**
+ * What was uploaded from one local file
+ */
+struct ManifestEntry
+{
+    std::string path;           // Local file
+    std::string target;         // bucket/key it was uploaded to
+    std::uint64_t size = 0;
+    std::int64_t mtime_ns = 0;
+    std::uint64_t inode = 0;
+    std::uint64_t content_hash = 0;     // CRC64NVME of the content
+    std::string etag;
+
+    // Whether file_stat still describes the file that was uploaded
+    bool Matches(const struct stat& file_stat) const
+    {
+        return size == static_cast<std::uint64_t>(file_stat.st_size) &&
+            mtime_ns == MtimeNs(file_stat) &&
+            inode == static_cast<std::uint64_t>(file_stat.st_ino);
+    }
+
+    static std::int64_t MtimeNs(const struct stat& file_stat)
+    {
+        return static_cast<std::int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 +
+            file_stat.st_mtim.tv_nsec;
+    }
+};
+
+/**
+ * Local record of the files uploaded so far, so that a later run skips the
+ * unchanged ones without a request to S3
+ *
+ * A file is unchanged if its size, modification time and inode, from one
+ * stat(), are those recorded for it and it goes to the same bucket/key;
+ * optionally, its content hash is checked too.
+ *
+ * The file is a header, then fixed-size records sorted by a hash of the
+ * path, then the strings they point to. It is mapped read-only and searched
+ * in place, so loading it takes the same time for 10M entries as for ten.
+ * Uploads recorded in this run are kept in memory, in front of the mapped
+ * records, until Save() merges both into a new file.
+ */
+class UploadManifest
+{
+public:
+    /**
+     * Load the manifest at path, if there is one
+     */
+    explicit UploadManifest(const std::string& path)
+        : m_path(path)
+    {
+        Load();
+    }
+
+    // Entries loaded and recorded
+    size_t Size() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_count + m_recorded.size();
+    }
+
+    /**
+     * Whether path was uploaded to target and has not changed since, by
+     * file_stat; with verify_hash, the content is hashed and compared too
+     */
+    bool Unchanged(const std::string& path, const std::string& target,
+        const struct stat& file_stat, bool verify_hash) const
+    {
+        ManifestEntry entry;
+        if (!Find(path, entry) || entry.target != target || !entry.Matches(file_stat))
+            return false;
+        return !verify_hash || ContentHash(path) == entry.content_hash;
+    }
+
+    /**
+     * Record that path, as described by file_stat, was uploaded to target
+     * and stored with etag, with its content_hash (see ContentHash() and
+     * ContentHashOf()). Thread-safe.
+     */
+    void Record(const std::string& path, const std::string& target,
+        const struct stat& file_stat, const std::string& etag, std::uint64_t content_hash)
+    {
+        ManifestEntry entry;
+        entry.path = path;
+        entry.target = target;
+        entry.size = static_cast<std::uint64_t>(file_stat.st_size);
+        entry.mtime_ns = ManifestEntry::MtimeNs(file_stat);
+        entry.inode = static_cast<std::uint64_t>(file_stat.st_ino);
+        entry.content_hash = content_hash;
+        entry.etag = etag;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_recorded[path] = std::move(entry);
+    }
+
+    /**
+     * CRC64NVME of the file at path (0 if it cannot be read); reads the
+     * whole file
+     */
+    static std::uint64_t ContentHash(const std::string& path)
+    {
+        auto file = MappedFile::Open(path);
+        if (!file)
+            return 0;
+        MappedFileStream body(file);
+        return FromDigest(Aws::Utils::HashingUtils::CalculateCRC64(body));
+    }
+
+    /**
+     * The content hash of a file from the base64 CRC64NVME S3 returned for
+     * its upload, as in the x-amz-checksum-crc64nvme header
+     */
+    static std::uint64_t ContentHashOf(const Aws::String& crc64nvme)
+    {
+        return FromDigest(Aws::Utils::HashingUtils::Base64Decode(crc64nvme));
+    }
+
+    /**
+     * Write the loaded and recorded entries to the manifest file, through a
+     * temporary file that replaces it; returns whether it was written
+     */
+    bool Save()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<std::pair<std::uint64_t, const ManifestEntry*>> recorded;
+        recorded.reserve(m_recorded.size());
+        for (auto& path_entry : m_recorded)
+            recorded.emplace_back(PathHash(path_entry.first), &path_entry.second);
+        std::sort(recorded.begin(), recorded.end(), [](const auto& a, const auto& b)
+            {
+                return Less(a.first, a.second->path, b.first, b.second->path);
+            });
+
+        const std::string temporary = m_path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios_base::binary | std::ios_base::trunc);
+            Writer writer(out);
+            // Merge the two sorted sequences; a recorded entry replaces the
+            // loaded one of its path
+            size_t loaded = 0;
+            auto next_recorded = recorded.begin();
+            while (loaded < m_count || next_recorded != recorded.end())
+            {
+                if (loaded < m_count && !InBounds(m_records[loaded]))
+                {
+                    ++loaded;
+                    continue;
+                }
+                if (next_recorded == recorded.end())
+                {
+                    writer.Add(m_records[loaded], LoadedStrings(loaded));
+                    ++loaded;
+                    continue;
+                }
+                const std::uint64_t hash = next_recorded->first;
+                const ManifestEntry& entry = *next_recorded->second;
+                if (loaded < m_count && Less(m_records[loaded].path_hash, LoadedPath(loaded),
+                    hash, entry.path))
+                {
+                    writer.Add(m_records[loaded], LoadedStrings(loaded));
+                    ++loaded;
+                    continue;
+                }
+                if (loaded < m_count && m_records[loaded].path_hash == hash &&
+                    LoadedPath(loaded) == entry.path)
+                    ++loaded;
+                writer.Add(Stored(hash, entry), entry.path + entry.target + entry.etag);
+                ++next_recorded;
+            }
+            if (!writer.Finish())
+            {
+                std::remove(temporary.c_str());
+                return false;
+            }
+        }
+        if (std::rename(temporary.c_str(), m_path.c_str()) != 0)
+            return false;
+
+        // Map the new file in place of the old one and the recorded entries
+        m_records = nullptr;
+        m_strings = nullptr;
+        m_strings_size = 0;
+        m_count = 0;
+        m_file.reset();
+        m_recorded.clear();
+        LoadLocked();
+        return true;
+    }
+
+private:
+    static constexpr char MAGIC[8] = { 'S', '3', 'M', 'A', 'N', 'I', 'F', '1' };
+
+    struct Header
+    {
+        char magic[8];
+        std::uint64_t count;
+    };
+
+    // One entry in the file
+    struct StoredEntry
+    {
+        std::uint64_t path_hash;
+        std::uint64_t size;
+        std::int64_t mtime_ns;
+        std::uint64_t inode;
+        std::uint64_t content_hash;
+        std::uint64_t strings_offset;   // path, then target, then etag
+        std::uint32_t path_length;
+        std::uint32_t target_length;
+        std::uint32_t etag_length;
+        std::uint32_t reserved;
+    };
+
+    // Writes records to a stream and appends their strings at the end
+    class Writer
+    {
+    public:
+        explicit Writer(std::ofstream& out) : m_out(out)
+        {
+            Header header{};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            m_out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+
+        // strings: the path, target and etag of record, one after another
+        void Add(StoredEntry record, std::string_view strings)
+        {
+            record.strings_offset = m_strings.size();
+            m_strings.append(strings.data(), strings.size());
+            m_out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+            ++m_count;
+        }
+
+        bool Finish()
+        {
+            m_out.write(m_strings.data(), static_cast<std::streamsize>(m_strings.size()));
+            Header header{};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.count = m_count;
+            m_out.seekp(0);
+            m_out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            m_out.flush();
+            return static_cast<bool>(m_out);
+        }
+
+    private:
+        std::ofstream& m_out;
+        std::string m_strings;
+        std::uint64_t m_count = 0;
+    };
+
+    // entry as stored, but for the offset of its strings
+    static StoredEntry Stored(std::uint64_t path_hash, const ManifestEntry& entry)
+    {
+        StoredEntry record{};
+        record.path_hash = path_hash;
+        record.size = entry.size;
+        record.mtime_ns = entry.mtime_ns;
+        record.inode = entry.inode;
+        record.content_hash = entry.content_hash;
+        record.path_length = static_cast<std::uint32_t>(entry.path.size());
+        record.target_length = static_cast<std::uint32_t>(entry.target.size());
+        record.etag_length = static_cast<std::uint32_t>(entry.etag.size());
+        return record;
+    }
+
+    // FNV-1a
+    static std::uint64_t PathHash(std::string_view path)
+    {
+        std::uint64_t hash = 0xcbf29ce484222325;
+        for (unsigned char c : path)
+            hash = (hash ^ c) * 0x100000001b3;
+        return hash;
+    }
+
+    // The big-endian digest as a number
+    static std::uint64_t FromDigest(const Aws::Utils::ByteBuffer& digest)
+    {
+        std::uint64_t hash = 0;
+        for (size_t i = 0; i < digest.GetLength(); ++i)
+            hash = hash << 8 | digest[i];
+        return hash;
+    }
+
+    static bool Less(std::uint64_t hash_a, std::string_view path_a, std::uint64_t hash_b,
+        std::string_view path_b)
+    {
+        return hash_a != hash_b ? hash_a < hash_b : path_a < path_b;
+    }
+
+    void Load()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        LoadLocked();
+    }
+
+    // Map the file and check that its records and strings are all there
+    void LoadLocked()
+    {
+        auto file = MappedFile::Open(m_path);
+        if (!file || file->Size() < sizeof(Header))
+            return;
+        Header header;
+        std::memcpy(&header, file->Data(), sizeof(header));
+        const std::uint64_t records_end = sizeof(Header) + header.count * sizeof(StoredEntry);
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            header.count > file->Size() / sizeof(StoredEntry) || records_end > file->Size())
+        {
+            std::cout << "Ignoring invalid upload manifest " << m_path << std::endl;
+            return;
+        }
+        m_file = std::move(file);
+        m_records = reinterpret_cast<const StoredEntry*>(m_file->Data() + sizeof(Header));
+        m_strings = m_file->Data() + records_end;
+        m_strings_size = m_file->Size() - records_end;
+        m_count = static_cast<size_t>(header.count);
+    }
+
+    // Whether the strings of a loaded record lie within the file; records
+    // that do not are treated as absent
+    bool InBounds(const StoredEntry& record) const
+    {
+        return record.strings_offset <= m_strings_size &&
+            std::uint64_t(record.path_length) + record.target_length + record.etag_length <=
+            m_strings_size - record.strings_offset;
+    }
+
+    std::string_view LoadedPath(size_t index) const
+    {
+        const StoredEntry& record = m_records[index];
+        return std::string_view(m_strings + record.strings_offset, record.path_length);
+    }
+
+    std::string_view LoadedStrings(size_t index) const
+    {
+        const StoredEntry& record = m_records[index];
+        return std::string_view(m_strings + record.strings_offset,
+            std::size_t(record.path_length) + record.target_length + record.etag_length);
+    }
+
+    ManifestEntry LoadedEntry(size_t index) const
+    {
+        const StoredEntry& record = m_records[index];
+        const char* strings = m_strings + record.strings_offset;
+        ManifestEntry entry;
+        entry.path.assign(strings, record.path_length);
+        entry.target.assign(strings + record.path_length, record.target_length);
+        entry.etag.assign(strings + record.path_length + record.target_length,
+            record.etag_length);
+        entry.size = record.size;
+        entry.mtime_ns = record.mtime_ns;
+        entry.inode = record.inode;
+        entry.content_hash = record.content_hash;
+        return entry;
+    }
+
+    bool Find(const std::string& path, ManifestEntry& entry) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto recorded = m_recorded.find(path);
+        if (recorded != m_recorded.end())
+        {
+            entry = recorded->second;
+            return true;
+        }
+
+        const std::uint64_t hash = PathHash(path);
+        const StoredEntry* end = m_records + m_count;
+        const StoredEntry* record = std::lower_bound(m_records, end, hash,
+            [](const StoredEntry& a, std::uint64_t b) { return a.path_hash < b; });
+        for (; record != end && record->path_hash == hash; ++record)
+        {
+            size_t index = static_cast<size_t>(record - m_records);
+            if (InBounds(*record) && LoadedPath(index) == path)
+            {
+                entry = LoadedEntry(index);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const std::string m_path;
+    mutable std::mutex m_mutex;
+    std::shared_ptr<const MappedFile> m_file;
+    const StoredEntry* m_records = nullptr;
+    const char* m_strings = nullptr;
+    std::uint64_t m_strings_size = 0;
+    size_t m_count = 0;
+    std::unordered_map<std::string, ManifestEntry> m_recorded;
+};
@@ -0,0 +1,94 @@
+/*
+   Copyright 2010-2019 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+
+   This file is licensed under the Apache License, Version 2.0 (the "License").
+   You may not use this file except in compliance with the License. A copy of
+   the License is located at
+
+    http://aws.amazon.com/apache2.0/
+
+   This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied. See the License for the
+   specific language governing permissions and limitations under the License.
+*/
+
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Process-wide threads, one per core, for CPU-bound work of the uploads
+ *
+ * Compressing blocks (BlockCompressor), hashing parts for local ETags
+ * (local_etag_async()) and hashing files for the manifest all run here.
+ * The pool is kept apart from the client's executor, whose threads block
+ * on the network, so that this work always has every core to itself.
+ */
+class WorkPool
+{
+public:
+    static WorkPool& Instance()
+    {
+        static WorkPool pool(std::max(std::thread::hardware_concurrency(), 1u));
+        return pool;
+    }
+
+    size_t Threads() const { return m_threads.size(); }
+
+    void Submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        m_changed.notify_one();
+    }
+
+    ~WorkPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_changed.notify_all();
+        for (std::thread& thread : m_threads)
+            thread.join();
+    }
+
+private:
+    explicit WorkPool(size_t threads)
+    {
+        for (size_t i = 0; i < threads; ++i)
+            m_threads.emplace_back([this]() { Run(); });
+    }
+
+    void Run()
+    {
+        for (;;)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_changed.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+                if (m_tasks.empty())
+                    return;
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_stopping = false;
+    std::vector<std::thread> m_threads;
+};